@@ -7,22 +7,61 @@ CONFIG -= qt
 # Turn this off to skip runtime info log
 DEFINES += LOG_RUNTIME_INFO
 
-include(ShaderCompiler.pri)
+# CONFIG+=shader_pack loads the shaders precompiled by tools/ShaderPackTool from shaders/shaders.pack,
+# glslang and the runtime shader compiler are then left out of the player
+shader_pack {
+    DEFINES += USE_SHADER_PACK
+} else {
+    include(ShaderCompiler.pri)
+
+    HEADERS += src/shadercompilerhelper.h
+    SOURCES += src/shadercompilerhelper.cpp
+}
 
 THE_FORGE_ROOT = $$PWD/The-Forge
 include($$THE_FORGE_ROOT/The-Cute-Forge.pri)
 
 # Sources
 HEADERS += \
+    src/AtomicFile.h \
+    src/FrameScheduler.h \
+    src/FrameTrace.h \
+    src/HAPAvFormatDemuxer.h \
+    src/HapBlockDecoder.h \
+    src/HapDecodePool.h \
     src/HAPAvFormatForgeRenderer.h \
-    src/hap/hap.h \
-    src/shadercompilerhelper.h
+    src/HAPAvFormatNullRenderer.h \
+    src/HAPAvFormatRenderer.h \
+    src/HAPPacketSource.h \
+    src/HAPStreamEngine.h \
+    src/HapMTDecode.h \
+    src/LatencyHistogram.h \
+    src/MappedFile.h \
+    src/PacketIndex.h \
+    src/PacketQueue.h \
+    src/PlaybackMetrics.h \
+    src/ShaderPack.h \
+    src/hap/hap.h
 
 SOURCES += \
+    src/AtomicFile.cpp \
+    src/FrameScheduler.cpp \
+    src/FrameTrace.cpp \
+    src/HAPAvFormatDemuxer.cpp \
     src/HAPAvFormatForgeRenderer.cpp \
+    src/HAPAvFormatNullRenderer.cpp \
+    src/HAPPacketSource.cpp \
+    src/HAPStreamEngine.cpp \
+    src/HapBlockDecoder.cpp \
+    src/HapDecodePool.cpp \
+    src/HapMTDecode.cpp \
+    src/LatencyHistogram.cpp \
+    src/MappedFile.cpp \
+    src/PacketIndex.cpp \
+    src/PlaybackMetrics.cpp \
+    src/ShaderPack.cpp \
     src/main.cpp \
-    src/hap/hap.c \
-    src/shadercompilerhelper.cpp
+    src/hap/hap.c
 
 EXECUTABLE_PATH = $${OUT_PWD}/$${TARGET}
 
@@ -133,49 +172,37 @@ windows {
 }
 
 linux {
-    # seems to be broken
-    CC = clang
-    CXX = clang
-    CFLAGS += -fblocks
-    CXXFLAGS += -fblocks
-
     # important flag ;-)
     DEFINES += Linux
 
     # Dependencies pathes
     # no change needed (works for me ...)
 
-    # Linux build is broken.
-    # Since the changes above don't work, you'll need to manually tweak the Makefile at the end
-    #
-    # clang IS mandatory to build HAPAvFormatOpenGLRenderer.cpp
-
-    # replace CC = gcc with the line : CC = clang
-    # replace CXX = g++ with the line : CXX = clang
-    # replace the line CFLAGS = -m64 -pipe     with the line : CFLAGS = -m64 -fblock -pipe
-    # replace the line CXXFLAGS = -m64 -pipe   with the line : CFLAGS = -m64 -fblock -pipe
-
-    # do not modify the LIBRARY_PATH. Should work without change anything
-
     # OpenGL
     LIBS += -lGL
 
-    # libpthread :
+    # libpthread : also runs the HAP decode thread pool
     LIBS +=  -lpthread
 
     # libdl :
     LIBS +=  -ldl
 
+    # SSSE3 kernels of the CPU block decoder, build with -mavx2 for the AVX2 YCoCg conversion
+    contains(QMAKE_HOST.arch, x86_64): QMAKE_CXXFLAGS += -mssse3
+
+    # liburing : io_uring packet source (--uring), left out when the library is missing or with CONFIG+=no_uring
+    CONFIG += link_pkgconfig
+    !no_uring:packagesExist(liburing) {
+        DEFINES += HAVE_LIBURING
+        HEADERS += src/UringPacketSource.h
+        SOURCES += src/UringPacketSource.cpp
+        PKGCONFIG += liburing
+    }
+
     # libsnappy
     SNAPPY_LIB_PATH = $${SNAPPY_PATH}/lib
     LIBS += -lsnappy
 
-    # libdispatch
-    LIBS += -ldispatch
-
-    # BlocksRuntime
-    LIBS += -lBlocksRuntime
-
     # ffmpeg :
     LIBS +=  `pkg-config --cflags --libs libavformat libavcodec libavutil`
 
@@ -195,7 +222,11 @@ linux {
 
 DISTFILES += \
     shaders/Default.frag \
+    shaders/Layer.frag \
+    shaders/LayerScaledCoCgY.frag \
+    shaders/LayerScaledCoCgYPlusA.frag \
     shaders/ScaledCoCgYPlusAToRGBA.frag \
     shaders/ScaledCoCgYToRGBA.frag \
-    shaders/Default.vert
+    shaders/Default.vert \
+    shaders/Layer.vert
 
@@ -1,9 +1,9 @@
-include(glslang.pri)
+include($$PWD/glslang.pri)
 
 SOURCES += \
     $$PWD/shadercompilerdefaults.cpp \
-    shadercompiler.cpp \
+    $$PWD/shadercompiler.cpp \
 
 HEADERS += \
     $$PWD/shadercompilerdefaults.h \
-    shadercompiler.h \
+    $$PWD/shadercompiler.h \
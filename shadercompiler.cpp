@@ -11,7 +11,10 @@
 #include "ThirdParty/OpenSource/SPIRV_Cross/spirv_glsl.hpp"
 #include "ThirdParty/OpenSource/SPIRV_Cross/spirv_hlsl.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <thread>
 namespace madam{
 template<typename T, typename... Args>
 std::unique_ptr<T> make_unique(Args&&... args) {
@@ -32,6 +35,14 @@ struct GLSLLangProcessRAII
     }
 };
 
+//Built-in symbol tables are built by the first compile and shared by the next ones until process exit
+//Initialization is thread safe (static local), glslang compiles can then run on several threads at once
+static void initializeGlslang()
+{
+    static GLSLLangProcessRAII processRAII;
+    (void)processRAII;
+}
+
 //NOTE: all spirv_cross compilers inherit from CompilerGLSL
 std::unique_ptr<spirv_cross::CompilerGLSL> createCompiler(ShaderCompiler::ConversionType conversionType, const std::vector<unsigned int>& spirv)
 {
@@ -200,11 +211,11 @@ static const char* g_attributes[] = {
     "BLENDWEIGHT"
 };
 
-ShaderCompiler::Result ShaderCompiler::compile(const ShaderCompiler::Input& input)
+//Front end: parses and links the source then generates SPIR-V, logs get the diagnostics
+static bool compileToSpirv(const ShaderCompiler::Input& input, std::vector<unsigned int>& spirv, std::string& logs)
 {
-    ShaderCompiler::Result result;
     //transform shader to spirv binary
-    GLSLLangProcessRAII processRAII;
+    initializeGlslang();
     glslang::TShader shader(stageToEShLanguage(input.stage));
     const char *source = input.sourceCode.c_str();
     shader.setStrings(&source, 1);
@@ -215,18 +226,17 @@ ShaderCompiler::Result ShaderCompiler::compile(const ShaderCompiler::Input& inpu
     shader.setEnvTarget(glslang::EShTargetSpv, glslang::EShTargetSpv_1_0);
     if (!shader.parse(&g_defaultConfiguration, 100, false, EShMsgDefault))
     {
-        result.logs = std::string(shader.getInfoLog());
-        return result;
+        logs = std::string(shader.getInfoLog());
+        return false;
     }
     glslang::TProgram program;
     program.addShader(&shader);
     if (!program.link(EShMsgDefault))
     {
-        result.logs = std::string(program.getInfoLog());
-        return result;
+        logs = std::string(program.getInfoLog());
+        return false;
     }
     //Source code is now validated, we can compile to whatever language we want
-    std::vector<unsigned int> spirv;
     spv::SpvBuildLogger logger;
     glslang::SpvOptions spvOptions;
     spvOptions.disableOptimizer = !input.optimize;
@@ -234,17 +244,25 @@ ShaderCompiler::Result ShaderCompiler::compile(const ShaderCompiler::Input& inpu
     spvOptions.disassemble = input.disassemble;
     spvOptions.validate = input.validate;
     glslang::GlslangToSpv(*program.getIntermediate(stageToEShLanguage(input.stage)), spirv, &logger, &spvOptions);
-    if ((input.conversionType == GLSL2SPV || input.conversionType == HLSL2SPV) || input.includeSpv)
+    logs = logger.getAllMessages();
+    return true;
+}
+
+//Back end: converts the SPIR-V module to the target language of input
+static void crossCompile(const ShaderCompiler::Input& input, const std::vector<unsigned int>& spirv, const std::string& logs,
+                         ShaderCompiler::Result& result)
+{
+    result.logs = logs;
+    if ((input.conversionType == ShaderCompiler::GLSL2SPV || input.conversionType == ShaderCompiler::HLSL2SPV) || input.includeSpv)
     {
         result.spirv = spirv;
-        if (input.conversionType == GLSL2SPV || input.conversionType == HLSL2SPV)
+        if (input.conversionType == ShaderCompiler::GLSL2SPV || input.conversionType == ShaderCompiler::HLSL2SPV)
         {
             //Conversion stops here
             result.success = 1;
-            return result;
+            return;
         }
     }
-    result.logs = logger.getAllMessages();
 
     auto compiler = createCompiler(input.conversionType, spirv);
     // Set some options.
@@ -276,7 +294,7 @@ ShaderCompiler::Result ShaderCompiler::compile(const ShaderCompiler::Input& inpu
             hlsl_compiler->add_vertex_attribute_remap(remap);
         }
     }
-    else if (isMSLTarget(input.conversionType) && input.stage == STAGE_VERTEX)
+    else if (isMSLTarget(input.conversionType) && input.stage == ShaderCompiler::STAGE_VERTEX)
     {
         //Reset vertex input locations
         for (size_t i = 0; i < ress.stage_inputs.size(); i++) {
@@ -306,5 +324,177 @@ ShaderCompiler::Result ShaderCompiler::compile(const ShaderCompiler::Input& inpu
 
     result.outputCode = compiler->compile();
     result.success = true;
+}
+
+ShaderCompiler::Result ShaderCompiler::compile(const ShaderCompiler::Input& input)
+{
+    ShaderCompiler::Result result;
+    std::vector<unsigned int> spirv;
+    std::string logs;
+    if (!compileToSpirv(input, spirv, logs))
+    {
+        result.logs = logs;
+        return result;
+    }
+    crossCompile(input, spirv, logs, result);
     return result;
 }
+
+static bool sameSourceLanguage(ShaderCompiler::ConversionType a, ShaderCompiler::ConversionType b)
+{
+    return sourceFromConversionType(a) == sourceFromConversionType(b);
+}
+
+//Runs the front end of input once then its back ends, on one thread per target when parallel is set
+static void compileShaderTargets(const ShaderCompiler::Input& input, const ShaderCompiler::Target* targets, const unsigned int count,
+                                 ShaderCompiler::Result* results, bool parallel)
+{
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (!sameSourceLanguage(input.conversionType, targets[i].conversionType))
+        {
+            results[i].errors = "Target does not take the source language of the input";
+            return;
+        }
+    }
+
+    std::vector<unsigned int> spirv;
+    std::string logs;
+    try
+    {
+        if (!compileToSpirv(input, spirv, logs))
+        {
+            for (unsigned int i = 0; i < count; i++)
+            {
+                results[i].logs = logs;
+            }
+            return;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        for (unsigned int i = 0; i < count; i++)
+        {
+            results[i].errors = e.what();
+        }
+        return;
+    }
+    catch (...)
+    {
+        for (unsigned int i = 0; i < count; i++)
+        {
+            results[i].errors = "Exception while compiling";
+        }
+        return;
+    }
+
+    //Every back end reads the same module
+    auto work = [&](unsigned int i)
+    {
+        ShaderCompiler::Input targetInput = input;
+        targetInput.conversionType = targets[i].conversionType;
+        targetInput.entryPoint = targets[i].entryPoint;
+        try
+        {
+            crossCompile(targetInput, spirv, logs, results[i]);
+        }
+        catch (const std::exception& e)
+        {
+            results[i].errors = e.what();
+        }
+        catch (...)
+        {
+            results[i].errors = "Exception while compiling";
+        }
+    };
+    if (!parallel)
+    {
+        for (unsigned int i = 0; i < count; i++)
+        {
+            work(i);
+        }
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < count; i++)
+    {
+        threads.emplace_back(work, i);
+    }
+    if (count > 0)
+    {
+        work(0);
+    }
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+std::vector<ShaderCompiler::Result> ShaderCompiler::compileTargets(const Input& input, const Target* targets, const unsigned int count)
+{
+    std::vector<Result> results(count);
+    compileShaderTargets(input, targets, count, results.data(), true);
+    return results;
+}
+
+void ShaderCompiler::compileTargetsBatch(const Input* inputs, const unsigned int inputCount,
+                                         const Target* targets, const unsigned int targetCount,
+                                         Result* results, unsigned int threadCount)
+{
+    if (threadCount == 0)
+    {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threadCount = std::min<unsigned int>(threadCount, inputCount);
+
+    // Each thread takes the next shader until none is left and runs its back ends in turn, the calling thread compiles too
+    std::atomic<unsigned int> next(0);
+    auto work = [&]()
+    {
+        for (unsigned int i = next++; i < inputCount; i = next++)
+        {
+            compileShaderTargets(inputs[i], targets, targetCount, &results[i * targetCount], false);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < threadCount; i++)
+    {
+        threads.emplace_back(work);
+    }
+    work();
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+void ShaderCompiler::compileBatch(const ShaderCompiler::Input* inputs, ShaderCompiler::Result* results,
+                                  const unsigned int count, unsigned int threadCount)
+{
+    if (threadCount == 0)
+    {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threadCount = std::min<unsigned int>(threadCount, count);
+
+    // Each thread takes the next shader until none is left, the calling thread compiles too
+    std::atomic<unsigned int> next(0);
+    auto work = [&]()
+    {
+        ShaderCompiler compiler;
+        for (unsigned int i = next++; i < count; i = next++)
+        {
+            results[i] = compiler(inputs[i]);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < threadCount; i++)
+    {
+        threads.emplace_back(work);
+    }
+    work();
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
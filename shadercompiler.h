@@ -62,8 +62,29 @@ public:
         bool useOpenglES = false;
     };
 
+    struct Target
+    {
+        ConversionType conversionType;
+        std::string entryPoint;
+    };
+
     Result operator()(const Input&);
     Result compile(const Input&);
+
+    // Runs the front end (parse, link, SPIR-V) once then one SPIRV-Cross back end per target in parallel
+    // Targets must take the source language of input.conversionType, results[i] is the result for targets[i]
+    static std::vector<Result> compileTargets(const Input& input, const Target* targets, const unsigned int count);
+
+    // Runs compileTargets for every input on up to threadCount threads (0 for one per hardware thread), each thread
+    // taking the next input and running its back ends in turn
+    // results[i * targetCount + j] is the result of inputs[i] for targets[j]
+    static void compileTargetsBatch(const Input* inputs, const unsigned int inputCount,
+                                    const Target* targets, const unsigned int targetCount,
+                                    Result* results, unsigned int threadCount = 0);
+
+    // Compiles every input concurrently on up to threadCount threads (0 for one per hardware thread)
+    // results[i] is the result of inputs[i]
+    static void compileBatch(const Input* inputs, Result* results, const unsigned int count, unsigned int threadCount = 0);
 };
 
 
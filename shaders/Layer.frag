@@ -0,0 +1,18 @@
+#version 450 core
+
+layout (binding = 0) uniform sampler2D cocgsy_src;
+
+in vec2 uv;
+in float opacity;
+
+out vec4 colorOut;
+
+void main()
+{
+    vec4 rgba = texture(cocgsy_src, uv);
+
+    // Premultiplied alpha, as the compositor blend modes expect
+    float alpha = rgba.a * opacity;
+
+    colorOut = vec4(rgba.rgb * alpha, alpha);
+}
@@ -0,0 +1,15 @@
+#version 450 core
+
+in vec3 aPos;
+in vec2 aUv;
+in float aOpacity;
+
+out vec2 uv;
+out float opacity;
+
+void main()
+{
+        gl_Position = vec4(aPos.x, aPos.y, aPos.z, 1.0);
+        uv = aUv;
+        opacity = aOpacity;
+}
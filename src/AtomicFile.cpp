@@ -0,0 +1,55 @@
+#include "AtomicFile.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#ifdef _WIN32
+    #include <process.h>
+    #include <windows.h>
+#else
+    #include <unistd.h>
+#endif
+
+static bool holdsContent(const std::string& path, const void* data, size_t size)
+{
+    std::FILE* fp = std::fopen(path.c_str(), "rb");
+    if (!fp)
+        return false;
+    // One byte more to tell a longer file apart
+    std::vector<char> content(size + 1);
+    size_t contentSize = std::fread(content.data(), 1, content.size(), fp);
+    std::fclose(fp);
+    return contentSize == size && !memcmp(content.data(), data, size);
+}
+
+bool writeFileAtomically(const std::string& path, const void* data, size_t size)
+{
+    // Unique per process and per call, writers of the same file never share their temporary file
+    static std::atomic<unsigned int> s_writeCount{0};
+    #ifdef _WIN32
+        int pid = _getpid();
+    #else
+        int pid = (int)getpid();
+    #endif
+    std::string tempPath = path + "." + std::to_string(pid) + "." + std::to_string(s_writeCount++) + ".tmp";
+
+    std::FILE* fp = std::fopen(tempPath.c_str(), "wb");
+    if (!fp)
+        return false;
+    bool success = std::fwrite(data, 1, size, fp) == size;
+    success = std::fclose(fp) == 0 && success;
+    // rename replaces the file atomically on POSIX, Windows needs MoveFileEx to replace an existing file
+    #ifdef _WIN32
+        success = success && MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+    #else
+        success = success && std::rename(tempPath.c_str(), path.c_str()) == 0;
+    #endif
+    if (!success)
+    {
+        std::remove(tempPath.c_str());
+        return holdsContent(path, data, size);
+    }
+    return true;
+}
@@ -0,0 +1,12 @@
+#ifndef ATOMICFILE_H
+#define ATOMICFILE_H
+
+#include <cstddef>
+#include <string>
+
+// Writes size bytes to a file named after path and this process, then renames it over path so readers never see
+// a partial file. When the rename fails because another process replaced path at the same time, succeeds if path
+// now holds the same bytes
+bool writeFileAtomically(const std::string& path, const void* data, size_t size);
+
+#endif // ATOMICFILE_H
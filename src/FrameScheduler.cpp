@@ -0,0 +1,111 @@
+#include "FrameScheduler.h"
+
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+using namespace std::chrono;
+
+// Below this, OS sleeps are too coarse and we spin instead
+#define SCHEDULER_SPIN_MARGIN_MS 2.0
+// Frame duration assumed when a packet doesn't carry one
+#define SCHEDULER_DEFAULT_FRAME_DURATION_MS (1000.0 / 30.0)
+// Lateness after which dropping frames is not worth it anymore and the timeline restarts from now
+// (stalled I/O, debugger, window dragged...)
+#define SCHEDULER_RESYNC_THRESHOLD_MS 500.0
+
+FrameScheduler::FrameScheduler(AVRational timeBase, LatePolicy latePolicy)
+    :m_timeBase(timeBase),
+     m_latePolicy(latePolicy)
+{
+}
+
+double FrameScheduler::nowMs()
+{
+    duration<double, std::milli> time_span = duration_cast<duration<double, std::milli>>(steady_clock::now().time_since_epoch());
+    return time_span.count();
+}
+
+void FrameScheduler::rebase(int64_t pts, double timeMs)
+{
+    m_anchorPts = pts;
+    m_anchorTimeMs = timeMs;
+    if (m_anchored)
+        m_rebaseCount++;
+    m_anchored = true;
+}
+
+double FrameScheduler::presentationTimeMs(const AVPacket* packet)
+{
+    double durationMs = packet->duration > 0 ? packet->duration * av_q2d(m_timeBase) * 1000.0 : m_lastDurationMs;
+    if (durationMs <= 0)
+        durationMs = SCHEDULER_DEFAULT_FRAME_DURATION_MS;
+
+    int64_t pts = packet->pts;
+    if (pts == AV_NOPTS_VALUE)
+        pts = packet->dts;
+    if (pts == AV_NOPTS_VALUE)
+        pts = m_lastPts + (int64_t)llround(m_lastDurationMs / (av_q2d(m_timeBase) * 1000.0));
+
+    if (!m_anchored)
+    {
+        rebase(pts, nowMs());
+    }
+    else if (pts <= m_lastPts)
+    {
+        // Looped or seeked backward: continue right after the previous frame
+        rebase(pts, m_lastPresentationTimeMs + m_lastDurationMs);
+    }
+
+    // Derived from pts rather than accumulated durations so rounding never drifts
+    double presentationTimeMs = m_anchorTimeMs + (pts - m_anchorPts) * av_q2d(m_timeBase) * 1000.0;
+
+    m_lastPts = pts;
+    m_lastPresentationTimeMs = presentationTimeMs;
+    m_lastDurationMs = durationMs;
+    return presentationTimeMs;
+}
+
+bool FrameScheduler::shouldDrop(double& presentationTimeMs, bool newerFrameQueued)
+{
+    double now = nowMs();
+    double lateMs = now - presentationTimeMs;
+    if (m_latePolicy == LATE_POLICY_LATEST)
+    {
+        // Every HAP frame is an intra frame, skipping one costs nothing but its read
+        // Once the next frame is due this one would be replaced right away, unless it is the last one read
+        if (lateMs > m_lastDurationMs && newerFrameQueued)
+        {
+            m_droppedFrames++;
+            return true;
+        }
+        return false;
+    }
+    if (lateMs > SCHEDULER_RESYNC_THRESHOLD_MS)
+    {
+        // Too far behind to catch up by dropping, restart the timeline on this frame
+        rebase(m_lastPts, now);
+        m_lastPresentationTimeMs = now;
+        presentationTimeMs = now;
+        return false;
+    }
+    if (m_latePolicy == LATE_POLICY_DROP && lateMs > m_lastDurationMs)
+    {
+        m_droppedFrames++;
+        return true;
+    }
+    return false;
+}
+
+void FrameScheduler::waitUntil(double timeMs) const
+{
+    double remainingMs = timeMs - nowMs();
+    if (remainingMs > SCHEDULER_SPIN_MARGIN_MS)
+    {
+        std::this_thread::sleep_for(duration<double, std::milli>(remainingMs - SCHEDULER_SPIN_MARGIN_MS));
+    }
+    while (nowMs() < timeMs)
+    {
+        std::this_thread::yield();
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef FRAMESCHEDULER_H
+#define FRAMESCHEDULER_H
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+}
+
+#include <cstddef>
+
+// Paces presentation on a timeline derived from packet pts and the stream time base,
+// measured with steady_clock so it never jumps with wall time adjustments
+class FrameScheduler
+{
+public:
+    enum LatePolicy
+    {
+        LATE_POLICY_PRESENT, // Present late frames right away and catch up on the following ones
+        LATE_POLICY_DROP,    // Skip frames that are more than one frame late
+        LATE_POLICY_LATEST,  // Skip every frame a newer queued one replaces, and never give up on the timeline
+    };
+
+    FrameScheduler(AVRational timeBase, LatePolicy latePolicy = LATE_POLICY_DROP);
+
+    // Steady clock time in milliseconds
+    static double nowMs();
+
+    // Returns the time at which packet should be presented
+    // The timeline is anchored on the first packet and rebased on pts discontinuities (loops, seeks)
+    double presentationTimeMs(const AVPacket* packet);
+
+    // Returns true if the frame last scheduled at presentationTimeMs must be skipped according to the late policy
+    // newerFrameQueued tells if the frame after it is already read, the latest policy never skips the last frame read
+    // When playback is too far behind the timeline restarts on this frame and presentationTimeMs is moved to now,
+    // except with the latest policy which drops frames until it is back on time
+    bool shouldDrop(double& presentationTimeMs, bool newerFrameQueued = true);
+
+    // The next packet is presented right away and starts a new timeline (after a seek)
+    void restart() { m_anchored = false; }
+
+    // Sleeps most of the way and spins the last 2 ms, the usual sleep overshoot, to hit timeMs precisely
+    void waitUntil(double timeMs) const;
+
+    size_t droppedFrames() const { return m_droppedFrames; }
+    size_t rebaseCount() const { return m_rebaseCount; }
+
+private:
+    void rebase(int64_t pts, double timeMs);
+
+    AVRational m_timeBase;
+    LatePolicy m_latePolicy;
+
+    bool m_anchored = false;
+    int64_t m_anchorPts = 0;
+    double m_anchorTimeMs = 0;
+
+    int64_t m_lastPts = 0;
+    double m_lastPresentationTimeMs = 0;
+    double m_lastDurationMs = 0;
+
+    size_t m_droppedFrames = 0;
+    size_t m_rebaseCount = 0;
+};
+
+#endif // FRAMESCHEDULER_H
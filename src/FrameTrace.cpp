@@ -0,0 +1,179 @@
+#include "FrameTrace.h"
+
+#include <chrono>
+#include <cstring>
+
+#include "PlaybackMetrics.h"
+
+// Time the writer sleeps when the ring is empty
+#define TRACE_WRITER_SLEEP_MS 10
+
+static const char* g_stageNames[FrameTrace::STAGE_COUNT] =
+{
+    "demux",
+    "decompress",
+    "upload",
+    "record",
+    "submit",
+    "present",
+};
+
+std::atomic<FrameTrace*> FrameTrace::s_active(nullptr);
+const char* FrameTrace::s_error = nullptr;
+std::atomic<int> FrameTrace::s_stageConsumers(0);
+
+int FrameTrace::start(const char* path, size_t capacity)
+{
+    if (active())
+    {
+        s_error = "Trace already started";
+        return -1;
+    }
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        s_error = "Couldn't create trace file";
+        return -1;
+    }
+    size_t length = strlen(path);
+    bool chromeTrace = length >= 5 && !strcmp(path + length - 5, ".json");
+    s_active.store(new FrameTrace(file, chromeTrace, capacity), std::memory_order_release);
+    s_stageConsumers.fetch_add(1, std::memory_order_release);
+    return 0;
+}
+
+void FrameTrace::stop()
+{
+    FrameTrace* trace = s_active.exchange(nullptr, std::memory_order_acq_rel);
+    if (!trace)
+        return;
+    s_stageConsumers.fetch_sub(1, std::memory_order_release);
+    if (trace->droppedRecords())
+        fprintf(stderr, "Frame trace: %lu records dropped, the writer fell behind\n",
+                static_cast<unsigned long>(trace->droppedRecords()));
+    delete trace;
+}
+
+FrameTrace::FrameTrace(FILE* file, bool chromeTrace, size_t capacity)
+    : m_file(file)
+    , m_chromeTrace(chromeTrace)
+    , m_startTimeMs(FrameScheduler::nowMs())
+    , m_head(0)
+    , m_tail(0)
+    , m_droppedRecords(0)
+    , m_stopping(false)
+{
+    size_t ringSize = 1;
+    while (ringSize < capacity)
+        ringSize <<= 1;
+    m_records.resize(ringSize);
+    m_mask = ringSize - 1;
+    memset(&m_current, 0, sizeof(m_current));
+
+    if (m_chromeTrace)
+        fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", m_file);
+    m_writer = std::thread(&FrameTrace::writerMain, this);
+}
+
+FrameTrace::~FrameTrace()
+{
+    m_stopping.store(true, std::memory_order_release);
+    m_writer.join();
+    if (m_chromeTrace)
+        fputs("\n]}\n", m_file);
+    fclose(m_file);
+}
+
+void FrameTrace::beginFrame()
+{
+    memset(&m_current, 0, sizeof(m_current));
+    m_current.frame = m_frameCount;
+    m_inFrame = true;
+}
+
+void FrameTrace::recordStage(Stage stage, double startMs, double endMs)
+{
+    FrameTrace* trace = active();
+    if (trace)
+        trace->addStage(stage, startMs, endMs - startMs);
+    PlaybackMetrics* metrics = PlaybackMetrics::active();
+    if (metrics)
+        metrics->recordStage(stage, endMs - startMs);
+}
+
+void FrameTrace::addStage(Stage stage, double startMs, double durationMs)
+{
+    // A stage running several times in a frame (one per texture) starts with its first run
+    if (m_current.stageStartMs[stage] == 0)
+        m_current.stageStartMs[stage] = startMs;
+    m_current.stageDurationMs[stage] += durationMs;
+}
+
+void FrameTrace::endFrame()
+{
+    if (!m_inFrame)
+        return;
+    m_inFrame = false;
+    m_frameCount++;
+
+    size_t head = m_head.load(std::memory_order_relaxed);
+    if (head - m_tail.load(std::memory_order_acquire) > m_mask)
+    {
+        m_droppedRecords.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    m_records[head & m_mask] = m_current;
+    m_head.store(head + 1, std::memory_order_release);
+}
+
+void FrameTrace::writerMain()
+{
+    for (;;)
+    {
+        // Read the stop flag first so records pushed before stop() are all written
+        bool stopping = m_stopping.load(std::memory_order_acquire);
+        if (!writeRecords())
+        {
+            if (stopping)
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(TRACE_WRITER_SLEEP_MS));
+        }
+    }
+    fflush(m_file);
+}
+
+bool FrameTrace::writeRecords()
+{
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    size_t head = m_head.load(std::memory_order_acquire);
+    if (tail == head)
+        return false;
+    for (; tail != head; tail++)
+    {
+        writeRecord(m_records[tail & m_mask]);
+        // Hand the slot back right away so a slow file doesn't make the playback thread drop records
+        m_tail.store(tail + 1, std::memory_order_release);
+    }
+    return true;
+}
+
+void FrameTrace::writeRecord(const Record& record)
+{
+    if (!m_chromeTrace)
+    {
+        fwrite(&record, sizeof(record), 1, m_file);
+        return;
+    }
+    // One complete event per stage, in microseconds from the start of the trace
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        if (record.stageStartMs[stage] == 0)
+            continue;
+        fprintf(m_file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3lf,\"dur\":%.3lf,"
+                        "\"args\":{\"frame\":%llu,\"presentation_ms\":%.3lf}}",
+                m_firstEvent ? "" : ",\n", g_stageNames[stage],
+                (record.stageStartMs[stage] - m_startTimeMs) * 1000.0, record.stageDurationMs[stage] * 1000.0,
+                static_cast<unsigned long long>(record.frame), record.presentationTimeMs - m_startTimeMs);
+        m_firstEvent = false;
+    }
+}
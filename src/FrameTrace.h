@@ -0,0 +1,140 @@
+#ifndef FRAMETRACE_H
+#define FRAMETRACE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "FrameScheduler.h"
+
+// Timings of the playback stages of every frame, taken on the playback thread without locks nor I/O
+// Each frame is one record pushed to a ring, a background thread drains the ring into a file:
+// a Chrome trace (path ending with .json, opens in chrome://tracing or Perfetto) or raw FrameTrace::Record
+// Stage timings also feed PlaybackMetrics, when both are off timing a stage costs a load and a branch
+class FrameTrace
+{
+public:
+    enum Stage
+    {
+        STAGE_DEMUX,        // Getting the packet from the demux queue
+        STAGE_DECOMPRESS,   // HapDecode of the textures
+        STAGE_UPLOAD,       // Texture updates, decompression included when decoding into upload memory
+        STAGE_RECORD,       // Command buffer recording, swapchain image acquire included
+        STAGE_SUBMIT,
+        STAGE_PRESENT,
+        STAGE_COUNT
+    };
+
+    struct Record
+    {
+        // Frames traced before this one
+        uint64_t frame;
+        double presentationTimeMs;
+        // Start of each stage on the FrameScheduler::nowMs clock and its total time, 0 when it didn't run
+        double stageStartMs[STAGE_COUNT];
+        double stageDurationMs[STAGE_COUNT];
+    };
+
+    // Times stages of the current frame for the trace and the playback metrics, does nothing when both are off
+    class StageTimer
+    {
+    public:
+        void begin(Stage stage)
+        {
+            m_timing = s_stageConsumers.load(std::memory_order_acquire) > 0;
+            if (m_timing)
+            {
+                m_stage = stage;
+                m_startMs = FrameScheduler::nowMs();
+            }
+        }
+        void end()
+        {
+            if (m_timing)
+                recordStage(m_stage, m_startMs, FrameScheduler::nowMs());
+            m_timing = false;
+        }
+
+    private:
+        bool m_timing = false;
+        Stage m_stage = STAGE_DEMUX;
+        double m_startMs = 0;
+    };
+
+    // Times a stage from construction to destruction
+    class Scope
+    {
+    public:
+        explicit Scope(Stage stage) { m_timer.begin(stage); }
+        ~Scope() { m_timer.end(); }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        StageTimer m_timer;
+    };
+
+    // Starts tracing into path with room for capacity records (rounded up to a power of 2) not written yet
+    // Returns 0 on success, or -1 with the reason in get_error()
+    static int start(const char* path, size_t capacity = 4096);
+    // Writes the remaining records and closes the file, call once playback stopped
+    static void stop();
+    static const char* get_error() { return s_error; }
+
+    // Trace in progress, or nullptr when tracing is off
+    static FrameTrace* active() { return s_active.load(std::memory_order_acquire); }
+
+    // Stages and frames are timed by the playback thread only
+    static void recordStage(Stage stage, double startMs, double endMs);
+
+    // Starts the record of a new frame, an unfinished previous record is discarded
+    void beginFrame();
+    void setPresentationTime(double presentationTimeMs) { m_current.presentationTimeMs = presentationTimeMs; }
+    // Pushes the record to the ring, it is dropped when the writer fell behind
+    void endFrame();
+
+    size_t droppedRecords() const { return m_droppedRecords.load(std::memory_order_relaxed); }
+
+private:
+    friend class PlaybackMetrics;
+
+    FrameTrace(FILE* file, bool chromeTrace, size_t capacity);
+    ~FrameTrace();
+
+    void addStage(Stage stage, double startMs, double durationMs);
+
+    void writerMain();
+    // Writes the records pushed since the last call, returns false when there was none
+    bool writeRecords();
+    void writeRecord(const Record& record);
+
+    static std::atomic<FrameTrace*> s_active;
+    static const char* s_error;
+    // Number of started FrameTrace and PlaybackMetrics
+    static std::atomic<int> s_stageConsumers;
+
+    FILE* m_file;
+    bool m_chromeTrace;
+    bool m_firstEvent = true;
+    double m_startTimeMs;
+
+    // Single producer single consumer ring, m_head is written by the playback thread, m_tail by the writer
+    std::vector<Record> m_records;
+    size_t m_mask;
+    std::atomic<size_t> m_head;
+    std::atomic<size_t> m_tail;
+    std::atomic<size_t> m_droppedRecords;
+
+    Record m_current;
+    bool m_inFrame = false;
+    uint64_t m_frameCount = 0;
+
+    std::atomic<bool> m_stopping;
+    std::thread m_writer;
+};
+
+#endif // FRAMETRACE_H
@@ -0,0 +1,316 @@
+#include "HAPAvFormatDemuxer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#if defined(_WIN32)
+    #include <malloc.h>
+#endif
+
+// How long the demux thread backs off when the queue is over budget or the source is busy
+#define DEMUX_FULL_QUEUE_SLEEP_US 500
+// Consecutive read errors after which the demuxer gives up on the stream
+#define DEMUX_MAX_READ_ERRORS 8
+
+HAPAvFormatDemuxer::HAPAvFormatDemuxer(HAPPacketSource* source, const PacketIndex* index,
+                                       size_t maxQueuedPackets, size_t maxQueuedBytes,
+                                       bool loop)
+    :m_source(source),
+     m_index(index),
+     m_loop(loop),
+     m_queue(maxQueuedPackets, maxQueuedBytes)
+{
+}
+
+HAPAvFormatDemuxer::~HAPAvFormatDemuxer()
+{
+    stop();
+    for (AVPacket* packet : m_loopCache)
+        av_packet_free(&packet);
+}
+
+void* HAPAvFormatDemuxer::operator new(size_t size)
+{
+    void* p = nullptr;
+    #if defined(_WIN32)
+        p = _aligned_malloc(size, alignof(HAPAvFormatDemuxer));
+    #else
+        if (posix_memalign(&p, alignof(HAPAvFormatDemuxer), size) != 0)
+            p = nullptr;
+    #endif
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void HAPAvFormatDemuxer::operator delete(void* p)
+{
+    #if defined(_WIN32)
+        _aligned_free(p);
+    #else
+        free(p);
+    #endif
+}
+
+bool HAPAvFormatDemuxer::setLoopRange(size_t inFrame, size_t outFrame, size_t cachedFrames)
+{
+    if (!m_index || inFrame > outFrame || outFrame >= m_index->size())
+        return false;
+    m_loopIn = inFrame;
+    m_loopOut = outFrame;
+    m_loopCacheFrames = std::min(cachedFrames, outFrame - inFrame + 1);
+    return true;
+}
+
+void HAPAvFormatDemuxer::start()
+{
+    if (m_running)
+        return;
+    m_running = true;
+    m_thread = std::thread(&HAPAvFormatDemuxer::run, this);
+}
+
+void HAPAvFormatDemuxer::stop()
+{
+    m_running = false;
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+AVPacket* HAPAvFormatDemuxer::popPacket()
+{
+    int serial;
+    AVPacket* packet = m_queue.pop(&serial);
+    while (packet && serial != m_serial)
+    {
+        // Read before the last seek
+        av_packet_free(&packet);
+        packet = m_queue.pop(&serial);
+    }
+    if (!packet)
+    {
+        // Count each period without packets once
+        if (!m_starving)
+            m_starvationCount++;
+        m_starving = true;
+        return nullptr;
+    }
+    m_starving = false;
+    return packet;
+}
+
+void HAPAvFormatDemuxer::releasePacket(AVPacket* packet)
+{
+    av_packet_free(&packet);
+}
+
+bool HAPAvFormatDemuxer::seekToFrame(size_t frame)
+{
+    if (!m_index || frame >= m_index->size())
+        return false;
+    std::lock_guard<std::mutex> lock(m_seekMutex);
+    m_serial++;
+    m_seekFrame = frame;
+    m_seekSerial = m_serial;
+    m_seekPending = true;
+    return true;
+}
+
+bool HAPAvFormatDemuxer::seekToTime(double seconds)
+{
+    if (!m_index || m_index->empty())
+        return false;
+    return seekToFrame(m_index->entryAtTime(seconds));
+}
+
+std::string HAPAvFormatDemuxer::get_error() const
+{
+    std::lock_guard<std::mutex> lock(m_errorMutex);
+    return m_error;
+}
+
+// Stops reading on error, until the next seek
+void HAPAvFormatDemuxer::fail(int error)
+{
+    char message[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(error, message, sizeof(message));
+    {
+        std::lock_guard<std::mutex> lock(m_errorMutex);
+        m_error = message;
+    }
+    m_failed = true;
+    m_endOfStream = true;
+}
+
+void HAPAvFormatDemuxer::fillLoopCache()
+{
+    // Without the cache the wrap seeks to the in point, which reports the error if it fails again
+    int res = m_source->seekToEntry(m_loopIn);
+    if (res < 0)
+        return;
+    AVPacket* packet = av_packet_alloc();
+    while (m_running && m_loopCache.size() < m_loopCacheFrames)
+    {
+        int res = m_source->readPacket(packet);
+        if (res == AVERROR(EAGAIN))
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(DEMUX_FULL_QUEUE_SLEEP_US));
+            continue;
+        }
+        if (res < 0)
+            break;
+        AVPacket* copy = av_packet_alloc();
+        if (av_new_packet(copy, packet->size) < 0)
+        {
+            av_packet_free(&copy);
+            break;
+        }
+        memcpy(copy->data, packet->data, packet->size);
+        av_packet_copy_props(copy, packet);
+        m_loopCache.push_back(copy);
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    res = m_source->seekToEntry(0);
+    if (res < 0)
+        fail(res);
+}
+
+void HAPAvFormatDemuxer::run()
+{
+    bool gapless = gaplessLoop();
+    int64_t loopDuration = 0;
+    if (gapless)
+    {
+        fillLoopCache();
+        const PacketIndex::Entry& out = (*m_index)[m_loopOut];
+        loopDuration = out.pts + out.duration - (*m_index)[m_loopIn].pts;
+    }
+
+    AVPacket* packet = nullptr;
+    int serial = 0;
+    // Index entry of the next packet read from the source
+    size_t nextEntry = 0;
+    // Position in the loop cache while replaying it, cache size otherwise
+    size_t replayed = m_loopCache.size();
+    // Added to pts of looped packets so the timeline keeps going forward
+    int64_t ptsOffset = 0;
+    int readErrors = 0;
+    while (m_running)
+    {
+        if (m_seekPending)
+        {
+            std::lock_guard<std::mutex> lock(m_seekMutex);
+            av_packet_free(&packet);
+            serial = m_seekSerial;
+            nextEntry = m_seekFrame;
+            replayed = m_loopCache.size();
+            ptsOffset = 0;
+            readErrors = 0;
+            m_endOfStream = false;
+            m_failed = false;
+            int res = m_source->seekToEntry(m_seekFrame);
+            if (res < 0)
+                fail(res);
+            m_seekPending = false;
+        }
+        if (m_endOfStream)
+        {
+            // Wait for a seek
+            std::this_thread::sleep_for(std::chrono::microseconds(DEMUX_FULL_QUEUE_SLEEP_US));
+            continue;
+        }
+        if (!packet)
+        {
+            if (replayed < m_loopCache.size())
+            {
+                packet = av_packet_clone(m_loopCache[replayed++]);
+                // The cached frames cover the seek to the rest of the loop
+                if (replayed == m_loopCache.size() && nextEntry <= m_loopOut)
+                {
+                    int res = m_source->seekToEntry(nextEntry);
+                    if (res < 0)
+                        fail(res);
+                }
+            }
+            else if (gapless && nextEntry > m_loopOut)
+            {
+                // Wrap to the in point
+                ptsOffset += loopDuration;
+                replayed = 0;
+                nextEntry = m_loopIn + m_loopCache.size();
+                if (m_loopCache.empty())
+                {
+                    int res = m_source->seekToEntry(m_loopIn);
+                    if (res < 0)
+                        fail(res);
+                }
+                continue;
+            }
+            else
+            {
+                packet = av_packet_alloc();
+                int res = m_source->readPacket(packet);
+                if (res == AVERROR(EAGAIN))
+                {
+                    // Source is out of buffers until playback frees some packets
+                    av_packet_free(&packet);
+                    std::this_thread::sleep_for(std::chrono::microseconds(DEMUX_FULL_QUEUE_SLEEP_US));
+                    continue;
+                }
+                if (res < 0 && res != AVERROR_EOF)
+                {
+                    // Retry later, a damaged packet is skipped by the next read, give up if reads keep failing
+                    av_packet_free(&packet);
+                    if (++readErrors >= DEMUX_MAX_READ_ERRORS)
+                        fail(res);
+                    else
+                    {
+                        std::this_thread::sleep_for(std::chrono::microseconds(DEMUX_FULL_QUEUE_SLEEP_US));
+                    }
+                    continue;
+                }
+                readErrors = 0;
+                if (res < 0)
+                {
+                    av_packet_free(&packet);
+                    if (!m_loop)
+                    {
+                        m_endOfStream = true;
+                        continue;
+                    }
+                    if (gapless)
+                    {
+                        // Index and stream disagree on the length, wrap here
+                        nextEntry = m_loopOut + 1;
+                        continue;
+                    }
+                    // Loop - seek back to first frame
+                    res = m_source->rewind();
+                    if (res < 0)
+                        fail(res);
+                    continue;
+                }
+                nextEntry++;
+            }
+            if (!packet)
+                continue;
+            if (packet->pts != AV_NOPTS_VALUE)
+                packet->pts += ptsOffset;
+            if (packet->dts != AV_NOPTS_VALUE)
+                packet->dts += ptsOffset;
+        }
+        if (m_queue.push(packet, serial))
+        {
+            packet = nullptr;
+        }
+        else
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(DEMUX_FULL_QUEUE_SLEEP_US));
+        }
+    }
+    av_packet_free(&packet);
+}
@@ -0,0 +1,108 @@
+#ifndef HAPAVFORMATDEMUXER_H
+#define HAPAVFORMATDEMUXER_H
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "HAPPacketSource.h"
+#include "PacketQueue.h"
+
+// Reads packets of one stream on its own thread, running ahead of playback
+// Packets are handed over through a bounded lock-free queue, the file loops on end of stream unless told otherwise
+class HAPAvFormatDemuxer
+{
+public:
+    // The packet source must not be used by anyone else between start() and stop()
+    // Seeking needs the packet index of the stream
+    HAPAvFormatDemuxer(HAPPacketSource* source, const PacketIndex* index,
+                       size_t maxQueuedPackets, size_t maxQueuedBytes,
+                       bool loop = true);
+    ~HAPAvFormatDemuxer();
+
+    // Heap allocated demuxers keep the cache line alignment of their queue, C++14 new ignores alignas
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
+
+    // With a packet index, loops play frames [inFrame, outFrame] without a gap:
+    // the first cachedFrames frames of the loop are kept in memory and queued at the wrap
+    // while the source seeks, and pts keep increasing across loops so the timeline never breaks
+    // Call before start(), returns false if the range is not in the stream
+    bool setLoopRange(size_t inFrame, size_t outFrame, size_t cachedFrames);
+
+    void start();
+    void stop();
+
+    // Returns the next packet or nullptr if the demuxer did not keep up
+    // Packets read before the last seek are dropped
+    // Returned packets must be given back with releasePacket
+    AVPacket* popPacket();
+    void releasePacket(AVPacket* packet);
+
+    // Playback continues from the given frame, every HAP frame being an intra frame the next packet is exactly that frame
+    // Returns false without a packet index or out of the stream
+    bool seekToFrame(size_t frame);
+    // Seeks to the frame shown at seconds from the start of the stream
+    bool seekToTime(double seconds);
+
+    // Changes on each seek, lets playback restart its timeline on the first packet after a seek
+    int serial() const { return m_serial; }
+
+    // True once the end of a non looping stream was reached, or reading failed, and every packet was popped
+    bool finished() const { return m_endOfStream && !m_seekPending && m_queue.size() == 0; }
+
+    // True when the demuxer stopped on read or seek errors, get_error() then describes the last one
+    // The error is written by the demux thread, get_error() returns a copy taken under a lock
+    bool failed() const { return m_failed; }
+    std::string get_error() const;
+
+    // Metrics
+    size_t queueDepth() const { return m_queue.size(); }
+    size_t queuedBytes() const { return m_queue.bytes(); }
+    size_t starvationCount() const { return m_starvationCount; }
+
+private:
+    void run();
+    void fail(int error);
+    void fillLoopCache();
+    bool gaplessLoop() const { return m_loop && m_index && m_loopOut < m_index->size(); }
+
+    HAPPacketSource* m_source;
+    const PacketIndex* m_index;
+    bool m_loop;
+
+    size_t m_loopIn = 0;
+    size_t m_loopOut = (size_t)-1;
+    size_t m_loopCacheFrames = 0;
+    // Own copies, packets of the source may hold on scarce buffers
+    std::vector<AVPacket*> m_loopCache;
+
+    PacketQueue m_queue;
+    std::thread m_thread;
+    std::atomic<bool> m_running{false};
+    std::atomic<bool> m_endOfStream{false};
+    std::atomic<bool> m_failed{false};
+    mutable std::mutex m_errorMutex;
+    std::string m_error;
+
+    bool m_starving = false;
+    size_t m_starvationCount = 0;
+
+    // Seek requested by the playback thread, picked up by the demux thread
+    std::mutex m_seekMutex;
+    std::atomic<bool> m_seekPending{false};
+    size_t m_seekFrame = 0;
+    int m_seekSerial = 0;
+    // Serial of the playback thread
+    int m_serial = 0;
+};
+
+#endif // HAPAVFORMATDEMUXER_H
@@ -3,12 +3,22 @@
 #include <iostream>
 
 #include "hap/hap.h"
-#include "shadercompilerhelper.h"
+#include "FrameTrace.h"
+#include "HapDecodePool.h"
+#include "HapMTDecode.h"
+#include "PlaybackMetrics.h"
+#ifdef USE_SHADER_PACK
+    #include "shadercompiler.h"
+    #include "ShaderPack.h"
+#else
+    #include "shadercompilerhelper.h"
+#endif
 
 #include "Renderer/IRenderer.h"
 #include "Renderer/IResourceLoader.h"
 #include "OS/Logging/Log.h"
 #include "OS/Interfaces/IApp.h"
+#include "OS/Interfaces/IFileSystem.h"
 
 #ifdef __APPLE__
 #import <Cocoa/cocoa.h>
@@ -20,35 +30,83 @@
 #include <windowsx.h>
 #endif
 
-#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
 
 using namespace std;
-using namespace std::chrono;
 
-static double currentMS()
+#ifdef USE_SHADER_PACK
+// Shaders were compiled offline by tools/ShaderPackTool, copies the byte code of a target out of the pack
+static bool readPackedShaders(const std::string* names, int count, uint32_t conversionType, std::vector<std::string>& outputs)
 {
-    duration<double, milli> time_span = duration_cast<duration<double, milli>>(system_clock::now().time_since_epoch());
-    return time_span.count();
+    ShaderPack pack;
+    if (pack.open("shaders/shaders.pack"))
+    {
+        std::cout << "Could not open shader pack - " << pack.get_error() << std::endl;
+        return false;
+    }
+    outputs.resize(count);
+    for (int i = 0; i < count; i++)
+    {
+        const ShaderPack::Entry* entry = pack.find(names[i].c_str(), conversionType);
+        if (!entry)
+        {
+            std::cout << "Shader " << names[i] << " missing from shader pack" << std::endl;
+            return false;
+        }
+        outputs[i].assign(reinterpret_cast<const char*>(pack.data(entry)), entry->size);
+    }
+    return true;
 }
 
-
-#if defined(__APPLE__) || defined( Linux )
-    #include <dispatch/dispatch.h>
-#else
-    #include <ppl.h>
-#endif
-void HapMTDecode(HapDecodeWorkFunction function, void *info, unsigned int count, void * /*info*/)
+// Copies the shaders of the renderer API where The forge loads them
+// Only SPIR-V is byte code: the pack holds GLSL, MSL and HLSL sources, which addShaderBinary can't take (it expects
+// DXBC/DXIL on D3D and a metallib on Metal), while addShader compiles them with the platform compiler and caches the
+// result by file name. Files that already hold the same shader are left untouched so that cache stays valid
+static bool extractPackedShaders(const std::string* names, int count, uint32_t rendererApi)
 {
-    #if defined(__APPLE__) || defined( Linux )
-        dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t index) {
-            function(info, (unsigned int)index);
-        });
-    #else
-        concurrency::parallel_for((unsigned int)0, count, [&](unsigned int i) {
-            function(info, i);
-        });
-    #endif
+    ShaderPack pack;
+    if (pack.open("shaders/shaders.pack"))
+    {
+        std::cout << "Could not open shader pack - " << pack.get_error() << std::endl;
+        return false;
+    }
+    uint32_t conversionType = ShaderCompiler::GLSL2GLSL;
+    const char* fileSuffix = nullptr;
+    if (rendererApi == RENDERER_API_METAL)
+    {
+        conversionType = ShaderCompiler::GLSL2MSL;
+        fileSuffix = ".metal";
+    }
+    else if (rendererApi == RENDERER_API_D3D11 || rendererApi == RENDERER_API_D3D12)
+    {
+        conversionType = ShaderCompiler::GLSL2HLSL;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        const ShaderPack::Entry* entry = pack.find(names[i].c_str(), conversionType);
+        if (!entry)
+        {
+            std::cout << "Shader " << names[i] << " missing from shader pack" << std::endl;
+            return false;
+        }
+        char c_fileOutput[FS_MAX_PATH] = {0};
+        fsAppendPathComponent(fsGetResourceDirectory(RD_SHADER_SOURCES), names[i].c_str(), c_fileOutput);
+        if (fileSuffix)
+        {
+            fsAppendPathExtension(c_fileOutput, fileSuffix, c_fileOutput);
+        }
+        if (!pack.extract(entry, c_fileOutput))
+        {
+            return false;
+        }
+    }
+    return true;
 }
+#endif
+
 
 #ifdef __APPLE__
 float2 g_retinaScale = { 1.0f, 1.0f };
@@ -62,6 +120,12 @@ static WNDCLASSW	                             gWindowClass;
 
 // Number of buffers to swap from
 #define IMAGE_COUNT MAX_SWAPCHAIN_IMAGES
+// Number of video texture slots: one is being uploaded while the previous ones may still be drawn
+#define VIDEO_TEXTURE_SLOT_COUNT 3
+// Layers the compositor draws at most
+#define MAX_COMPOSITOR_LAYERS 16
+// Compositor vertex: vec3 position + vec2 texture coord + float opacity
+#define LAYER_VERTEX_FLOATS 6
 
 const char* g_error_messages[] =
 {
@@ -72,6 +136,8 @@ const char* g_error_messages[] =
     "Depthbuffer initialize error",
     "Could not initialize window class",
     "Could not open window",
+    "Could not create compositor",
+    "Could not add layer",
 
     //Add error messages here
 };
@@ -89,6 +155,34 @@ uint32_t HAPAvFormatForgeRenderer::get_error_code()
     return error_code;
 }
 
+// Fragment shader of a compositor layer, depends on the HAP variant
+enum LayerShader
+{
+    LAYER_SHADER_RGBA,              // Hap, Hap Alpha, Hap Alpha Only
+    LAYER_SHADER_COCGY,             // Hap Q
+    LAYER_SHADER_COCGY_PLUS_A,      // Hap Q Alpha
+    LAYER_SHADER_COUNT
+};
+
+// Movie drawn by the compositor, its frames go through texture slots as in renderFrame
+struct CompositorLayer
+{
+    LayerShader shader = LAYER_SHADER_RGBA;
+    int textureCount = 0;
+    size_t textureBytes[2] = { 0, 0 };
+    Texture* textures[VIDEO_TEXTURE_SLOT_COUNT][2] = { { nullptr } };
+    SyncToken textureTokens[VIDEO_TEXTURE_SLOT_COUNT] = {};
+    Fence* textureFences[VIDEO_TEXTURE_SLOT_COUNT] = { nullptr };
+    DescriptorSet* descriptorSet = nullptr;
+    int uploadSlot = 0;
+    int lastUploadedSlot = -1;
+    // Slot drawn by the next render, -1 until a frame was uploaded
+    int drawSlot = -1;
+    // Frame uploaded last
+    int64_t frameNumber = -1;
+    HAPAvFormatForgeRenderer::LayerPlacement placement;
+};
+
 struct HAPAvFormatForgeRenderer::Pimpl
 {
     // The forge main renderer object
@@ -110,15 +204,25 @@ struct HAPAvFormatForgeRenderer::Pimpl
     Pipeline*       videoPipeline = nullptr;
     // Image Sampler
     Sampler*        videoTextureSampler = nullptr;
-    // Image texture
-    Texture*        videoTexture[2] = { nullptr }; //2 for HAP Q alpha case
+    // Image textures, one set per slot
+    Texture*        videoTexture[VIDEO_TEXTURE_SLOT_COUNT][2] = { { nullptr } }; //2 for HAP Q alpha case
+    // Completes when the copy queue is done uploading a slot
+    SyncToken       videoTextureTokens[VIDEO_TEXTURE_SLOT_COUNT] = {};
+    // Render complete fence of the last frame that sampled a slot
+    Fence*          videoTextureFences[VIDEO_TEXTURE_SLOT_COUNT] = { nullptr };
+    // One descriptor set index per slot
     DescriptorSet*  videoDescriptorSet = nullptr;
 
     // The forge root signature, still unsure what it does
     RootSignature*  rootSignature = nullptr;
-    // The forge depth buffer
+    // The forge depth buffer, only created when enabled: the video quads don't use depth
+    bool            depthBufferEnabled = false;
     RenderTarget*   depthBuffer = nullptr;
 
+    TinyImageFormat depthFormat() const { return depthBuffer ? depthBuffer->mFormat : TinyImageFormat_UNDEFINED; }
+    // Color target barrier, followed by the depth one when there is a depth buffer
+    uint32_t renderTargetBarrierCount() const { return depthBuffer ? 2 : 1; }
+
     // The forge swap chain
     SwapChain*      swapChain = nullptr;
     // The forge rendertargets represents the swapchain buffers
@@ -132,6 +236,89 @@ struct HAPAvFormatForgeRenderer::Pimpl
     // Per buffer, unlocked when render complete
     Semaphore*      renderCompleteSemaphore[IMAGE_COUNT] = { nullptr };
 
+    // Compositor: one program per layer shader sharing a root signature, one pipeline per shader and blend mode
+    Shader*         layerShaders[LAYER_SHADER_COUNT] = { nullptr };
+    RootSignature*  layerRootSignature = nullptr;
+    Pipeline*       layerPipelines[LAYER_SHADER_COUNT][BLEND_MODE_COUNT] = { { nullptr } };
+    // Quads of the layers, written by the CPU for each frame
+    Buffer*         layerVertexBuffers[IMAGE_COUNT] = { nullptr };
+    std::vector<CompositorLayer> layers;
+    std::vector<TextureBarrier> layerBarriers;
+
+    // GPU time of the frames: timestamps written at the start and end of their command buffer,
+    // resolved to a readback buffer per frame and read once its render complete fence is signaled
+    QueryPool*      gpuTimestampPools[IMAGE_COUNT] = { nullptr };
+    Buffer*         gpuTimestampBuffers[IMAGE_COUNT] = { nullptr };
+    // Timestamp ticks per second, 0 when the queue can't tell
+    double          gpuTimestampFrequency = 0;
+    bool            gpuTimestampsPending[IMAGE_COUNT] = { false };
+
+    void addGpuTimestamps()
+    {
+        getTimestampFrequency(graphicsQueue, &gpuTimestampFrequency);
+        for (int i = 0; i < IMAGE_COUNT; i++)
+        {
+            QueryPoolDesc queryPoolDesc = {};
+            queryPoolDesc.mType = QUERY_TYPE_TIMESTAMP;
+            queryPoolDesc.mQueryCount = 2;
+            addQueryPool(renderer, &queryPoolDesc, &gpuTimestampPools[i]);
+
+            BufferLoadDesc readbackDesc = {};
+            readbackDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_GPU_TO_CPU;
+            readbackDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_OWN_MEMORY_BIT | BUFFER_CREATION_FLAG_PERSISTENT_MAP_BIT;
+            readbackDesc.mDesc.mSize = 2 * sizeof(uint64_t);
+            readbackDesc.mDesc.mStartState = RESOURCE_STATE_COPY_DEST;
+            readbackDesc.ppBuffer = &gpuTimestampBuffers[i];
+            addResource(&readbackDesc, NULL);
+        }
+    }
+
+    // Brackets the commands of a frame, only when metrics are on
+    void beginGpuTimestamps(Cmd* cmd, int frameIndex)
+    {
+        gpuTimestampsPending[frameIndex] = PlaybackMetrics::active() && gpuTimestampFrequency > 0;
+        if (gpuTimestampsPending[frameIndex])
+        {
+            QueryDesc queryDesc = { 0 };
+            cmdResetQueryPool(cmd, gpuTimestampPools[frameIndex], 0, 2);
+            cmdBeginQuery(cmd, gpuTimestampPools[frameIndex], &queryDesc);
+        }
+    }
+
+    // Call outside of render passes
+    void endGpuTimestamps(Cmd* cmd, int frameIndex)
+    {
+        if (gpuTimestampsPending[frameIndex])
+        {
+            QueryDesc queryDesc = { 1 };
+            cmdEndQuery(cmd, gpuTimestampPools[frameIndex], &queryDesc);
+            cmdResolveQuery(cmd, gpuTimestampPools[frameIndex], gpuTimestampBuffers[frameIndex], 0, 2);
+        }
+    }
+
+    // GPU time of the frames completed since the last render
+    void sampleGpuLatencies()
+    {
+        PlaybackMetrics* metrics = PlaybackMetrics::active();
+        for (int i = 0; i < IMAGE_COUNT; i++)
+        {
+            if (!gpuTimestampsPending[i])
+            {
+                continue;
+            }
+            FenceStatus fenceStatus;
+            getFenceStatus(renderer, renderCompleteFences[i], &fenceStatus);
+            if (fenceStatus == FENCE_STATUS_COMPLETE)
+            {
+                const uint64_t* timestamps = static_cast<const uint64_t*>(gpuTimestampBuffers[i]->pCpuMappedAddress);
+                if (metrics && timestamps[1] > timestamps[0])
+                {
+                    metrics->recordGpuLatency((timestamps[1] - timestamps[0]) * 1000.0 / gpuTimestampFrequency);
+                }
+                gpuTimestampsPending[i] = false;
+            }
+        }
+    }
 };
 
 HAPAvFormatForgeRenderer::HAPAvFormatForgeRenderer()
@@ -144,6 +331,19 @@ HAPAvFormatForgeRenderer::~HAPAvFormatForgeRenderer()
     //TODO: cleanup resources
 }
 
+void HAPAvFormatForgeRenderer::enableDepthBuffer(bool enabled)
+{
+    m_pImpl->depthBufferEnabled = enabled;
+}
+
+void HAPAvFormatForgeRenderer::setPreview(int scale, const HapBlockDecoder::Region* region)
+{
+    m_previewScale = scale;
+    m_hasPreviewRegion = region != nullptr;
+    if (region)
+        m_previewRegion = *region;
+}
+
 extern char gResourceMounts[RM_COUNT][FS_MAX_PATH];
 
 int HAPAvFormatForgeRenderer::initRenderer()
@@ -227,6 +427,7 @@ int HAPAvFormatForgeRenderer::initRenderer()
     addSemaphore(m_pImpl->renderer, &(m_pImpl->imageAcquiredSemaphore));
 
     initResourceLoaderInterface(m_pImpl->renderer);
+    m_pImpl->addGpuTimestamps();
 
     float quadTexturePoints[] =
     {
@@ -373,10 +574,15 @@ int HAPAvFormatForgeRenderer::createContext()
         error_code = 3;
         return error_code;
     }
-    if (!addDepthBuffer())
+    if (m_pImpl->depthBufferEnabled && !addDepthBuffer())
     {
         error_code = 4;
-        return false;
+        return error_code;
+    }
+    // In compositor mode the pipelines are created with the first layer
+    if (!m_pImpl->videoShader)
+    {
+        return 0;
     }
     VertexLayout vertexLayout = {};
     vertexLayout.mAttribCount = 2;
@@ -402,7 +608,7 @@ int HAPAvFormatForgeRenderer::createContext()
     pipelineSettings.pColorFormats = &(m_pImpl->swapChain->ppRenderTargets[0]->mFormat);
     pipelineSettings.mSampleCount = m_pImpl->swapChain->ppRenderTargets[0]->mSampleCount;
     pipelineSettings.mSampleQuality = m_pImpl->swapChain->ppRenderTargets[0]->mSampleQuality;
-    pipelineSettings.mDepthStencilFormat = m_pImpl->depthBuffer->mFormat;
+    pipelineSettings.mDepthStencilFormat = m_pImpl->depthFormat();
     pipelineSettings.pRootSignature = m_pImpl->rootSignature;
     pipelineSettings.pShaderProgram = m_pImpl->videoShader;
     pipelineSettings.pVertexLayout = &vertexLayout;
@@ -414,9 +620,7 @@ int HAPAvFormatForgeRenderer::createContext()
 void HAPAvFormatForgeRenderer::createShaderProgram(unsigned int codecTag)
 {
     // Get vertex and fragment shader files to use
-    std::string vertexFilePath = "shaders/Default.vert";
     std::string vertexShaderName = "Default.vert";
-    std::string fragmentFilePath = "shaders/Default.frag";
     std::string fragmentShaderName = "Default.frag";
     switch (codecTag) {
         case MKTAG('H','a','p','1'): // Hap
@@ -429,30 +633,77 @@ void HAPAvFormatForgeRenderer::createShaderProgram(unsigned int codecTag)
             break;
         case MKTAG('H','a','p','Y'): // Hap Q
             // Single texture with HapTextureFormat_YCoCg_DXT5;
-            fragmentFilePath = "shaders/ScaledCoCgYToRGBA.frag";
             fragmentShaderName = "ScaledCoCgYToRGBA.frag";
             break;
         case MKTAG('H','a','p','M'):
             // Two textures: HapTextureFormat_YCoCg_DXT5 & HapTextureFormat_A_RGTC1;
-            fragmentFilePath = "shaders/ScaledCoCgYPlusAToRGBA.frag";
             fragmentShaderName = "ScaledCoCgYPlusAToRGBA.frag";
             break;
         default:
             assert(false);
             throw std::runtime_error("Unhandled HAP codec tab");
     }
-    //Convert from gl to target platform
-    ShaderCompilerHelper compileHelper;
-    ShaderCompilerHelper::TranspileDesc transpileDesc[] =
-    {
-        {vertexFilePath, ShaderCompiler::STAGE_VERTEX },
-        {fragmentFilePath, ShaderCompiler::STAGE_FRAGMENT }
-    };
-    if (!compileHelper.transpileShaders(transpileDesc, 2, m_pImpl->renderer->mApi))
+    addShaderProgram(vertexShaderName, fragmentShaderName, &(m_pImpl->videoShader));
+}
+
+// Loads the shaders/ vertex and fragment shaders of a program, converted to the language of the renderer API
+bool HAPAvFormatForgeRenderer::addShaderProgram(const std::string& vertexShaderName, const std::string& fragmentShaderName,
+                                                Shader** ppShader)
+{
+    std::string shaderNames[] = { vertexShaderName, fragmentShaderName };
+    #ifndef USE_SHADER_PACK
+        //Convert from gl to target platform
+        ShaderCompilerHelper compileHelper;
+        ShaderCompilerHelper::TranspileDesc transpileDesc[] =
+        {
+            {"shaders/" + vertexShaderName, ShaderCompiler::STAGE_VERTEX },
+            {"shaders/" + fragmentShaderName, ShaderCompiler::STAGE_FRAGMENT }
+        };
+    #endif
+
+    if (m_pImpl->renderer->mApi == RENDERER_API_VULKAN)
     {
-        std::cout << "Transpile error" << std::endl;
-        return ;
+        // SPIR-V goes straight to the renderer, no shader file is written nor read back
+        std::vector<std::string> byteCodes;
+        #ifdef USE_SHADER_PACK
+            bool loaded = readPackedShaders(shaderNames, 2, ShaderCompiler::GLSL2SPV, byteCodes);
+        #else
+            bool loaded = compileHelper.transpileShadersToMemory(transpileDesc, 2, m_pImpl->renderer->mApi, byteCodes);
+        #endif
+        if (!loaded)
+        {
+            std::cout << "Transpile error" << std::endl;
+            return false;
+        }
+        BinaryShaderDesc binaryShaderDesc = {};
+        binaryShaderDesc.mStages = SHADER_STAGE_VERT | SHADER_STAGE_FRAG;
+        binaryShaderDesc.mVert.pByteCode = &byteCodes[0][0];
+        binaryShaderDesc.mVert.mByteCodeSize = (uint32_t)byteCodes[0].size();
+        binaryShaderDesc.mVert.pEntryPoint = "main";
+        binaryShaderDesc.mFrag.pByteCode = &byteCodes[1][0];
+        binaryShaderDesc.mFrag.mByteCodeSize = (uint32_t)byteCodes[1].size();
+        binaryShaderDesc.mFrag.pEntryPoint = "main";
+        addShaderBinary(m_pImpl->renderer, &binaryShaderDesc, ppShader);
+        return *ppShader != nullptr;
     }
+
+    // Other renderer APIs compile their shaders from files
+    #ifdef USE_SHADER_PACK
+        if (!extractPackedShaders(shaderNames, 2, m_pImpl->renderer->mApi))
+        {
+            std::cout << "Shader pack error" << std::endl;
+            return false;
+        }
+    #else
+        if (!compileHelper.transpileShaders(transpileDesc, 2, m_pImpl->renderer->mApi))
+        {
+            std::cout << "Transpile error" << std::endl;
+            return false;
+        }
+        #ifdef LOG_RUNTIME_INFO
+            printf("Shader cache: %u hits, %u misses\n", compileHelper.cacheHits(), compileHelper.cacheMisses());
+        #endif
+    #endif
     //Load our shader
     ShaderLoadDesc videoShaderDesc = {};
 
@@ -460,24 +711,18 @@ void HAPAvFormatForgeRenderer::createShaderProgram(unsigned int codecTag)
     videoShaderDesc.mStages[1] = {fragmentShaderName.c_str(), NULL, 0};
 
 
-    addShader(m_pImpl->renderer, &videoShaderDesc, &(m_pImpl->videoShader));
+    addShader(m_pImpl->renderer, &videoShaderDesc, ppShader);
+    return *ppShader != nullptr;
 }
 
-void HAPAvFormatForgeRenderer::readCodecParams(AVCodecParameters *codecParams)
+// Adds the textures HapDecode outputs for codecTag, one set per slot
+// textureBytes receives the decoded size of each texture
+void HAPAvFormatForgeRenderer::addVideoTextures(unsigned int codecTag, int codedWidth, int codedHeight,
+                                                Texture* (*textures)[2], int slotCount, int& textureCount, size_t* textureBytes)
 {
-    (void)codecParams;
-    #define FFALIGN(x, a) (((x)+(a)-1)&~((a)-1))
-    #define TEXTURE_BLOCK_W 4
-    #define TEXTURE_BLOCK_H 4
-
-    m_textureWidth = codecParams->width;
-    m_textureHeight = codecParams->height;
-    // Encoded texture is 4 bytes aligned
-    m_codedWidth = FFALIGN(m_textureWidth,TEXTURE_BLOCK_W);
-    m_codedHeight = FFALIGN(m_textureHeight,TEXTURE_BLOCK_H);
-    m_textureCount = 1;
+    textureCount = 1;
     unsigned int outputBufferTextureFormats[2];
-    switch (codecParams->codec_tag) {
+    switch (codecTag) {
     case MKTAG('H','a','p','1'): // Hap
         outputBufferTextureFormats[0] = HapTextureFormat_RGB_DXT1;
 //        m_glInputFormat[0] = HapTextureFormat_RGB_DXT1;
@@ -495,7 +740,7 @@ void HAPAvFormatForgeRenderer::readCodecParams(AVCodecParameters *codecParams)
 //        m_glInputFormat[0] = HapTextureFormat_A_RGTC1;
         break;
     case MKTAG('H','a','p','M'):
-        m_textureCount = 2;
+        textureCount = 2;
         outputBufferTextureFormats[0] = HapTextureFormat_YCoCg_DXT5;
         outputBufferTextureFormats[1] = HapTextureFormat_A_RGTC1;
 //        m_glInputFormat[0] = HapTextureFormat_RGBA_DXT5;
@@ -506,7 +751,7 @@ void HAPAvFormatForgeRenderer::readCodecParams(AVCodecParameters *codecParams)
         throw std::runtime_error("Unhandled HAP codec tab");
     }
 
-    for (int textureId = 0; textureId < m_textureCount; textureId++) {
+    for (int textureId = 0; textureId < textureCount; textureId++) {
         unsigned int bitsPerPixel = 0;
         bool alphaOnly;
         TinyImageFormat imageFormat;
@@ -531,15 +776,15 @@ void HAPAvFormatForgeRenderer::readCodecParams(AVCodecParameters *codecParams)
                 throw std::runtime_error("Invalid texture format");
         }
 
-        size_t bytesPerRow = (m_codedWidth * bitsPerPixel) / 8;
+        size_t bytesPerRow = (codedWidth * bitsPerPixel) / 8;
 
-        m_outputBufferSize[textureId] = bytesPerRow * m_codedHeight; //required?
+        textureBytes[textureId] = bytesPerRow * codedHeight;
 
         TextureDesc texDesc = {};
         texDesc.mStartState = RESOURCE_STATE_COMMON;
         texDesc.pName = textureId == 0 ? "video" : "video_alpha";
-        texDesc.mWidth = m_codedWidth;
-        texDesc.mHeight = m_codedHeight;
+        texDesc.mWidth = codedWidth;
+        texDesc.mHeight = codedHeight;
         texDesc.mDepth = 1;
         texDesc.mArraySize = 1;
         texDesc.mSampleCount = SAMPLE_COUNT_1;
@@ -549,14 +794,76 @@ void HAPAvFormatForgeRenderer::readCodecParams(AVCodecParameters *codecParams)
         texDesc.mMipLevels = 1;
         texDesc.mDescriptors |= DESCRIPTOR_TYPE_TEXTURE;
 
+        for (int slot = 0; slot < slotCount; slot++)
+        {
+            TextureLoadDesc textureDesc = {};
+            textureDesc.pDesc = &texDesc;
+            textureDesc.pFileName = nullptr;
+            textureDesc.ppTexture = &(textures[slot][textureId]);
+            addResource(&textureDesc, NULL);
+        }
+    }
+}
+
+// Adds the RGBA8 textures the preview is decoded to, one per slot
+void HAPAvFormatForgeRenderer::addPreviewTextures(int width, int height)
+{
+    m_textureCount = 1;
+    m_outputBufferSize[0] = (size_t)width * height * 4;
+
+    TextureDesc texDesc = {};
+    texDesc.mStartState = RESOURCE_STATE_COMMON;
+    texDesc.pName = "preview";
+    texDesc.mWidth = width;
+    texDesc.mHeight = height;
+    texDesc.mDepth = 1;
+    texDesc.mArraySize = 1;
+    texDesc.mSampleCount = SAMPLE_COUNT_1;
+    texDesc.mFormat = TinyImageFormat_R8G8B8A8_UNORM;
+    texDesc.mClearValue = { 0 };
+    texDesc.pNativeHandle = nullptr;
+    texDesc.mMipLevels = 1;
+    texDesc.mDescriptors |= DESCRIPTOR_TYPE_TEXTURE;
+
+    for (int slot = 0; slot < VIDEO_TEXTURE_SLOT_COUNT; slot++)
+    {
         TextureLoadDesc textureDesc = {};
         textureDesc.pDesc = &texDesc;
         textureDesc.pFileName = nullptr;
-        textureDesc.ppTexture = &(m_pImpl->videoTexture[textureId]);
+        textureDesc.ppTexture = &(m_pImpl->videoTexture[slot][0]);
         addResource(&textureDesc, NULL);
     }
+}
 
-    createShaderProgram(codecParams->codec_tag);
+#define FFALIGN(x, a) (((x)+(a)-1)&~((a)-1))
+#define TEXTURE_BLOCK_W 4
+#define TEXTURE_BLOCK_H 4
+
+void HAPAvFormatForgeRenderer::readCodecParams(AVCodecParameters *codecParams)
+{
+    m_textureWidth = codecParams->width;
+    m_textureHeight = codecParams->height;
+    // Encoded texture is 4 bytes aligned
+    m_codedWidth = FFALIGN(m_textureWidth,TEXTURE_BLOCK_W);
+    m_codedHeight = FFALIGN(m_textureHeight,TEXTURE_BLOCK_H);
+    if (m_previewScale)
+    {
+        // Already RGB, drawn as is
+        int previewWidth, previewHeight;
+        if (!HapBlockDecoder::previewSize(m_textureWidth, m_textureHeight, m_hasPreviewRegion ? &m_previewRegion : nullptr,
+                                          m_previewScale, previewWidth, previewHeight))
+        {
+            throw std::runtime_error("Invalid preview scale or region");
+        }
+        addPreviewTextures(previewWidth, previewHeight);
+        addShaderProgram("Default.vert", "Default.frag", &(m_pImpl->videoShader));
+    }
+    else
+    {
+        addVideoTextures(codecParams->codec_tag, m_codedWidth, m_codedHeight,
+                         m_pImpl->videoTexture, VIDEO_TEXTURE_SLOT_COUNT, m_textureCount, m_outputBufferSize);
+        createShaderProgram(codecParams->codec_tag);
+    }
 
     //Setup texture sampler
     SamplerDesc samplerDesc = { FILTER_LINEAR,
@@ -577,60 +884,92 @@ void HAPAvFormatForgeRenderer::readCodecParams(AVCodecParameters *codecParams)
     rootDesc.ppShaders = &(m_pImpl->videoShader);
     addRootSignature(m_pImpl->renderer, &rootDesc, &(m_pImpl->rootSignature));
 
-    DescriptorSetDesc desc = { m_pImpl->rootSignature, DESCRIPTOR_UPDATE_FREQ_NONE, 1 };
+    DescriptorSetDesc desc = { m_pImpl->rootSignature, DESCRIPTOR_UPDATE_FREQ_NONE, VIDEO_TEXTURE_SLOT_COUNT };
     addDescriptorSet(m_pImpl->renderer, &desc, &(m_pImpl->videoDescriptorSet));
 
-    DescriptorData params[2] = {};
-    params[0].pName = "cocgsy_src";
-    params[0].ppTextures = &(m_pImpl->videoTexture[0]);
-    if (m_textureCount == 2)
+    for (int slot = 0; slot < VIDEO_TEXTURE_SLOT_COUNT; slot++)
     {
-        params[1].pName = "alpha_src";
-        params[1].ppTextures = &(m_pImpl->videoTexture[1]);
+        DescriptorData params[2] = {};
+        params[0].pName = "cocgsy_src";
+        params[0].ppTextures = &(m_pImpl->videoTexture[slot][0]);
+        if (m_textureCount == 2)
+        {
+            params[1].pName = "alpha_src";
+            params[1].ppTextures = &(m_pImpl->videoTexture[slot][1]);
+        }
+        updateDescriptorSet(m_pImpl->renderer, slot, m_pImpl->videoDescriptorSet, m_textureCount, params);
     }
-    updateDescriptorSet(m_pImpl->renderer, 0, m_pImpl->videoDescriptorSet, m_textureCount, params);
 }
 
 // This function will decode the AVPacket into memory buffers using HapDecode
 // and will then upload the binary result as an OpenGL texture of the correct type
 // It then renders a quad into the current framebuffer using the appropriate shader program
+//
+// Uploads go to a ring of texture slots and are not waited for: each call draws the frame uploaded
+// by the previous call, a fixed one frame lag, so the copy of frame N+1 overlaps the drawing of frame N
 void HAPAvFormatForgeRenderer::renderFrame(AVPacket* packet, double msTime) {
     #ifdef LOG_RUNTIME_INFO
         m_infoLogger.onNewFrame(msTime,packet->size);
     #endif
 
+    // Only reuse a slot once the GPU is done sampling and uploading it
+    int uploadSlot = m_uploadSlot;
+    Fence* pSlotFence = m_pImpl->videoTextureFences[uploadSlot];
+    if (pSlotFence)
+    {
+        FenceStatus slotFenceStatus;
+        getFenceStatus(m_pImpl->renderer, pSlotFence, &slotFenceStatus);
+        if (slotFenceStatus == FENCE_STATUS_INCOMPLETE)
+        {
+            waitForFences(m_pImpl->renderer, 1, &pSlotFence);
+        }
+    }
+    waitForToken(&m_pImpl->videoTextureTokens[uploadSlot]);
+
     // Update textures
     for (int textureId = 0; textureId < m_textureCount; textureId++) {
         unsigned long outputBufferDecodedSize;
         unsigned int outputBufferTextureFormat;
-        //We might be able to directly decode inside of the texture buffer
-        double preUpdate = currentMS();
-        SyncToken token = {};
-        TextureUpdateDesc textureUpdateDesc = { m_pImpl->videoTexture[textureId] };
-        beginUpdateResource(&textureUpdateDesc);
-        size_t outputBufferSize = textureUpdateDesc.mRowCount * textureUpdateDesc.mSrcRowStride;
-        uint8_t* outputBuffer = (uint8_t*)malloc(outputBufferSize);
-        unsigned int res = HapDecode(packet->data, packet->size,
-                                     textureId,
-                                     HapMTDecode,
-                                     nullptr,
-                                     outputBuffer, outputBufferSize,
-                                     &outputBufferDecodedSize,
-                                     &outputBufferTextureFormat);
-        for (uint32_t r = 0; r < textureUpdateDesc.mRowCount; ++r)
+        unsigned int res;
+        TextureUpdateDesc textureUpdateDesc = { m_pImpl->videoTexture[uploadSlot][textureId] };
         {
-            memcpy(textureUpdateDesc.pMappedData + r * textureUpdateDesc.mDstRowStride,
-                   outputBuffer + r * textureUpdateDesc.mSrcRowStride,
-                   textureUpdateDesc.mSrcRowStride);
+            FrameTrace::Scope traceUpload(FrameTrace::STAGE_UPLOAD);
+            beginUpdateResource(&textureUpdateDesc);
+            if (m_previewScale)
+            {
+                // Only the chunks of the preview region are decompressed, and its blocks scaled down to RGBA8
+                // on the decode pool, straight into the mapped upload memory
+                FrameTrace::Scope traceDecompress(FrameTrace::STAGE_DECOMPRESS);
+                res = HapBlockDecoder::decodePreview(packet->data, packet->size, m_textureWidth, m_textureHeight,
+                                                     m_hasPreviewRegion ? &m_previewRegion : nullptr, m_previewScale,
+                                                     textureUpdateDesc.pMappedData, textureUpdateDesc.mDstRowStride,
+                                                     &HapDecodePool::instance());
+                outputBufferDecodedSize = m_outputBufferSize[0];
+            }
+            else
+            {
+                // Decode straight into the mapped upload memory, one block row every mDstRowStride bytes
+                // (HapDecode only needs to go through a scratch chunk when the rows are padded)
+                FrameTrace::Scope traceDecompress(FrameTrace::STAGE_DECOMPRESS);
+                res = HapDecodeWithRowStride(packet->data, packet->size,
+                                             textureId,
+                                             HapMTDecode,
+                                             nullptr,
+                                             textureUpdateDesc.pMappedData,
+                                             textureUpdateDesc.mRowCount * textureUpdateDesc.mDstRowStride,
+                                             textureUpdateDesc.mSrcRowStride,
+                                             textureUpdateDesc.mDstRowStride,
+                                             &outputBufferDecodedSize,
+                                             &outputBufferTextureFormat);
+            }
+            endUpdateResource(&textureUpdateDesc, &m_pImpl->videoTextureTokens[uploadSlot]);
         }
-        free(outputBuffer);
-        endUpdateResource(&textureUpdateDesc, &token);
-        waitForToken(&token);
-        double postUpdate = currentMS();
-        std::cout << "full update " << postUpdate - preUpdate << "MS\n";
 
         #ifdef LOG_RUNTIME_INFO
             m_infoLogger.onHapDataDecoded(outputBufferDecodedSize);
+            // Frame-sized scratch buffer we no longer allocate, fill and copy from, when decoding straight into unpadded rows
+            if (!m_previewScale && textureUpdateDesc.mSrcRowStride == textureUpdateDesc.mDstRowStride)
+                m_infoLogger.onScratchCopySaved(textureUpdateDesc.mRowCount * textureUpdateDesc.mSrcRowStride);
         #endif
 
         if (res != HapResult_No_Error) {
@@ -638,6 +977,15 @@ void HAPAvFormatForgeRenderer::renderFrame(AVPacket* packet, double msTime) {
         }
     }
 
+    // Draw the previous upload, which had a whole frame to land, the first frame waits for its own
+    int drawSlot = m_lastUploadedSlot >= 0 ? m_lastUploadedSlot : uploadSlot;
+    waitForToken(&m_pImpl->videoTextureTokens[drawSlot]);
+    m_lastUploadedSlot = uploadSlot;
+    m_uploadSlot = (uploadSlot + 1) % VIDEO_TEXTURE_SLOT_COUNT;
+
+    FrameTrace::StageTimer stageTimer;
+    stageTimer.begin(FrameTrace::STAGE_RECORD);
+
     uint32_t swapchainImageIndex;
 
     acquireNextImage(m_pImpl->renderer, m_pImpl->swapChain,
@@ -654,11 +1002,13 @@ void HAPAvFormatForgeRenderer::renderFrame(AVPacket* packet, double msTime) {
     {
         waitForFences(m_pImpl->renderer, 1, &pRenderCompleteFence);
     }
+    m_pImpl->sampleGpuLatencies();
 
     resetCmdPool(m_pImpl->renderer, m_pImpl->cmdPool[m_frameIndex]);
 
     Cmd* cmd = m_pImpl->cmds[m_frameIndex];
     beginCmd(cmd);
+    m_pImpl->beginGpuTimestamps(cmd, m_frameIndex);
 
     RenderTargetBarrier barriers[] =
     {
@@ -667,19 +1017,22 @@ void HAPAvFormatForgeRenderer::renderFrame(AVPacket* packet, double msTime) {
     };
 
     TextureBarrier textureBarriers[2] = {};
-    for (uint32_t i = 0; i < m_textureCount; i++)
+    for (int i = 0; i < m_textureCount; i++)
     {
-        textureBarriers[i] = { m_pImpl->videoTexture[i], RESOURCE_STATE_SHADER_RESOURCE };
+        textureBarriers[i] = { m_pImpl->videoTexture[drawSlot][i], RESOURCE_STATE_SHADER_RESOURCE };
     }
 
-    cmdResourceBarrier(cmd, 0, nullptr, 0, textureBarriers, 2, barriers);
+    cmdResourceBarrier(cmd, 0, nullptr, (uint32_t)m_textureCount, textureBarriers, m_pImpl->renderTargetBarrierCount(), barriers);
 
 
     LoadActionsDesc loadActions = {};
     loadActions.mLoadActionsColor[0] = LOAD_ACTION_CLEAR;
-    loadActions.mLoadActionDepth = LOAD_ACTION_CLEAR;
-    loadActions.mClearDepth.depth = 0.0f;
-    loadActions.mClearDepth.stencil = 0;
+    if (m_pImpl->depthBuffer)
+    {
+        loadActions.mLoadActionDepth = LOAD_ACTION_CLEAR;
+        loadActions.mClearDepth.depth = 0.0f;
+        loadActions.mClearDepth.stencil = 0;
+    }
     cmdBindRenderTargets(cmd, 1, &pRenderTarget, m_pImpl->depthBuffer, &loadActions, NULL, NULL, -1, -1);
     cmdSetViewport(cmd, 0.0f, 0.0f, (float)pRenderTarget->mWidth, (float)pRenderTarget->mHeight, 0.0f, 1.0f);
     cmdSetScissor(cmd, 0, 0, pRenderTarget->mWidth, pRenderTarget->mHeight);
@@ -687,20 +1040,431 @@ void HAPAvFormatForgeRenderer::renderFrame(AVPacket* packet, double msTime) {
     const uint32_t vertexStride = sizeof(float) * 3 + sizeof(float) * 2; //vec3 + vec2
 
     cmdBindPipeline(cmd, m_pImpl->videoPipeline);
-    cmdBindDescriptorSet(cmd, 0, m_pImpl->videoDescriptorSet);
+    cmdBindDescriptorSet(cmd, drawSlot, m_pImpl->videoDescriptorSet);
     cmdBindVertexBuffer(cmd, 1, &m_pImpl->videoVertexBuffer, &vertexStride, NULL);
     cmdDraw(cmd, 6, 0);
 
+    // End the render pass, the GPU timestamps are resolved outside of it
+    cmdBindRenderTargets(cmd, 0, NULL, NULL, NULL, NULL, NULL, -1, -1);
+
     //Reset render target state
     barriers[0] = { pRenderTarget, RESOURCE_STATE_PRESENT };
     for (int i = 0; i < m_textureCount; i++)
     {
-        textureBarriers[i] = { m_pImpl->videoTexture[i], RESOURCE_STATE_COMMON };
+        textureBarriers[i] = { m_pImpl->videoTexture[drawSlot][i], RESOURCE_STATE_COMMON };
+    }
+
+    cmdResourceBarrier(cmd, 0, NULL, (uint32_t)m_textureCount, textureBarriers, 1, barriers);
+    m_pImpl->endGpuTimestamps(cmd, m_frameIndex);
+
+    endCmd(cmd);
+    stageTimer.end();
+    stageTimer.begin(FrameTrace::STAGE_SUBMIT);
+
+    QueueSubmitDesc submitDesc = {};
+    submitDesc.mCmdCount = 1;
+    submitDesc.mSignalSemaphoreCount = 1;
+    submitDesc.mWaitSemaphoreCount = 1;
+    submitDesc.ppCmds = &cmd;
+    submitDesc.ppSignalSemaphores = &pRenderCompleteSemaphore;
+    submitDesc.ppWaitSemaphores = &m_pImpl->imageAcquiredSemaphore;
+    submitDesc.pSignalFence = pRenderCompleteFence;
+    queueSubmit(m_pImpl->graphicsQueue, &submitDesc);
+    m_pImpl->videoTextureFences[drawSlot] = pRenderCompleteFence;
+    stageTimer.end();
+    stageTimer.begin(FrameTrace::STAGE_PRESENT);
+    QueuePresentDesc presentDesc = {};
+    presentDesc.mIndex = swapchainImageIndex;
+    presentDesc.mWaitSemaphoreCount = 1;
+    presentDesc.pSwapChain = m_pImpl->swapChain;
+    presentDesc.ppWaitSemaphores = &pRenderCompleteSemaphore;
+    presentDesc.mSubmitDone = true;
+    queuePresent(m_pImpl->graphicsQueue, &presentDesc);
+    stageTimer.end();
+
+    m_frameIndex = (m_frameIndex + 1) % IMAGE_COUNT;
+}
+
+// Writes the two triangles of a layer quad, in the vertex order of the full screen quad
+static void writeLayerVertices(const HAPAvFormatForgeRenderer::LayerPlacement& placement, float winWidth, float winHeight,
+                               float* vertices)
+{
+    float width = placement.width > 0 ? placement.width : winWidth;
+    float height = placement.height > 0 ? placement.height : winHeight;
+    float centerX = placement.width > 0 ? placement.x + width / 2 : winWidth / 2;
+    float centerY = placement.height > 0 ? placement.y + height / 2 : winHeight / 2;
+    float angle = placement.rotation * 3.14159265f / 180.0f;
+    float cosAngle = cosf(angle), sinAngle = sinf(angle);
+
+    // Corner offsets from the center in pixels (y down) and their texture coords
+    const float corners[6][4] =
+    {
+        { -0.5f, -0.5f,     0.0f, 0.0f },
+        { -0.5f, 0.5f,      0.0f, 1.0f },
+        { 0.5f, 0.5f,       1.0f, 1.0f },
+
+        { -0.5f, -0.5f,     0.0f, 0.0f },
+        { 0.5f, -0.5f,      1.0f, 0.0f },
+        { 0.5f, 0.5f,       1.0f, 1.0f },
+    };
+    for (int i = 0; i < 6; i++)
+    {
+        float offsetX = corners[i][0] * width;
+        float offsetY = corners[i][1] * height;
+        float pixelX = centerX + offsetX * cosAngle - offsetY * sinAngle;
+        float pixelY = centerY + offsetX * sinAngle + offsetY * cosAngle;
+        float* vertex = vertices + i * LAYER_VERTEX_FLOATS;
+        vertex[0] = pixelX / winWidth * 2.0f - 1.0f;
+        vertex[1] = 1.0f - pixelY / winHeight * 2.0f;
+        vertex[2] = 0.0f;
+        vertex[3] = corners[i][2];
+        vertex[4] = corners[i][3];
+        vertex[5] = placement.opacity;
+    }
+}
+
+bool HAPAvFormatForgeRenderer::createCompositor()
+{
+    const char* fragmentShaderNames[LAYER_SHADER_COUNT] =
+    {
+        "Layer.frag",
+        "LayerScaledCoCgY.frag",
+        "LayerScaledCoCgYPlusA.frag",
+    };
+    for (int shader = 0; shader < LAYER_SHADER_COUNT; shader++)
+    {
+        if (!addShaderProgram("Layer.vert", fragmentShaderNames[shader], &(m_pImpl->layerShaders[shader])))
+        {
+            return false;
+        }
+    }
+
+    //Setup texture sampler
+    SamplerDesc samplerDesc = { FILTER_LINEAR,
+                                FILTER_LINEAR,
+                                MIPMAP_MODE_NEAREST,
+                                ADDRESS_MODE_CLAMP_TO_EDGE,
+                                ADDRESS_MODE_CLAMP_TO_EDGE,
+                                ADDRESS_MODE_CLAMP_TO_EDGE };
+    addSampler(m_pImpl->renderer, &samplerDesc, &(m_pImpl->videoTextureSampler));
+
+    // A root signature shared by all layer shaders, so the descriptor sets of the layers work with every pipeline
+    const char*       pStaticSamplers[] = { "uSampler0" };
+    RootSignatureDesc rootDesc = {};
+    rootDesc.mStaticSamplerCount = 1;
+    rootDesc.ppStaticSamplerNames = pStaticSamplers;
+    rootDesc.ppStaticSamplers = &(m_pImpl->videoTextureSampler);
+    rootDesc.mShaderCount = LAYER_SHADER_COUNT;
+    rootDesc.ppShaders = m_pImpl->layerShaders;
+    addRootSignature(m_pImpl->renderer, &rootDesc, &(m_pImpl->layerRootSignature));
+
+    for (int i = 0; i < IMAGE_COUNT; i++)
+    {
+        BufferLoadDesc vertexBufferDesc = {};
+        vertexBufferDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_VERTEX_BUFFER;
+        vertexBufferDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
+        vertexBufferDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_PERSISTENT_MAP_BIT;
+        vertexBufferDesc.mDesc.mSize = MAX_COMPOSITOR_LAYERS * 6 * LAYER_VERTEX_FLOATS * sizeof(float);
+        vertexBufferDesc.pData = nullptr;
+        vertexBufferDesc.ppBuffer = &(m_pImpl->layerVertexBuffers[i]);
+        addResource(&vertexBufferDesc, NULL);
+    }
+
+    VertexLayout vertexLayout = {};
+    vertexLayout.mAttribCount = 3;
+    vertexLayout.mAttribs[0].mSemantic = SEMANTIC_POSITION;
+    vertexLayout.mAttribs[0].mFormat = TinyImageFormat_R32G32B32_SFLOAT;
+    vertexLayout.mAttribs[0].mBinding = 0;
+    vertexLayout.mAttribs[0].mLocation = 0;
+    vertexLayout.mAttribs[0].mOffset = 0;
+    vertexLayout.mAttribs[1].mSemantic = SEMANTIC_NORMAL;
+    vertexLayout.mAttribs[1].mFormat = TinyImageFormat_R32G32_SFLOAT;
+    vertexLayout.mAttribs[1].mBinding = 0;
+    vertexLayout.mAttribs[1].mLocation = 1;
+    vertexLayout.mAttribs[1].mOffset = 3 * sizeof(float);
+    vertexLayout.mAttribs[2].mSemantic = SEMANTIC_COLOR;
+    vertexLayout.mAttribs[2].mFormat = TinyImageFormat_R32_SFLOAT;
+    vertexLayout.mAttribs[2].mBinding = 0;
+    vertexLayout.mAttribs[2].mLocation = 2;
+    vertexLayout.mAttribs[2].mOffset = 5 * sizeof(float);
+
+    RasterizerStateDesc rasterizerStateDesc = {};
+    rasterizerStateDesc.mCullMode = CULL_MODE_NONE;
+
+    // Source and destination colour factors of each blend mode, on premultiplied colours
+    const BlendConstant blendFactors[BLEND_MODE_COUNT][2] =
+    {
+        { BC_ONE, BC_ONE_MINUS_SRC_ALPHA },         // Over
+        { BC_ONE, BC_ONE },                         // Add
+        { BC_DST_COLOR, BC_ONE_MINUS_SRC_ALPHA },   // Multiply
+        { BC_ONE, BC_ONE_MINUS_SRC_COLOR },         // Screen
+    };
+    for (int blendMode = 0; blendMode < BLEND_MODE_COUNT; blendMode++)
+    {
+        BlendStateDesc blendStateDesc = {};
+        blendStateDesc.mSrcFactors[0] = blendFactors[blendMode][0];
+        blendStateDesc.mDstFactors[0] = blendFactors[blendMode][1];
+        blendStateDesc.mSrcAlphaFactors[0] = BC_ONE;
+        blendStateDesc.mDstAlphaFactors[0] = BC_ONE_MINUS_SRC_ALPHA;
+        blendStateDesc.mBlendModes[0] = BM_ADD;
+        blendStateDesc.mBlendAlphaModes[0] = BM_ADD;
+        blendStateDesc.mMasks[0] = ALL;
+        blendStateDesc.mRenderTargetMask = BLEND_STATE_TARGET_0;
+        blendStateDesc.mIndependentBlend = false;
+
+        for (int shader = 0; shader < LAYER_SHADER_COUNT; shader++)
+        {
+            PipelineDesc pipelineDesc = {};
+            pipelineDesc.mType = PIPELINE_TYPE_GRAPHICS;
+            GraphicsPipelineDesc& pipelineSettings = pipelineDesc.mGraphicsDesc;
+            pipelineSettings.mPrimitiveTopo = PRIMITIVE_TOPO_TRI_LIST;
+            pipelineSettings.mRenderTargetCount = 1;
+            pipelineSettings.pColorFormats = &(m_pImpl->swapChain->ppRenderTargets[0]->mFormat);
+            pipelineSettings.mSampleCount = m_pImpl->swapChain->ppRenderTargets[0]->mSampleCount;
+            pipelineSettings.mSampleQuality = m_pImpl->swapChain->ppRenderTargets[0]->mSampleQuality;
+            pipelineSettings.mDepthStencilFormat = m_pImpl->depthFormat();
+            pipelineSettings.pRootSignature = m_pImpl->layerRootSignature;
+            pipelineSettings.pShaderProgram = m_pImpl->layerShaders[shader];
+            pipelineSettings.pVertexLayout = &vertexLayout;
+            pipelineSettings.pRasterizerState = &rasterizerStateDesc;
+            pipelineSettings.pBlendState = &blendStateDesc;
+            addPipeline(m_pImpl->renderer, &pipelineDesc, &(m_pImpl->layerPipelines[shader][blendMode]));
+            if (!m_pImpl->layerPipelines[shader][blendMode])
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int HAPAvFormatForgeRenderer::addLayer(const AVCodecParameters* codecParams)
+{
+    if (m_pImpl->layers.size() >= MAX_COMPOSITOR_LAYERS || codecParams->codec_id != AV_CODEC_ID_HAP)
+    {
+        error_code = 8;
+        return -1;
+    }
+    if (!m_pImpl->layerRootSignature && !createCompositor())
+    {
+        error_code = 7;
+        return -1;
+    }
+
+    m_pImpl->layers.emplace_back();
+    CompositorLayer& layer = m_pImpl->layers.back();
+    switch (codecParams->codec_tag) {
+    case MKTAG('H','a','p','Y'): // Hap Q
+        layer.shader = LAYER_SHADER_COCGY;
+        break;
+    case MKTAG('H','a','p','M'): // Hap Q Alpha
+        layer.shader = LAYER_SHADER_COCGY_PLUS_A;
+        break;
+    default:
+        layer.shader = LAYER_SHADER_RGBA;
+        break;
+    }
+    addVideoTextures(codecParams->codec_tag,
+                     FFALIGN(codecParams->width, TEXTURE_BLOCK_W), FFALIGN(codecParams->height, TEXTURE_BLOCK_H),
+                     layer.textures, VIDEO_TEXTURE_SLOT_COUNT, layer.textureCount, layer.textureBytes);
+
+    DescriptorSetDesc desc = { m_pImpl->layerRootSignature, DESCRIPTOR_UPDATE_FREQ_NONE, VIDEO_TEXTURE_SLOT_COUNT };
+    addDescriptorSet(m_pImpl->renderer, &desc, &(layer.descriptorSet));
+    for (int slot = 0; slot < VIDEO_TEXTURE_SLOT_COUNT; slot++)
+    {
+        DescriptorData params[2] = {};
+        params[0].pName = "cocgsy_src";
+        params[0].ppTextures = &(layer.textures[slot][0]);
+        if (layer.textureCount == 2)
+        {
+            params[1].pName = "alpha_src";
+            params[1].ppTextures = &(layer.textures[slot][1]);
+        }
+        updateDescriptorSet(m_pImpl->renderer, slot, layer.descriptorSet, layer.textureCount, params);
+    }
+    return (int)m_pImpl->layers.size() - 1;
+}
+
+void HAPAvFormatForgeRenderer::setLayerPlacement(int layer, const LayerPlacement& placement)
+{
+    m_pImpl->layers[layer].placement = placement;
+}
+
+// Same slot ring as renderFrame for every layer: a new frame is copied to a slot the GPU is done with,
+// and drawn once its upload landed. The layers are then drawn back to front in a single pass
+void HAPAvFormatForgeRenderer::renderLayers(const HAPStreamEngine::Frame* frames, int frameCount, double msTime)
+{
+    #ifdef LOG_RUNTIME_INFO
+        m_infoLogger.onNewFrame(msTime, 0);
+    #else
+        (void)msTime;
+    #endif
+
+    std::vector<CompositorLayer>& layers = m_pImpl->layers;
+    int layerCount = std::min(frameCount, (int)layers.size());
+    for (int layerId = 0; layerId < layerCount; layerId++)
+    {
+        CompositorLayer& layer = layers[layerId];
+        const HAPStreamEngine::Frame& frame = frames[layerId];
+        if (frame.textureCount == (unsigned int)layer.textureCount && frame.number != layer.frameNumber)
+        {
+            // Only reuse a slot once the GPU is done sampling and uploading it
+            int uploadSlot = layer.uploadSlot;
+            Fence* pSlotFence = layer.textureFences[uploadSlot];
+            if (pSlotFence)
+            {
+                FenceStatus slotFenceStatus;
+                getFenceStatus(m_pImpl->renderer, pSlotFence, &slotFenceStatus);
+                if (slotFenceStatus == FENCE_STATUS_INCOMPLETE)
+                {
+                    waitForFences(m_pImpl->renderer, 1, &pSlotFence);
+                }
+            }
+            waitForToken(&layer.textureTokens[uploadSlot]);
+
+            FrameTrace::Scope traceUpload(FrameTrace::STAGE_UPLOAD);
+            for (int textureId = 0; textureId < layer.textureCount; textureId++)
+            {
+                TextureUpdateDesc textureUpdateDesc = { layer.textures[uploadSlot][textureId] };
+                beginUpdateResource(&textureUpdateDesc);
+                // Rows of blocks are packed in the decoded frame, mDstRowStride apart in the upload memory
+                const uint8_t* src = static_cast<const uint8_t*>(frame.textures[textureId]);
+                uint8_t* dst = static_cast<uint8_t*>(textureUpdateDesc.pMappedData);
+                uint32_t rowCount = std::min<size_t>(textureUpdateDesc.mRowCount,
+                                                     frame.textureBytes[textureId] / textureUpdateDesc.mSrcRowStride);
+                for (uint32_t row = 0; row < rowCount; row++)
+                {
+                    memcpy(dst + row * textureUpdateDesc.mDstRowStride, src + row * textureUpdateDesc.mSrcRowStride,
+                           textureUpdateDesc.mSrcRowStride);
+                }
+                endUpdateResource(&textureUpdateDesc, &layer.textureTokens[uploadSlot]);
+            }
+
+            // Draw this frame if its upload already landed, otherwise the previous one while the copy queue finishes
+            layer.drawSlot = uploadSlot;
+            if (layer.lastUploadedSlot >= 0 && !isTokenCompleted(&layer.textureTokens[uploadSlot]))
+            {
+                layer.drawSlot = layer.lastUploadedSlot;
+            }
+            layer.lastUploadedSlot = uploadSlot;
+            layer.uploadSlot = (uploadSlot + 1) % VIDEO_TEXTURE_SLOT_COUNT;
+            layer.frameNumber = frame.number;
+        }
+        else if (layer.lastUploadedSlot >= 0 && layer.drawSlot != layer.lastUploadedSlot &&
+                 isTokenCompleted(&layer.textureTokens[layer.lastUploadedSlot]))
+        {
+            layer.drawSlot = layer.lastUploadedSlot;
+        }
+        if (layer.drawSlot >= 0)
+        {
+            waitForToken(&layer.textureTokens[layer.drawSlot]);
+        }
+    }
+
+    FrameTrace::StageTimer stageTimer;
+    stageTimer.begin(FrameTrace::STAGE_RECORD);
+
+    uint32_t swapchainImageIndex;
+
+    acquireNextImage(m_pImpl->renderer, m_pImpl->swapChain,
+                     m_pImpl->imageAcquiredSemaphore, NULL,
+                     &swapchainImageIndex);
+
+    RenderTarget* pRenderTarget = m_pImpl->swapChain->ppRenderTargets[swapchainImageIndex];
+    Semaphore*    pRenderCompleteSemaphore = m_pImpl->renderCompleteSemaphore[m_frameIndex];
+    Fence*        pRenderCompleteFence = m_pImpl->renderCompleteFences[m_frameIndex];
+
+    FenceStatus fenceStatus;
+    getFenceStatus(m_pImpl->renderer, pRenderCompleteFence, &fenceStatus);
+    if (fenceStatus == FENCE_STATUS_INCOMPLETE)
+    {
+        waitForFences(m_pImpl->renderer, 1, &pRenderCompleteFence);
+    }
+    m_pImpl->sampleGpuLatencies();
+
+    resetCmdPool(m_pImpl->renderer, m_pImpl->cmdPool[m_frameIndex]);
+
+    Cmd* cmd = m_pImpl->cmds[m_frameIndex];
+    beginCmd(cmd);
+    m_pImpl->beginGpuTimestamps(cmd, m_frameIndex);
+
+    RenderTargetBarrier barriers[] =
+    {
+        { pRenderTarget, RESOURCE_STATE_RENDER_TARGET },
+        { m_pImpl->depthBuffer, RESOURCE_STATE_DEPTH_WRITE },
+    };
+
+    std::vector<TextureBarrier>& textureBarriers = m_pImpl->layerBarriers;
+    textureBarriers.clear();
+    for (int layerId = 0; layerId < layerCount; layerId++)
+    {
+        const CompositorLayer& layer = layers[layerId];
+        for (int i = 0; layer.drawSlot >= 0 && i < layer.textureCount; i++)
+        {
+            textureBarriers.push_back({ layer.textures[layer.drawSlot][i], RESOURCE_STATE_SHADER_RESOURCE });
+        }
+    }
+
+    cmdResourceBarrier(cmd, 0, nullptr, (uint32_t)textureBarriers.size(), textureBarriers.data(), m_pImpl->renderTargetBarrierCount(), barriers);
+
+    LoadActionsDesc loadActions = {};
+    loadActions.mLoadActionsColor[0] = LOAD_ACTION_CLEAR;
+    if (m_pImpl->depthBuffer)
+    {
+        loadActions.mLoadActionDepth = LOAD_ACTION_CLEAR;
+        loadActions.mClearDepth.depth = 0.0f;
+        loadActions.mClearDepth.stencil = 0;
+    }
+    cmdBindRenderTargets(cmd, 1, &pRenderTarget, m_pImpl->depthBuffer, &loadActions, NULL, NULL, -1, -1);
+    cmdSetViewport(cmd, 0.0f, 0.0f, (float)pRenderTarget->mWidth, (float)pRenderTarget->mHeight, 0.0f, 1.0f);
+    cmdSetScissor(cmd, 0, 0, pRenderTarget->mWidth, pRenderTarget->mHeight);
+
+    // The GPU is done with the vertices of this frame index since its fence completed
+    Buffer* pVertexBuffer = m_pImpl->layerVertexBuffers[m_frameIndex];
+    float* vertices = static_cast<float*>(pVertexBuffer->pCpuMappedAddress);
+    const uint32_t vertexStride = sizeof(float) * LAYER_VERTEX_FLOATS;
+    cmdBindVertexBuffer(cmd, 1, &pVertexBuffer, &vertexStride, NULL);
+
+    // Back to front, the pipeline is only bound again when the shader or blend mode changes
+    Pipeline* pBoundPipeline = nullptr;
+    uint32_t drawnLayers = 0;
+    for (int layerId = 0; layerId < layerCount; layerId++)
+    {
+        CompositorLayer& layer = layers[layerId];
+        if (layer.drawSlot < 0 || layer.placement.opacity <= 0.0f)
+        {
+            continue;
+        }
+        writeLayerVertices(layer.placement, (float)m_winWidth, (float)m_winHeight,
+                           vertices + drawnLayers * 6 * LAYER_VERTEX_FLOATS);
+        Pipeline* pPipeline = m_pImpl->layerPipelines[layer.shader][layer.placement.blendMode];
+        if (pPipeline != pBoundPipeline)
+        {
+            cmdBindPipeline(cmd, pPipeline);
+            pBoundPipeline = pPipeline;
+        }
+        cmdBindDescriptorSet(cmd, layer.drawSlot, layer.descriptorSet);
+        cmdDraw(cmd, 6, drawnLayers * 6);
+        layer.textureFences[layer.drawSlot] = pRenderCompleteFence;
+        drawnLayers++;
+    }
+
+    // End the render pass, the GPU timestamps are resolved outside of it
+    cmdBindRenderTargets(cmd, 0, NULL, NULL, NULL, NULL, NULL, -1, -1);
+
+    //Reset render target state
+    barriers[0] = { pRenderTarget, RESOURCE_STATE_PRESENT };
+    for (TextureBarrier& textureBarrier : textureBarriers)
+    {
+        textureBarrier = { textureBarrier.pTexture, RESOURCE_STATE_COMMON };
     }
 
-    cmdResourceBarrier(cmd, 0, NULL, 0, textureBarriers, 1, barriers);
+    cmdResourceBarrier(cmd, 0, NULL, (uint32_t)textureBarriers.size(), textureBarriers.data(), 1, barriers);
+    m_pImpl->endGpuTimestamps(cmd, m_frameIndex);
 
     endCmd(cmd);
+    stageTimer.end();
+    stageTimer.begin(FrameTrace::STAGE_SUBMIT);
 
     QueueSubmitDesc submitDesc = {};
     submitDesc.mCmdCount = 1;
@@ -711,6 +1475,8 @@ void HAPAvFormatForgeRenderer::renderFrame(AVPacket* packet, double msTime) {
     submitDesc.ppWaitSemaphores = &m_pImpl->imageAcquiredSemaphore;
     submitDesc.pSignalFence = pRenderCompleteFence;
     queueSubmit(m_pImpl->graphicsQueue, &submitDesc);
+    stageTimer.end();
+    stageTimer.begin(FrameTrace::STAGE_PRESENT);
     QueuePresentDesc presentDesc = {};
     presentDesc.mIndex = swapchainImageIndex;
     presentDesc.mWaitSemaphoreCount = 1;
@@ -718,6 +1484,7 @@ void HAPAvFormatForgeRenderer::renderFrame(AVPacket* packet, double msTime) {
     presentDesc.ppWaitSemaphores = &pRenderCompleteSemaphore;
     presentDesc.mSubmitDone = true;
     queuePresent(m_pImpl->graphicsQueue, &presentDesc);
+    stageTimer.end();
 
     m_frameIndex = (m_frameIndex + 1) % IMAGE_COUNT;
 }
@@ -3,30 +3,77 @@
 
 #include <assert.h>
 
-extern "C"
-{
-    #include <libavcodec/avcodec.h>
-    #include <libavformat/avformat.h>
-}
+#include "HAPAvFormatRenderer.h"
+#include "HAPStreamEngine.h"
+#include "HapBlockDecoder.h"
 
 #include <memory>
+#include <string>
+
+struct Shader;
+struct Texture;
 
-class HAPAvFormatForgeRenderer
+class HAPAvFormatForgeRenderer : public HAPAvFormatRenderer
 {
 public:
     HAPAvFormatForgeRenderer();
-    ~HAPAvFormatForgeRenderer();
-
-    int initRenderer();
-    int openWindow(const char* title, int width, int height);
-    int createContext();
-
-    void readCodecParams(AVCodecParameters* codecParams);
-
-    void renderFrame(AVPacket* packet, double msTime);
-
-    const char* get_error();
-    uint32_t get_error_code();
+    ~HAPAvFormatForgeRenderer() override;
+
+    // Adds a depth buffer to the render passes, for overlays that need depth testing
+    // The video passes don't use depth, without it no depth target is allocated nor cleared each frame
+    // Call before createContext
+    void enableDepthBuffer(bool enabled);
+
+    // Preview mode for confidence monitors and thumbnails, call before readCodecParams
+    // Frames are decoded on the CPU to an RGBA8 texture scaled down by scale (1, 2 or 4), of region of the frame
+    // unless it is null (see HapBlockDecoder::decodePreview): decode time and upload size follow the preview size
+    void setPreview(int scale, const HapBlockDecoder::Region* region = nullptr);
+
+    int initRenderer() override;
+    int openWindow(const char* title, int width, int height) override;
+    int createContext() override;
+
+    void readCodecParams(AVCodecParameters* codecParams) override;
+
+    void renderFrame(AVPacket* packet, double msTime) override;
+
+    // Compositor mode, used instead of readCodecParams / renderFrame to show several movies at once
+    // Every layer is a textured quad placed in the window and blended over the layers added before it.
+    // All layers are drawn with one command buffer and one submit, consecutive layers using the same
+    // shader and blend mode share their pipeline bind
+    enum BlendMode
+    {
+        // Colours are premultiplied by alpha and opacity
+        BLEND_MODE_OVER,
+        BLEND_MODE_ADD,
+        BLEND_MODE_MULTIPLY,
+        BLEND_MODE_SCREEN,
+        BLEND_MODE_COUNT
+    };
+
+    // Rectangle of the window (in pixels, from the top left corner) a layer is drawn to
+    // A width or height of 0 covers the whole window
+    struct LayerPlacement
+    {
+        float x = 0, y = 0;
+        float width = 0, height = 0;
+        // Clockwise around the center of the rectangle, in degrees
+        float rotation = 0;
+        float opacity = 1;
+        BlendMode blendMode = BLEND_MODE_OVER;
+    };
+
+    // Adds a layer playing a movie with codecParams, call after createContext
+    // Returns the index of the layer, or -1 when there are too many layers or the codec isn't HAP
+    int addLayer(const AVCodecParameters* codecParams);
+    void setLayerPlacement(int layer, const LayerPlacement& placement);
+
+    // Uploads the frames of the layers that changed since the last call and draws all layers
+    // frames[i] goes to layer i, a layer without a frame yet (no textures) isn't drawn
+    void renderLayers(const HAPStreamEngine::Frame* frames, int frameCount, double msTime);
+
+    const char* get_error() override;
+    uint32_t get_error_code() override;
 
 private:
     uint32_t error_code;
@@ -40,12 +87,28 @@ private:
 
     int  m_frameIndex = 0;
 
+    // Video texture slot the next frame is uploaded to, and the last one uploaded
+    int  m_uploadSlot = 0;
+    int  m_lastUploadedSlot = -1;
+
+    // Preview scale, 0 when frames are uploaded as they are decoded
+    int  m_previewScale = 0;
+    bool m_hasPreviewRegion = false;
+    HapBlockDecoder::Region m_previewRegion;
+
     // Frame buffers in RAM
     void* m_outputBuffers[2];
     size_t m_outputBufferSize[2];
 
     // Shader will be stored in Pimpl
     void createShaderProgram(unsigned int codecTag);
+    bool addShaderProgram(const std::string& vertexShaderName, const std::string& fragmentShaderName, Shader** ppShader);
+    void addVideoTextures(unsigned int codecTag, int codedWidth, int codedHeight,
+                          Texture* (*textures)[2], int slotCount, int& textureCount, size_t* textureBytes);
+    void addPreviewTextures(int width, int height);
+
+    // Shaders, root signature and pipelines of the compositor, created with the first layer
+    bool createCompositor();
 
     bool addSwapChain();
     bool addDepthBuffer();
@@ -66,7 +129,7 @@ private:
                 if (msTime > m_lastLogTime+1000) {
                     m_lastLogTime = msTime;
                     double elapsedTime = msTime - m_startTime;
-                    printf("Decompressed Frames: %lu, Average Input Bitrate: %lf, Average Output Birate: %lf, Average framerate: %lf\n",static_cast<unsigned long>(m_frameCount),m_totalBytesRead*8/elapsedTime,m_totalBytesDecompressed*8/elapsedTime,m_frameCount/double((msTime-m_startTime)/1000));
+                    printf("Decompressed Frames: %lu, Average Input Bitrate: %lf, Average Output Birate: %lf, Average framerate: %lf, Saved Copy Bytes Per Frame: %lf\n",static_cast<unsigned long>(m_frameCount),m_totalBytesRead*8/elapsedTime,m_totalBytesDecompressed*8/elapsedTime,m_frameCount/double((msTime-m_startTime)/1000),m_totalBytesCopySaved/double(m_frameCount));
                 }
                 m_frameCount++;
                 m_totalBytesRead += packetLength;
@@ -74,12 +137,16 @@ private:
             void onHapDataDecoded(size_t outputBufferDecodedSize) {
                 m_totalBytesDecompressed += outputBufferDecodedSize;
             }
+            void onScratchCopySaved(size_t bytes) {
+                m_totalBytesCopySaved += bytes;
+            }
         private:
             double m_startTime=0;
             double m_lastLogTime=0;
             size_t m_frameCount=0;
             size_t m_totalBytesRead=0;
             size_t m_totalBytesDecompressed=0;
+            size_t m_totalBytesCopySaved=0;
         };
         RuntimeInfoLogger m_infoLogger;
     #endif
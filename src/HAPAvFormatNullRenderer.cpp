@@ -0,0 +1,207 @@
+#include "HAPAvFormatNullRenderer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "hap/hap.h"
+#include "FrameTrace.h"
+#include "HapBlockDecoder.h"
+#include "HapDecodePool.h"
+#include "HapMTDecode.h"
+
+using namespace std::chrono;
+
+static double currentMS()
+{
+    duration<double, std::milli> time_span = duration_cast<duration<double, std::milli>>(steady_clock::now().time_since_epoch());
+    return time_span.count();
+}
+
+static const char* g_null_error_messages[] =
+{
+    "No error",
+    "Memalloc init error",
+};
+
+HAPAvFormatNullRenderer::HAPAvFormatNullRenderer()
+{
+}
+
+HAPAvFormatNullRenderer::~HAPAvFormatNullRenderer()
+{
+    for (int textureId = 0; textureId < 2; textureId++) {
+        free(m_outputBuffers[textureId]);
+    }
+}
+
+int HAPAvFormatNullRenderer::initRenderer()
+{
+    return 0;
+}
+
+int HAPAvFormatNullRenderer::openWindow(const char* /*title*/, int /*width*/, int /*height*/)
+{
+    return 0;
+}
+
+int HAPAvFormatNullRenderer::createContext()
+{
+    return error_code;
+}
+
+const char* HAPAvFormatNullRenderer::get_error()
+{
+    if (error_code >= (sizeof(g_null_error_messages) / sizeof(g_null_error_messages[0])))
+        return "Undefined error";
+    return g_null_error_messages[error_code];
+}
+
+uint32_t HAPAvFormatNullRenderer::get_error_code()
+{
+    return error_code;
+}
+
+void HAPAvFormatNullRenderer::setPreview(int scale, const HapBlockDecoder::Region* region)
+{
+    m_previewScale = scale;
+    m_hasPreviewRegion = region != nullptr;
+    if (region)
+        m_previewRegion = *region;
+}
+
+void HAPAvFormatNullRenderer::readCodecParams(AVCodecParameters* codecParams)
+{
+    // Encoded texture is 4 pixels aligned
+    size_t codedWidth = (codecParams->width + 3) & ~3;
+    size_t codedHeight = (codecParams->height + 3) & ~3;
+    unsigned int bitsPerPixel[2] = { 0, 0 };
+    m_textureCount = 1;
+    switch (codecParams->codec_tag) {
+    case MKTAG('H','a','p','1'): // Hap
+    case MKTAG('H','a','p','A'): // Hap Alpha Only
+        bitsPerPixel[0] = 4;
+        break;
+    case MKTAG('H','a','p','5'): // Hap Alpha
+    case MKTAG('H','a','p','Y'): // Hap Q
+        bitsPerPixel[0] = 8;
+        break;
+    case MKTAG('H','a','p','M'): // Hap Q Alpha
+        m_textureCount = 2;
+        bitsPerPixel[0] = 8;
+        bitsPerPixel[1] = 4;
+        break;
+    default:
+        throw std::runtime_error("Unhandled HAP codec tab");
+    }
+
+    m_width = codecParams->width;
+    m_height = codecParams->height;
+    if (m_previewScale) {
+        if (!HapBlockDecoder::previewSize(m_width, m_height, m_hasPreviewRegion ? &m_previewRegion : nullptr,
+                                          m_previewScale, m_previewWidth, m_previewHeight))
+            throw std::runtime_error("Invalid preview scale or region");
+        m_rgbaBuffer.resize((size_t)m_previewWidth * m_previewHeight * 4);
+    } else if (m_rgbaMode != RGBA_NONE)
+        m_rgbaBuffer.resize((size_t)m_width * m_height * 4);
+
+    for (int textureId = 0; textureId < m_textureCount; textureId++) {
+        m_outputBufferSize[textureId] = (codedWidth * bitsPerPixel[textureId]) / 8 * codedHeight;
+        free(m_outputBuffers[textureId]);
+        m_outputBuffers[textureId] = malloc(m_outputBufferSize[textureId]);
+        if (!m_outputBuffers[textureId]) {
+            error_code = 1;
+        }
+    }
+}
+
+void HAPAvFormatNullRenderer::renderFrame(AVPacket* packet, double /*msTime*/)
+{
+    FrameTrace::Scope traceDecompress(FrameTrace::STAGE_DECOMPRESS);
+    double preDecode = currentMS();
+    if (m_rgbaMode == RGBA_FUSED || m_previewScale) {
+        unsigned int res;
+        if (m_previewScale)
+            res = HapBlockDecoder::decodePreview(packet->data, packet->size, m_width, m_height,
+                                                 m_hasPreviewRegion ? &m_previewRegion : nullptr, m_previewScale,
+                                                 m_rgbaBuffer.data(), (size_t)m_previewWidth * 4, &HapDecodePool::instance());
+        else
+            res = HapBlockDecoder::decodeFrame(packet->data, packet->size, m_width, m_height,
+                                               m_rgbaBuffer.data(), (size_t)m_width * 4, &HapDecodePool::instance());
+        if (res != HapResult_No_Error) {
+            throw std::runtime_error("Failed to decode HAP frame to RGBA");
+        }
+        double decodeTimeMs = currentMS() - preDecode;
+        m_rgbaTimeMs += decodeTimeMs;
+        m_decodeTimesMs.push_back(decodeTimeMs);
+        m_totalBytesDecompressed += m_rgbaBuffer.size();
+        m_totalBytesRead += packet->size;
+        m_frameCount++;
+        return;
+    }
+
+    HapBlockDecoder::Texture textures[2];
+    for (int textureId = 0; textureId < m_textureCount; textureId++) {
+        unsigned long outputBufferDecodedSize;
+        unsigned int outputBufferTextureFormat;
+        unsigned int res = HapDecode(packet->data, packet->size,
+                                     textureId,
+                                     HapMTDecode,
+                                     nullptr,
+                                     m_outputBuffers[textureId], m_outputBufferSize[textureId],
+                                     &outputBufferDecodedSize,
+                                     &outputBufferTextureFormat);
+        if (res != HapResult_No_Error) {
+            throw std::runtime_error("Failed to decode HAP texture");
+        }
+        m_totalBytesDecompressed += outputBufferDecodedSize;
+        textures[textureId].data = m_outputBuffers[textureId];
+        textures[textureId].size = outputBufferDecodedSize;
+        textures[textureId].format = outputBufferTextureFormat;
+    }
+    if (m_rgbaMode == RGBA_SEPARATE) {
+        double preRGBA = currentMS();
+        unsigned int res = HapBlockDecoder::decode(textures, m_textureCount, m_width, m_height,
+                                                   m_rgbaBuffer.data(), (size_t)m_width * 4, &HapDecodePool::instance());
+        if (res != HapResult_No_Error) {
+            throw std::runtime_error("Failed to decode HAP texture to RGBA");
+        }
+        m_rgbaTimeMs += currentMS() - preRGBA;
+    }
+    m_decodeTimesMs.push_back(currentMS() - preDecode);
+    m_totalBytesRead += packet->size;
+    m_frameCount++;
+}
+
+void HAPAvFormatNullRenderer::printStats(FILE* output, double elapsedMs) const
+{
+    std::vector<double> sortedTimesMs = m_decodeTimesMs;
+    std::sort(sortedTimesMs.begin(), sortedTimesMs.end());
+    double p50 = 0;
+    double p99 = 0;
+    if (!sortedTimesMs.empty()) {
+        p50 = sortedTimesMs[(sortedTimesMs.size() - 1) / 2];
+        p99 = sortedTimesMs[std::min(sortedTimesMs.size() - 1, (size_t)(sortedTimesMs.size() * 0.99))];
+    }
+    double elapsedSeconds = elapsedMs / 1000.0;
+    fprintf(output, "Decoded Frames: %lu in %lf s, Framerate: %lf fps, Input: %lf MB/s, Output: %lf MB/s, Decode latency p50: %lf ms, p99: %lf ms\n",
+            static_cast<unsigned long>(m_frameCount), elapsedSeconds,
+            m_frameCount / elapsedSeconds,
+            m_totalBytesRead / (1024.0 * 1024.0) / elapsedSeconds,
+            m_totalBytesDecompressed / (1024.0 * 1024.0) / elapsedSeconds,
+            p50, p99);
+    if (m_previewScale && m_rgbaTimeMs > 0) {
+        // Output pixels of the preview, not of the frame
+        double pixels = (double)m_previewWidth * m_previewHeight * m_frameCount;
+        fprintf(output, "RGBA preview %dx%d at 1/%d (%s): %lf Gpix/s, %lf ms per frame\n",
+                m_previewWidth, m_previewHeight, m_previewScale, HapBlockDecoder::instructionSet(),
+                pixels / (m_rgbaTimeMs / 1000.0) / 1e9, m_rgbaTimeMs / m_frameCount);
+    } else if (m_rgbaMode != RGBA_NONE && m_rgbaTimeMs > 0) {
+        // Fused decodes are timed from the packet, separate ones from the DXT textures
+        double pixels = (double)m_width * m_height * m_frameCount;
+        fprintf(output, "RGBA %s (%s): %lf Gpix/s, %lf ms per frame\n",
+                m_rgbaMode == RGBA_FUSED ? "fused decode" : "conversion", HapBlockDecoder::instructionSet(),
+                pixels / (m_rgbaTimeMs / 1000.0) / 1e9, m_rgbaTimeMs / m_frameCount);
+    }
+}
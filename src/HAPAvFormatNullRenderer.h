@@ -0,0 +1,71 @@
+#ifndef HAPAVFORMATNULLRENDERER_H
+#define HAPAVFORMATNULLRENDERER_H
+
+#include "HAPAvFormatRenderer.h"
+#include "HapBlockDecoder.h"
+
+#include <cstdio>
+#include <vector>
+
+// Renderer without window nor GPU: frames are decoded with HapDecode into RAM and dropped
+// Used to benchmark the demux + decode path on machines without a GPU
+class HAPAvFormatNullRenderer : public HAPAvFormatRenderer
+{
+public:
+    HAPAvFormatNullRenderer();
+    ~HAPAvFormatNullRenderer() override;
+
+    int initRenderer() override;
+    int openWindow(const char* title, int width, int height) override;
+    int createContext() override;
+
+    void readCodecParams(AVCodecParameters* codecParams) override;
+
+    void renderFrame(AVPacket* packet, double msTime) override;
+
+    const char* get_error() override;
+    uint32_t get_error_code() override;
+
+    enum RGBAMode
+    {
+        // Frames are only decoded to DXT textures
+        RGBA_NONE,
+        // Frames are decoded to DXT textures, then turned into RGBA8 pixels on the CPU (see HapBlockDecoder)
+        RGBA_SEPARATE,
+        // Each chunk is decompressed and turned into RGBA8 pixels in one pass (HapBlockDecoder::decodeFrame)
+        RGBA_FUSED
+    };
+    void setRGBAMode(RGBAMode mode) { m_rgbaMode = mode; }
+    // Decodes previews instead of whole frames, see HAPAvFormatForgeRenderer::setPreview
+    void setPreview(int scale, const HapBlockDecoder::Region* region = nullptr);
+
+    // Prints frames/s, MB/s in and out and per-frame decode latency percentiles
+    void printStats(FILE* output, double elapsedMs) const;
+
+private:
+    uint32_t error_code = 0;
+
+    int m_textureCount = 0;
+
+    // Frame buffers in RAM, reused for every frame
+    void* m_outputBuffers[2] = { nullptr, nullptr };
+    size_t m_outputBufferSize[2] = { 0, 0 };
+
+    // RGBA8 output of HapBlockDecoder
+    RGBAMode m_rgbaMode = RGBA_NONE;
+    int m_width = 0, m_height = 0;
+    std::vector<uint8_t> m_rgbaBuffer;
+    // Preview scale, 0 when whole frames are decoded
+    int m_previewScale = 0;
+    bool m_hasPreviewRegion = false;
+    HapBlockDecoder::Region m_previewRegion;
+    int m_previewWidth = 0, m_previewHeight = 0;
+    double m_rgbaTimeMs = 0;
+
+    size_t m_frameCount = 0;
+    size_t m_totalBytesRead = 0;
+    size_t m_totalBytesDecompressed = 0;
+    std::vector<double> m_decodeTimesMs;
+};
+
+#endif // HAPAVFORMATNULLRENDERER_H
@@ -0,0 +1,31 @@
+#ifndef HAPAVFORMATRENDERER_H
+#define HAPAVFORMATRENDERER_H
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+#include <cstdint>
+
+// Interface shared by the renderers driven by the playback loop
+// Every method returning an int returns 0 on success or an error code described by get_error()
+class HAPAvFormatRenderer
+{
+public:
+    virtual ~HAPAvFormatRenderer() {}
+
+    virtual int initRenderer() = 0;
+    virtual int openWindow(const char* title, int width, int height) = 0;
+    virtual int createContext() = 0;
+
+    virtual void readCodecParams(AVCodecParameters* codecParams) = 0;
+
+    virtual void renderFrame(AVPacket* packet, double msTime) = 0;
+
+    virtual const char* get_error() = 0;
+    virtual uint32_t get_error_code() = 0;
+};
+
+#endif // HAPAVFORMATRENDERER_H
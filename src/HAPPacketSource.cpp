@@ -0,0 +1,90 @@
+#include "HAPPacketSource.h"
+
+AvFormatPacketSource::AvFormatPacketSource(AVFormatContext* formatCtx, int streamIndex, const PacketIndex* index)
+    :m_formatCtx(formatCtx),
+     m_streamIndex(streamIndex),
+     m_index(index)
+{
+}
+
+AvFormatPacketSource::~AvFormatPacketSource()
+{
+    av_packet_free(&m_pending);
+}
+
+int AvFormatPacketSource::readPacket(AVPacket* packet)
+{
+    if (m_pending)
+    {
+        av_packet_move_ref(packet, m_pending);
+        av_packet_free(&m_pending);
+        return 0;
+    }
+    for (;;)
+    {
+        int res = av_read_frame(m_formatCtx, packet);
+        if (res < 0)
+            return res;
+        if (packet->stream_index == m_streamIndex)
+            return 0;
+        av_packet_unref(packet);
+    }
+}
+
+int AvFormatPacketSource::rewind()
+{
+    av_packet_free(&m_pending);
+    return av_seek_frame(m_formatCtx, -1, 0, AVSEEK_FLAG_BACKWARD);
+}
+
+// Reads packets until the one at pts, kept for the next readPacket
+// Returns AVERROR(ERANGE) when the first packet read is already past pts
+int AvFormatPacketSource::readForwardTo(int64_t pts)
+{
+    AVPacket* packet = av_packet_alloc();
+    if (!packet)
+        return AVERROR(ENOMEM);
+    bool first = true;
+    for (;;)
+    {
+        int res = readPacket(packet);
+        if (res < 0)
+        {
+            av_packet_free(&packet);
+            return res;
+        }
+        int64_t packetPts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+        // Packets without timestamps can't be checked, trust the seek
+        if (packetPts == AV_NOPTS_VALUE || packetPts >= pts)
+        {
+            if (first && packetPts != AV_NOPTS_VALUE && packetPts > pts)
+            {
+                av_packet_free(&packet);
+                return AVERROR(ERANGE);
+            }
+            m_pending = packet;
+            return 0;
+        }
+        av_packet_unref(packet);
+        first = false;
+    }
+}
+
+int AvFormatPacketSource::seekToEntry(size_t entry)
+{
+    if (!m_index || entry >= m_index->size())
+        return AVERROR(EINVAL);
+    av_packet_free(&m_pending);
+    // Seeks land on the closest index point at or before the entry, which may be several packets earlier when the
+    // container indexes clusters: read forward to the entry. A seek past it starts over from the first entry
+    const int64_t seekPts[2] = { (*m_index)[entry].pts, (*m_index)[0].pts };
+    int res = AVERROR(ERANGE);
+    for (int attempt = 0; attempt < 2 && res == AVERROR(ERANGE); attempt++)
+    {
+        res = av_seek_frame(m_formatCtx, m_streamIndex, seekPts[attempt], AVSEEK_FLAG_BACKWARD);
+        if (res < 0)
+            return res;
+        res = readForwardTo((*m_index)[entry].pts);
+    }
+    return res;
+}
@@ -0,0 +1,55 @@
+#ifndef HAPPACKETSOURCE_H
+#define HAPPACKETSOURCE_H
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+#include "PacketIndex.h"
+
+// Produces the packets of the played stream, only used from the demux thread
+class HAPPacketSource
+{
+public:
+    virtual ~HAPPacketSource() {}
+
+    // Fills an empty packet with the next packet of the stream
+    // Returns 0, AVERROR_EOF at the end of the stream, AVERROR(EAGAIN) when the caller should retry later
+    // or another negative AVERROR code
+    virtual int readPacket(AVPacket* packet) = 0;
+
+    // Goes back to the first packet of the stream, returns 0 or a negative AVERROR code
+    virtual int rewind() = 0;
+
+    // Makes entry of the packet index the next packet read, returns 0 or a negative AVERROR code
+    virtual int seekToEntry(size_t entry) = 0;
+};
+
+// Reads packets through libavformat
+// Seeking needs a packet index to map entries to timestamps
+class AvFormatPacketSource : public HAPPacketSource
+{
+public:
+    AvFormatPacketSource(AVFormatContext* formatCtx, int streamIndex, const PacketIndex* index = nullptr);
+    ~AvFormatPacketSource() override;
+
+    AvFormatPacketSource(const AvFormatPacketSource&) = delete;
+    AvFormatPacketSource& operator=(const AvFormatPacketSource&) = delete;
+
+    int readPacket(AVPacket* packet) override;
+    int rewind() override;
+    int seekToEntry(size_t entry) override;
+
+private:
+    int readForwardTo(int64_t pts);
+
+    AVFormatContext* m_formatCtx;
+    int m_streamIndex;
+    const PacketIndex* m_index;
+    // Packet of the entry a seek landed on, returned by the next readPacket
+    AVPacket* m_pending = nullptr;
+};
+
+#endif // HAPPACKETSOURCE_H
@@ -0,0 +1,382 @@
+#include "HAPStreamEngine.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "HAPAvFormatDemuxer.h"
+#include "HAPPacketSource.h"
+#include "HapDecodePool.h"
+#include "HapMTDecode.h"
+#include "MappedFile.h"
+#include "PacketIndex.h"
+#include "PlaybackMetrics.h"
+#include "hap/hap.h"
+
+// A layer waits this long for its demuxer before trying again
+#define ENGINE_STARVATION_SLEEP_US 500
+
+struct HAPStreamEngine::Layer
+{
+    std::string path;
+    LayerOptions options;
+
+    // Must outlive the format context and every packet
+    MappedFile mappedFile;
+    AVFormatContext* formatCtx = nullptr;
+    int streamIndex = -1;
+    PacketIndex index;
+    std::unique_ptr<HAPPacketSource> source;
+    std::unique_ptr<HAPAvFormatDemuxer> demuxer;
+    std::unique_ptr<FrameScheduler> scheduler;
+
+    unsigned int textureCount = 0;
+    size_t textureBufferBytes[2] = { 0, 0 };
+
+    // Triple buffered frames: the layer thread decodes into back and swaps it with ready,
+    // acquireFrame swaps ready with front when it holds a newer frame
+    struct FrameBuffer
+    {
+        std::vector<uint8_t> textures[2];
+        Frame frame;
+    };
+    FrameBuffer buffers[3];
+    std::mutex swapMutex;
+    int back = 0, ready = 1, front = 2;
+    bool readyIsNew = false;
+
+    std::thread thread;
+    std::atomic<bool> running{false};
+
+    mutable std::mutex statsMutex;
+    LayerStats stats;
+    size_t decodedFrames = 0;
+    double totalDecodeMs = 0;
+
+    ~Layer()
+    {
+        if (formatCtx)
+            avformat_close_input(&formatCtx);
+    }
+};
+
+HAPStreamEngine::HAPStreamEngine(size_t memoryBudgetBytes, HapDecodePool* pool)
+    :m_memoryBudgetBytes(memoryBudgetBytes),
+     m_pool(pool ? pool : &HapDecodePool::instance())
+{
+}
+
+HAPStreamEngine::~HAPStreamEngine()
+{
+    stop();
+}
+
+// Bits per pixel of the textures of a HAP codec tag, returns the texture count or 0 if the tag is not HAP
+static unsigned int textureLayout(unsigned int codecTag, unsigned int bitsPerPixel[2])
+{
+    switch (codecTag) {
+    case MKTAG('H','a','p','1'): // Hap
+    case MKTAG('H','a','p','A'): // Hap Alpha Only
+        bitsPerPixel[0] = 4;
+        return 1;
+    case MKTAG('H','a','p','5'): // Hap Alpha
+    case MKTAG('H','a','p','Y'): // Hap Q
+        bitsPerPixel[0] = 8;
+        return 1;
+    case MKTAG('H','a','p','M'): // Hap Q Alpha
+        bitsPerPixel[0] = 8;
+        bitsPerPixel[1] = 4;
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+int HAPStreamEngine::addLayer(const char* filepath, const LayerOptions& options)
+{
+    if (m_started) {
+        m_error = "Layers must be added before start";
+        return -1;
+    }
+
+    std::unique_ptr<Layer> layer(new Layer());
+    layer->path = filepath;
+    layer->options = options;
+    layer->formatCtx = avformat_alloc_context();
+    if (options.useMmap) {
+        if (layer->mappedFile.open(filepath) || !layer->mappedFile.ioContext()) {
+            m_error = "Couldn't map input file";
+            return -1;
+        }
+        layer->formatCtx->pb = layer->mappedFile.ioContext();
+        layer->formatCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    if (avformat_open_input(&layer->formatCtx, filepath, NULL, NULL) != 0) {
+        // avformat_open_input frees the context on failure
+        layer->formatCtx = nullptr;
+        m_error = "Couldn't open input stream";
+        return -1;
+    }
+    if (avformat_find_stream_info(layer->formatCtx, NULL) < 0) {
+        m_error = "Couldn't find stream information";
+        return -1;
+    }
+    for (unsigned int i = 0; i < layer->formatCtx->nb_streams; i++) {
+        if (layer->formatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            layer->streamIndex = i;
+            break;
+        }
+    }
+    if (layer->streamIndex == -1) {
+        m_error = "Didn't find a video stream";
+        return -1;
+    }
+    AVCodecParameters* codecParams = layer->formatCtx->streams[layer->streamIndex]->codecpar;
+    unsigned int bitsPerPixel[2] = { 0, 0 };
+    layer->textureCount = textureLayout(codecParams->codec_tag, bitsPerPixel);
+    if (codecParams->codec_id != AV_CODEC_ID_HAP || layer->textureCount == 0) {
+        m_error = "Layers only play HAP movies";
+        return -1;
+    }
+
+    // Encoded texture is 4 pixels aligned
+    size_t codedWidth = (codecParams->width + 3) & ~3;
+    size_t codedHeight = (codecParams->height + 3) & ~3;
+    for (unsigned int textureId = 0; textureId < layer->textureCount; textureId++)
+        layer->textureBufferBytes[textureId] = (codedWidth * bitsPerPixel[textureId]) / 8 * codedHeight;
+
+    // Same packet sources as single stream playback, layers neither seek nor loop a range so files without a
+    // container index are not scanned
+    layer->index.buildFromContainer(layer->formatCtx, layer->streamIndex);
+    if (options.useMmap && layer->index.hasFileRanges())
+        layer->source.reset(new MappedPacketSource(layer->mappedFile, layer->index, layer->streamIndex));
+    else
+        layer->source.reset(new AvFormatPacketSource(layer->formatCtx, layer->streamIndex, &layer->index));
+    layer->scheduler.reset(new FrameScheduler(layer->formatCtx->streams[layer->streamIndex]->time_base, options.latePolicy));
+
+    m_layers.push_back(std::move(layer));
+    return (int)m_layers.size() - 1;
+}
+
+int HAPStreamEngine::start()
+{
+    if (m_started || m_layers.empty()) {
+        m_error = m_layers.empty() ? "No layer to play" : "Already started";
+        return -1;
+    }
+
+    // Decoded frames come off the budget first, the demux queues share the rest in proportion to their bitrate
+    // so every layer reads the same time ahead of playback
+    size_t frameBytes = 0;
+    double totalBytesPerFrame = 0;
+    std::vector<double> bytesPerFrame(m_layers.size(), 1.0);
+    for (size_t i = 0; i < m_layers.size(); i++) {
+        const Layer& layer = *m_layers[i];
+        for (unsigned int textureId = 0; textureId < layer.textureCount; textureId++)
+            frameBytes += layer.textureBufferBytes[textureId] * 3;
+        if (!layer.index.empty()) {
+            double totalBytes = 0;
+            for (size_t entry = 0; entry < layer.index.size(); entry++)
+                totalBytes += layer.index[entry].size;
+            bytesPerFrame[i] = totalBytes / layer.index.size();
+        } else {
+            bytesPerFrame[i] = (double)(layer.textureBufferBytes[0] + layer.textureBufferBytes[1]);
+        }
+        totalBytesPerFrame += bytesPerFrame[i];
+    }
+    // Without room left, each queue still takes one packet at a time
+    size_t queueBudget = m_memoryBudgetBytes > frameBytes ? m_memoryBudgetBytes - frameBytes : 0;
+
+    for (size_t i = 0; i < m_layers.size(); i++) {
+        Layer& layer = *m_layers[i];
+        size_t queueBytes = std::max((size_t)1, (size_t)(queueBudget * (bytesPerFrame[i] / totalBytesPerFrame)));
+        for (Layer::FrameBuffer& buffer : layer.buffers) {
+            for (unsigned int textureId = 0; textureId < layer.textureCount; textureId++)
+                buffer.textures[textureId].resize(layer.textureBufferBytes[textureId]);
+        }
+        layer.demuxer.reset(new HAPAvFormatDemuxer(layer.source.get(), &layer.index,
+                                                   layer.options.queuePackets, queueBytes, layer.options.loop));
+        layer.demuxer->start();
+        layer.running = true;
+        layer.thread = std::thread(&HAPStreamEngine::runLayer, this, std::ref(layer));
+    }
+    m_started = true;
+    return 0;
+}
+
+void HAPStreamEngine::stop()
+{
+    if (!m_started)
+        return;
+    for (std::unique_ptr<Layer>& layer : m_layers)
+        layer->running = false;
+    for (std::unique_ptr<Layer>& layer : m_layers) {
+        if (layer->thread.joinable())
+            layer->thread.join();
+        layer->demuxer->stop();
+    }
+    m_started = false;
+}
+
+const AVCodecParameters* HAPStreamEngine::codecParams(size_t layer) const
+{
+    const Layer& l = *m_layers[layer];
+    return l.formatCtx->streams[l.streamIndex]->codecpar;
+}
+
+bool HAPStreamEngine::decodeFrame(Layer& layer, AVPacket* packet, double presentationTimeMs)
+{
+    Layer::FrameBuffer& buffer = layer.buffers[layer.back];
+    // Ranks the chunks of this frame against the frames of the other layers
+    HapDecodeSchedule schedule = { m_pool, presentationTimeMs };
+    for (unsigned int textureId = 0; textureId < layer.textureCount; textureId++) {
+        unsigned long outputBufferDecodedSize;
+        unsigned int outputBufferTextureFormat;
+        unsigned int res = HapDecode(packet->data, packet->size,
+                                     textureId,
+                                     HapScheduledDecode,
+                                     &schedule,
+                                     buffer.textures[textureId].data(), buffer.textures[textureId].size(),
+                                     &outputBufferDecodedSize,
+                                     &outputBufferTextureFormat);
+        if (res != HapResult_No_Error)
+            return false;
+        buffer.frame.textures[textureId] = buffer.textures[textureId].data();
+        buffer.frame.textureBytes[textureId] = outputBufferDecodedSize;
+        buffer.frame.textureFormats[textureId] = outputBufferTextureFormat;
+    }
+    buffer.frame.textureCount = layer.textureCount;
+    buffer.frame.presentationTimeMs = presentationTimeMs;
+    return true;
+}
+
+void HAPStreamEngine::runLayer(Layer& layer)
+{
+    HAPAvFormatDemuxer& demuxer = *layer.demuxer;
+    FrameScheduler& scheduler = *layer.scheduler;
+    int serial = demuxer.serial();
+    int64_t frameNumber = 0;
+    bool starving = false;
+    while (layer.running) {
+        AVPacket* packet = demuxer.popPacket();
+        if (!packet) {
+            if (demuxer.finished()) {
+                if (demuxer.failed())
+                    fprintf(stderr, "Layer %s stopped on read errors - %s.\n", layer.path.c_str(), demuxer.get_error().c_str());
+                break;
+            }
+            if (!starving) {
+                starving = true;
+                std::lock_guard<std::mutex> lock(layer.statsMutex);
+                layer.stats.starvationCount++;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(ENGINE_STARVATION_SLEEP_US));
+            continue;
+        }
+        starving = false;
+
+        if (demuxer.serial() != serial) {
+            serial = demuxer.serial();
+            scheduler.restart();
+        }
+
+        // Frames of all layers add up in the playback metrics
+        PlaybackMetrics* metrics = PlaybackMetrics::active();
+        double presentationTimeMs = scheduler.presentationTimeMs(packet);
+        if (scheduler.shouldDrop(presentationTimeMs, demuxer.queueDepth() > 0)) {
+            demuxer.releasePacket(packet);
+            if (metrics)
+                metrics->onFrameDropped();
+            std::lock_guard<std::mutex> lock(layer.statsMutex);
+            layer.stats.droppedFrames++;
+            continue;
+        }
+
+        // Decode as soon as the packet is there, the frame waits in the back buffer until it is due
+        double preDecode = FrameScheduler::nowMs();
+        bool decoded = decodeFrame(layer, packet, presentationTimeMs);
+        double postDecode = FrameScheduler::nowMs();
+        demuxer.releasePacket(packet);
+        if (!decoded) {
+            std::lock_guard<std::mutex> lock(layer.statsMutex);
+            layer.stats.decodeErrors++;
+            continue;
+        }
+        if (metrics)
+            metrics->recordStage(FrameTrace::STAGE_DECOMPRESS, postDecode - preDecode);
+        {
+            std::lock_guard<std::mutex> lock(layer.statsMutex);
+            double decodeMs = postDecode - preDecode;
+            layer.decodedFrames++;
+            layer.totalDecodeMs += decodeMs;
+            layer.stats.maxDecodeMs = std::max(layer.stats.maxDecodeMs, decodeMs);
+            if (postDecode > presentationTimeMs)
+                layer.stats.lateFrames++;
+        }
+
+        scheduler.waitUntil(presentationTimeMs);
+        layer.buffers[layer.back].frame.number = frameNumber++;
+        {
+            std::lock_guard<std::mutex> lock(layer.swapMutex);
+            std::swap(layer.back, layer.ready);
+            layer.readyIsNew = true;
+        }
+        if (metrics)
+            metrics->onFramePresented(postDecode > presentationTimeMs);
+        std::lock_guard<std::mutex> lock(layer.statsMutex);
+        layer.stats.presentedFrames++;
+    }
+}
+
+bool HAPStreamEngine::acquireFrame(size_t layer, Frame& frame)
+{
+    Layer& l = *m_layers[layer];
+    {
+        std::lock_guard<std::mutex> lock(l.swapMutex);
+        if (l.readyIsNew) {
+            std::swap(l.front, l.ready);
+            l.readyIsNew = false;
+        }
+    }
+    const Frame& front = l.buffers[l.front].frame;
+    if (front.number < 0)
+        return false;
+    frame = front;
+    return true;
+}
+
+HAPStreamEngine::LayerStats HAPStreamEngine::layerStats(size_t layer) const
+{
+    const Layer& l = *m_layers[layer];
+    LayerStats stats;
+    {
+        std::lock_guard<std::mutex> lock(l.statsMutex);
+        stats = l.stats;
+        if (l.decodedFrames > 0)
+            stats.averageDecodeMs = l.totalDecodeMs / l.decodedFrames;
+    }
+    if (l.demuxer) {
+        stats.queuedPackets = l.demuxer->queueDepth();
+        stats.queuedBytes = l.demuxer->queuedBytes();
+    }
+    return stats;
+}
+
+void HAPStreamEngine::printStats(FILE* output) const
+{
+    for (size_t i = 0; i < m_layers.size(); i++) {
+        LayerStats stats = layerStats(i);
+        fprintf(output, "Layer %lu (%s): Presented: %lu, Dropped: %lu, Decode errors: %lu, Late: %lu, Starved: %lu, Queue: %lu packets %lu bytes, Decode avg: %lf ms max: %lf ms\n",
+                static_cast<unsigned long>(i), m_layers[i]->path.c_str(),
+                static_cast<unsigned long>(stats.presentedFrames),
+                static_cast<unsigned long>(stats.droppedFrames),
+                static_cast<unsigned long>(stats.decodeErrors),
+                static_cast<unsigned long>(stats.lateFrames),
+                static_cast<unsigned long>(stats.starvationCount),
+                static_cast<unsigned long>(stats.queuedPackets),
+                static_cast<unsigned long>(stats.queuedBytes),
+                stats.averageDecodeMs, stats.maxDecodeMs);
+    }
+}
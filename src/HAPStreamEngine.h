@@ -0,0 +1,106 @@
+#ifndef HAPSTREAMENGINE_H
+#define HAPSTREAMENGINE_H
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "FrameScheduler.h"
+
+class HapDecodePool;
+
+// Plays several HAP movies (layers) at once, each with its own demuxer and clock
+// Every layer decodes its frames on its own thread, ahead of their presentation time, into RAM textures.
+// The chunk work of all layers runs on one shared HapDecodePool where the frame due first is served first,
+// frames due at the same time take turns. A single memory budget is split between the layers.
+class HAPStreamEngine
+{
+public:
+    struct LayerOptions
+    {
+        bool loop = true;
+        // Read packets from a memory mapping of the file when the container has an index
+        bool useMmap = false;
+        size_t queuePackets = 32;
+        FrameScheduler::LatePolicy latePolicy = FrameScheduler::LATE_POLICY_DROP;
+    };
+
+    // Decoded textures (HapDecode output) of the frame a layer shows
+    struct Frame
+    {
+        // Frames published by the layer before this one
+        int64_t number = -1;
+        double presentationTimeMs = 0;
+        unsigned int textureCount = 0;
+        unsigned int textureFormats[2] = { 0, 0 };
+        const void* textures[2] = { nullptr, nullptr };
+        size_t textureBytes[2] = { 0, 0 };
+    };
+
+    struct LayerStats
+    {
+        size_t presentedFrames = 0;
+        // Skipped before decoding because they were already late
+        size_t droppedFrames = 0;
+        // Packets HapDecode failed on
+        size_t decodeErrors = 0;
+        // Decoded after their presentation time
+        size_t lateFrames = 0;
+        // Times the layer waited for its demuxer
+        size_t starvationCount = 0;
+        size_t queuedPackets = 0;
+        size_t queuedBytes = 0;
+        double averageDecodeMs = 0;
+        double maxDecodeMs = 0;
+    };
+
+    // memoryBudgetBytes covers the demux queues and decoded frames of every layer
+    // pool runs the decodes of every layer, nullptr uses the process wide pool
+    explicit HAPStreamEngine(size_t memoryBudgetBytes, HapDecodePool* pool = nullptr);
+    ~HAPStreamEngine();
+
+    HAPStreamEngine(const HAPStreamEngine&) = delete;
+    HAPStreamEngine& operator=(const HAPStreamEngine&) = delete;
+
+    // Opens filepath as a new layer, call before start()
+    // Returns the index of the layer, or -1 with the reason in get_error()
+    int addLayer(const char* filepath, const LayerOptions& options);
+
+    // Splits the memory budget between the layers and starts playing all of them
+    // Returns 0 on success
+    int start();
+    void stop();
+
+    size_t layerCount() const { return m_layers.size(); }
+    const AVCodecParameters* codecParams(size_t layer) const;
+
+    // Gets the latest frame published by layer, the textures stay valid until the next call for that layer
+    // Returns false until the layer published its first frame
+    bool acquireFrame(size_t layer, Frame& frame);
+
+    LayerStats layerStats(size_t layer) const;
+    void printStats(FILE* output) const;
+
+    const char* get_error() const { return m_error; }
+
+private:
+    struct Layer;
+
+    void runLayer(Layer& layer);
+    bool decodeFrame(Layer& layer, AVPacket* packet, double presentationTimeMs);
+
+    std::vector<std::unique_ptr<Layer>> m_layers;
+    size_t m_memoryBudgetBytes;
+    HapDecodePool* m_pool;
+    bool m_started = false;
+    const char* m_error = nullptr;
+};
+
+#endif // HAPSTREAMENGINE_H
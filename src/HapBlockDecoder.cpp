@@ -0,0 +1,1039 @@
+#include "HapBlockDecoder.h"
+
+#include "HapDecodePool.h"
+#include "HapMTDecode.h"
+#include "hap/hap.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Kernels are picked at compile time, x86 builds need at least SSSE3 for the palette shuffles
+#if defined(__SSSE3__) || defined(__AVX__)
+    #define HAP_BLOCK_SSSE3
+    #include <tmmintrin.h>
+    #if defined(__AVX2__)
+        #define HAP_BLOCK_AVX2
+        #include <immintrin.h>
+    #endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    #define HAP_BLOCK_NEON
+    #include <arm_neon.h>
+#endif
+
+// Pixels of one 4x4 block row after row, RGBA8 with R in the low byte
+struct alignas(32) Tile
+{
+    uint32_t pixels[16];
+};
+
+static inline uint32_t packRGBA(uint32_t r, uint32_t g, uint32_t b, uint32_t a)
+{
+    return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+// RGB565 colour to RGBA8
+static inline uint32_t expandColour(uint32_t colour)
+{
+    uint32_t r = (colour >> 11) & 31, g = (colour >> 5) & 63, b = colour & 31;
+    return packRGBA((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2), 255);
+}
+
+// Four colours of a DXT colour block, DXT5 colour blocks never use the three colours mode
+static inline void colourPalette(const uint8_t* block, bool allowThreeColours, uint32_t palette[4])
+{
+    uint32_t c0 = block[0] | (block[1] << 8);
+    uint32_t c1 = block[2] | (block[3] << 8);
+    uint32_t r0 = (c0 >> 11) & 31, g0 = (c0 >> 5) & 63, b0 = c0 & 31;
+    uint32_t r1 = (c1 >> 11) & 31, g1 = (c1 >> 5) & 63, b1 = c1 & 31;
+    r0 = (r0 << 3) | (r0 >> 2); g0 = (g0 << 2) | (g0 >> 4); b0 = (b0 << 3) | (b0 >> 2);
+    r1 = (r1 << 3) | (r1 >> 2); g1 = (g1 << 2) | (g1 >> 4); b1 = (b1 << 3) | (b1 >> 2);
+    palette[0] = packRGBA(r0, g0, b0, 255);
+    palette[1] = packRGBA(r1, g1, b1, 255);
+    if (c0 > c1 || !allowThreeColours)
+    {
+        palette[2] = packRGBA((2 * r0 + r1) / 3, (2 * g0 + g1) / 3, (2 * b0 + b1) / 3, 255);
+        palette[3] = packRGBA((r0 + 2 * r1) / 3, (g0 + 2 * g1) / 3, (b0 + 2 * b1) / 3, 255);
+    }
+    else
+    {
+        // HapTextureFormat_RGB_DXT1 has no alpha, the fourth colour is opaque black
+        palette[2] = packRGBA((r0 + r1) / 2, (g0 + g1) / 2, (b0 + b1) / 2, 255);
+        palette[3] = packRGBA(0, 0, 0, 255);
+    }
+}
+
+// Eight values of a DXT5 alpha or RGTC1 block
+static inline void alphaPalette(const uint8_t* block, uint8_t palette[8])
+{
+    uint32_t a0 = block[0];
+    uint32_t a1 = block[1];
+    palette[0] = (uint8_t)a0;
+    palette[1] = (uint8_t)a1;
+    if (a0 > a1)
+    {
+        for (uint32_t i = 1; i < 7; i++)
+            palette[i + 1] = (uint8_t)(((7 - i) * a0 + i * a1) / 7);
+    }
+    else
+    {
+        for (uint32_t i = 1; i < 5; i++)
+            palette[i + 1] = (uint8_t)(((5 - i) * a0 + i * a1) / 5);
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+// 16 3-bit indices of a DXT5 alpha or RGTC1 block
+static inline uint64_t alphaIndices(const uint8_t* block)
+{
+    uint64_t bits = 0;
+    for (int i = 0; i < 6; i++)
+        bits |= (uint64_t)block[2 + i] << (8 * i);
+    return bits;
+}
+
+// Weights of the endpoints in the palette entries of pixels, indexed by their indices, to average blocks without decoding
+// their pixels. Entry i of a palette is (w0 * endpoint0 + w1 * endpoint1) / d, d being 3 for four colours and 2 for three
+// colours (whose fourth is black), 7 for eight alphas and 5 for six alphas (whose last two are 0 and 255)
+// w0 is in bits 0-9, w1 in bits 10-19 and the count of 255 alphas in bits 20-29
+struct PaletteWeights
+{
+    // By mode, then by the index byte of a row of a colour block
+    uint32_t colourRows[2][256];
+    // By mode, then by the 6 index bits of two neighbour pixels of an alpha block
+    uint32_t alphaPairs[2][64];
+
+    PaletteWeights()
+    {
+        const uint32_t colourWeights[2][4] = { { 3, 3 << 10, 2 | 1 << 10, 1 | 2 << 10 },
+                                               { 2, 2 << 10, 1 | 1 << 10, 0 } };
+        for (int mode = 0; mode < 2; mode++)
+        {
+            uint32_t alphaWeights[8];
+            const uint32_t d = mode ? 5 : 7;
+            alphaWeights[0] = d;
+            alphaWeights[1] = d << 10;
+            for (uint32_t i = 2; i < 8; i++)
+                alphaWeights[i] = (d + 1 - i) | (i - 1) << 10;
+            if (mode)
+            {
+                alphaWeights[6] = 0;
+                alphaWeights[7] = 1 << 20;
+            }
+            for (int row = 0; row < 256; row++)
+            {
+                colourRows[mode][row] = 0;
+                for (int pixel = 0; pixel < 4; pixel++)
+                    colourRows[mode][row] += colourWeights[mode][(row >> (pixel * 2)) & 3];
+            }
+            for (int pair = 0; pair < 64; pair++)
+                alphaPairs[mode][pair] = alphaWeights[pair & 7] + alphaWeights[pair >> 3];
+        }
+    }
+};
+static const PaletteWeights g_paletteWeights;
+
+#if defined(HAP_BLOCK_SSSE3) || defined(HAP_BLOCK_NEON)
+// Byte shuffles gathering the palette colours of one row of a colour block, indexed by the index byte of the row
+struct RowShuffles
+{
+    alignas(16) uint8_t masks[256][16];
+
+    RowShuffles()
+    {
+        for (int row = 0; row < 256; row++)
+        {
+            for (int pixel = 0; pixel < 4; pixel++)
+            {
+                int index = (row >> (pixel * 2)) & 3;
+                for (int channel = 0; channel < 4; channel++)
+                    masks[row][pixel * 4 + channel] = (uint8_t)(index * 4 + channel);
+            }
+        }
+    }
+};
+static const RowShuffles g_rowShuffles;
+#endif
+
+#if defined(HAP_BLOCK_SSSE3)
+
+static inline void decodeColourBlock(const uint8_t* block, bool allowThreeColours, Tile& tile)
+{
+    alignas(16) uint32_t palette[4];
+    colourPalette(block, allowThreeColours, palette);
+    __m128i colours = _mm_load_si128((const __m128i*)palette);
+    for (int row = 0; row < 4; row++)
+    {
+        __m128i mask = _mm_load_si128((const __m128i*)g_rowShuffles.masks[block[4 + row]]);
+        _mm_store_si128((__m128i*)&tile.pixels[row * 4], _mm_shuffle_epi8(colours, mask));
+    }
+}
+
+static inline void mergeAlphaBlock(const uint8_t* block, Tile& tile)
+{
+    alignas(16) uint8_t palette[16] = {};
+    alignas(16) uint8_t indices[16];
+    alphaPalette(block, palette);
+    uint64_t bits = alphaIndices(block);
+    for (int i = 0; i < 16; i++)
+        indices[i] = (uint8_t)((bits >> (3 * i)) & 7);
+    __m128i alphas = _mm_shuffle_epi8(_mm_load_si128((const __m128i*)palette), _mm_load_si128((const __m128i*)indices));
+
+    // Spread the 16 alpha bytes to the top byte of each pixel
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i colourMask = _mm_set1_epi32(0x00FFFFFF);
+    __m128i low = _mm_unpacklo_epi8(zero, alphas);
+    __m128i high = _mm_unpackhi_epi8(zero, alphas);
+    __m128i rows[4] = { _mm_unpacklo_epi16(zero, low), _mm_unpackhi_epi16(zero, low),
+                        _mm_unpacklo_epi16(zero, high), _mm_unpackhi_epi16(zero, high) };
+    for (int row = 0; row < 4; row++)
+    {
+        __m128i* pixels = (__m128i*)&tile.pixels[row * 4];
+        _mm_store_si128(pixels, _mm_or_si128(_mm_and_si128(_mm_load_si128(pixels), colourMask), rows[row]));
+    }
+}
+
+// Averages of the 2x2 squares of a tile, 2x2 pixels row after row, rounded to nearest
+static inline void halveTile(const Tile& tile, uint32_t* pixels)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    for (int row = 0; row < 2; row++)
+    {
+        __m128i top = _mm_load_si128((const __m128i*)&tile.pixels[row * 8]);
+        __m128i bottom = _mm_load_si128((const __m128i*)&tile.pixels[row * 8 + 4]);
+        // Channels of the pixel pairs of two rows in 16 bit lanes, then of the squares they form
+        __m128i left = _mm_add_epi16(_mm_unpacklo_epi8(top, zero), _mm_unpacklo_epi8(bottom, zero));
+        __m128i right = _mm_add_epi16(_mm_unpackhi_epi8(top, zero), _mm_unpackhi_epi8(bottom, zero));
+        left = _mm_add_epi16(left, _mm_srli_si128(left, 8));
+        right = _mm_add_epi16(right, _mm_srli_si128(right, 8));
+        __m128i sums = _mm_add_epi16(_mm_unpacklo_epi64(left, right), two);
+        _mm_storel_epi64((__m128i*)&pixels[row * 2], _mm_packus_epi16(_mm_srli_epi16(sums, 2), zero));
+    }
+}
+
+#if defined(HAP_BLOCK_AVX2)
+
+static inline void convertYCoCgTile(Tile& tile)
+{
+    const __m256i byteMask = _mm256_set1_epi32(0xFF);
+    const __m256i opaque = _mm256_set1_epi32((int)0xFF000000);
+    const __m256 offset = _mm256_set1_ps(128.0f);
+    const __m256 eight = _mm256_set1_ps(8.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 maximum = _mm256_set1_ps(255.0f);
+    for (int half = 0; half < 2; half++)
+    {
+        __m256i* address = (__m256i*)&tile.pixels[half * 8];
+        __m256i pixels = _mm256_load_si256(address);
+        __m256 co = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_and_si256(pixels, byteMask)), offset);
+        __m256 cg = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(pixels, 8), byteMask)), offset);
+        __m256 scale = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(pixels, 16), byteMask));
+        __m256 y = _mm256_cvtepi32_ps(_mm256_srli_epi32(pixels, 24));
+        __m256 inverseScale = _mm256_div_ps(eight, _mm256_add_ps(scale, eight));
+        co = _mm256_mul_ps(co, inverseScale);
+        cg = _mm256_mul_ps(cg, inverseScale);
+        __m256 r = _mm256_sub_ps(_mm256_add_ps(y, co), cg);
+        __m256 g = _mm256_add_ps(y, cg);
+        __m256 b = _mm256_sub_ps(_mm256_sub_ps(y, co), cg);
+        __m256i ri = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(r, zero), maximum));
+        __m256i gi = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(g, zero), maximum));
+        __m256i bi = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(b, zero), maximum));
+        __m256i rgba = _mm256_or_si256(_mm256_or_si256(ri, _mm256_slli_epi32(gi, 8)),
+                                       _mm256_or_si256(_mm256_slli_epi32(bi, 16), opaque));
+        _mm256_store_si256(address, rgba);
+    }
+}
+
+#else
+
+static inline void convertYCoCgTile(Tile& tile)
+{
+    const __m128i byteMask = _mm_set1_epi32(0xFF);
+    const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+    const __m128 offset = _mm_set1_ps(128.0f);
+    const __m128 eight = _mm_set1_ps(8.0f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 maximum = _mm_set1_ps(255.0f);
+    for (int row = 0; row < 4; row++)
+    {
+        __m128i* address = (__m128i*)&tile.pixels[row * 4];
+        __m128i pixels = _mm_load_si128(address);
+        __m128 co = _mm_sub_ps(_mm_cvtepi32_ps(_mm_and_si128(pixels, byteMask)), offset);
+        __m128 cg = _mm_sub_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixels, 8), byteMask)), offset);
+        __m128 scale = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixels, 16), byteMask));
+        __m128 y = _mm_cvtepi32_ps(_mm_srli_epi32(pixels, 24));
+        __m128 inverseScale = _mm_div_ps(eight, _mm_add_ps(scale, eight));
+        co = _mm_mul_ps(co, inverseScale);
+        cg = _mm_mul_ps(cg, inverseScale);
+        __m128 r = _mm_sub_ps(_mm_add_ps(y, co), cg);
+        __m128 g = _mm_add_ps(y, cg);
+        __m128 b = _mm_sub_ps(_mm_sub_ps(y, co), cg);
+        __m128i ri = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(r, zero), maximum));
+        __m128i gi = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(g, zero), maximum));
+        __m128i bi = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(b, zero), maximum));
+        __m128i rgba = _mm_or_si128(_mm_or_si128(ri, _mm_slli_epi32(gi, 8)),
+                                    _mm_or_si128(_mm_slli_epi32(bi, 16), opaque));
+        _mm_store_si128(address, rgba);
+    }
+}
+
+#endif // HAP_BLOCK_AVX2
+
+#elif defined(HAP_BLOCK_NEON)
+
+static inline void decodeColourBlock(const uint8_t* block, bool allowThreeColours, Tile& tile)
+{
+    alignas(16) uint32_t palette[4];
+    colourPalette(block, allowThreeColours, palette);
+    uint8x16_t colours = vreinterpretq_u8_u32(vld1q_u32(palette));
+    for (int row = 0; row < 4; row++)
+    {
+        uint8x16_t pixels = vqtbl1q_u8(colours, vld1q_u8(g_rowShuffles.masks[block[4 + row]]));
+        vst1q_u32(&tile.pixels[row * 4], vreinterpretq_u32_u8(pixels));
+    }
+}
+
+static inline void mergeAlphaBlock(const uint8_t* block, Tile& tile)
+{
+    alignas(16) uint8_t palette[16] = {};
+    alignas(16) uint8_t indices[16];
+    alphaPalette(block, palette);
+    uint64_t bits = alphaIndices(block);
+    for (int i = 0; i < 16; i++)
+        indices[i] = (uint8_t)((bits >> (3 * i)) & 7);
+    uint8x16_t alphas = vqtbl1q_u8(vld1q_u8(palette), vld1q_u8(indices));
+
+    // Spread the 16 alpha bytes to the top byte of each pixel
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint16x8_t zero16 = vdupq_n_u16(0);
+    const uint32x4_t colourMask = vdupq_n_u32(0x00FFFFFF);
+    uint16x8_t low = vreinterpretq_u16_u8(vzip1q_u8(zero, alphas));
+    uint16x8_t high = vreinterpretq_u16_u8(vzip2q_u8(zero, alphas));
+    uint32x4_t rows[4] = { vreinterpretq_u32_u16(vzip1q_u16(zero16, low)), vreinterpretq_u32_u16(vzip2q_u16(zero16, low)),
+                           vreinterpretq_u32_u16(vzip1q_u16(zero16, high)), vreinterpretq_u32_u16(vzip2q_u16(zero16, high)) };
+    for (int row = 0; row < 4; row++)
+    {
+        uint32_t* pixels = &tile.pixels[row * 4];
+        vst1q_u32(pixels, vorrq_u32(vandq_u32(vld1q_u32(pixels), colourMask), rows[row]));
+    }
+}
+
+// Averages of the 2x2 squares of a tile, 2x2 pixels row after row, rounded to nearest
+static inline void halveTile(const Tile& tile, uint32_t* pixels)
+{
+    for (int row = 0; row < 2; row++)
+    {
+        uint8x16_t top = vreinterpretq_u8_u32(vld1q_u32(&tile.pixels[row * 8]));
+        uint8x16_t bottom = vreinterpretq_u8_u32(vld1q_u32(&tile.pixels[row * 8 + 4]));
+        // Channels of the pixel pairs of two rows in 16 bit lanes, then of the squares they form
+        uint16x8_t left = vaddl_u8(vget_low_u8(top), vget_low_u8(bottom));
+        uint16x8_t right = vaddl_u8(vget_high_u8(top), vget_high_u8(bottom));
+        uint16x8_t sums = vcombine_u16(vadd_u16(vget_low_u16(left), vget_high_u16(left)),
+                                       vadd_u16(vget_low_u16(right), vget_high_u16(right)));
+        vst1_u32(&pixels[row * 2], vreinterpret_u32_u8(vrshrn_n_u16(sums, 2)));
+    }
+}
+
+static inline void convertYCoCgTile(Tile& tile)
+{
+    const uint32x4_t byteMask = vdupq_n_u32(0xFF);
+    const uint32x4_t opaque = vdupq_n_u32(0xFF000000);
+    const float32x4_t offset = vdupq_n_f32(128.0f);
+    const float32x4_t eight = vdupq_n_f32(8.0f);
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t maximum = vdupq_n_f32(255.0f);
+    for (int row = 0; row < 4; row++)
+    {
+        uint32_t* address = &tile.pixels[row * 4];
+        uint32x4_t pixels = vld1q_u32(address);
+        float32x4_t co = vsubq_f32(vcvtq_f32_u32(vandq_u32(pixels, byteMask)), offset);
+        float32x4_t cg = vsubq_f32(vcvtq_f32_u32(vandq_u32(vshrq_n_u32(pixels, 8), byteMask)), offset);
+        float32x4_t scale = vcvtq_f32_u32(vandq_u32(vshrq_n_u32(pixels, 16), byteMask));
+        float32x4_t y = vcvtq_f32_u32(vshrq_n_u32(pixels, 24));
+        float32x4_t inverseScale = vdivq_f32(eight, vaddq_f32(scale, eight));
+        co = vmulq_f32(co, inverseScale);
+        cg = vmulq_f32(cg, inverseScale);
+        float32x4_t r = vsubq_f32(vaddq_f32(y, co), cg);
+        float32x4_t g = vaddq_f32(y, cg);
+        float32x4_t b = vsubq_f32(vsubq_f32(y, co), cg);
+        uint32x4_t ri = vcvtnq_u32_f32(vminq_f32(vmaxq_f32(r, zero), maximum));
+        uint32x4_t gi = vcvtnq_u32_f32(vminq_f32(vmaxq_f32(g, zero), maximum));
+        uint32x4_t bi = vcvtnq_u32_f32(vminq_f32(vmaxq_f32(b, zero), maximum));
+        uint32x4_t rgba = vorrq_u32(vorrq_u32(ri, vshlq_n_u32(gi, 8)), vorrq_u32(vshlq_n_u32(bi, 16), opaque));
+        vst1q_u32(address, rgba);
+    }
+}
+
+#else
+
+static inline void decodeColourBlock(const uint8_t* block, bool allowThreeColours, Tile& tile)
+{
+    uint32_t palette[4];
+    colourPalette(block, allowThreeColours, palette);
+    uint32_t indices = block[4] | (block[5] << 8) | (block[6] << 16) | ((uint32_t)block[7] << 24);
+    for (int i = 0; i < 16; i++)
+        tile.pixels[i] = palette[(indices >> (2 * i)) & 3];
+}
+
+static inline void mergeAlphaBlock(const uint8_t* block, Tile& tile)
+{
+    uint8_t palette[8];
+    alphaPalette(block, palette);
+    uint64_t bits = alphaIndices(block);
+    for (int i = 0; i < 16; i++)
+        tile.pixels[i] = (tile.pixels[i] & 0x00FFFFFF) | ((uint32_t)palette[(bits >> (3 * i)) & 7] << 24);
+}
+
+// Rounds to nearest even like the SIMD conversions
+static inline uint32_t toUnorm8(float value)
+{
+    return (uint32_t)std::lrint(std::min(std::max(value, 0.0f), 255.0f));
+}
+
+static inline void convertYCoCgTile(Tile& tile)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        uint32_t pixel = tile.pixels[i];
+        float inverseScale = 8.0f / (float)(((pixel >> 16) & 0xFF) + 8);
+        float co = ((float)(pixel & 0xFF) - 128.0f) * inverseScale;
+        float cg = ((float)((pixel >> 8) & 0xFF) - 128.0f) * inverseScale;
+        float y = (float)(pixel >> 24);
+        tile.pixels[i] = packRGBA(toUnorm8(y + co - cg), toUnorm8(y + cg), toUnorm8(y - co - cg), 255);
+    }
+}
+
+// Averages of the 2x2 squares of a tile, 2x2 pixels row after row, rounded to nearest
+static inline void halveTile(const Tile& tile, uint32_t* pixels)
+{
+    for (int row = 0; row < 2; row++)
+    {
+        for (int column = 0; column < 2; column++)
+        {
+            const uint32_t* square = &tile.pixels[row * 8 + column * 2];
+            // Red and blue summed in the 16 bit lanes of one word, green and alpha in the other
+            uint32_t redBlue = 0x00020002;
+            uint32_t greenAlpha = 0x00020002;
+            for (int i = 0; i < 2; i++)
+            {
+                redBlue += (square[i] & 0x00FF00FF) + (square[i + 4] & 0x00FF00FF);
+                greenAlpha += ((square[i] >> 8) & 0x00FF00FF) + ((square[i + 4] >> 8) & 0x00FF00FF);
+            }
+            pixels[row * 2 + column] = ((redBlue >> 2) & 0x00FF00FF) | (((greenAlpha >> 2) & 0x00FF00FF) << 8);
+        }
+    }
+}
+
+#endif
+
+static inline size_t blockBytes(unsigned int textureFormat)
+{
+    switch (textureFormat)
+    {
+    case HapTextureFormat_RGB_DXT1:
+    case HapTextureFormat_A_RGTC1:
+        return 8;
+    case HapTextureFormat_RGBA_DXT5:
+    case HapTextureFormat_YCoCg_DXT5:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
+// Average of the 16 pixels of a block, rounded to nearest, YCoCg_DXT5 blocks being averaged before their conversion
+// Sums the palette endpoints weighted by the entries of the pixels, without computing the palettes nor decoding the pixels
+// Interpolated entries aren't rounded down as when decoding, so a channel may come out one above the decoded pixels' average
+static inline uint32_t averageBlock(unsigned int format, const uint8_t* block)
+{
+    const uint8_t* colourBlock = nullptr;
+    const uint8_t* alphaBlock = nullptr;
+    switch (format)
+    {
+    case HapTextureFormat_RGB_DXT1:
+        colourBlock = block;
+        break;
+    case HapTextureFormat_RGBA_DXT5:
+    case HapTextureFormat_YCoCg_DXT5:
+        colourBlock = block + 8;
+        alphaBlock = block;
+        break;
+    case HapTextureFormat_A_RGTC1:
+        alphaBlock = block;
+        break;
+    }
+
+    uint32_t colour = 0;
+    if (colourBlock)
+    {
+        const uint32_t c0 = colourBlock[0] | (colourBlock[1] << 8);
+        const uint32_t c1 = colourBlock[2] | (colourBlock[3] << 8);
+        const bool threeColours = format == HapTextureFormat_RGB_DXT1 && c0 <= c1;
+        const uint32_t* rowWeights = g_paletteWeights.colourRows[threeColours];
+        const uint32_t weights = rowWeights[colourBlock[4]] + rowWeights[colourBlock[5]]
+                               + rowWeights[colourBlock[6]] + rowWeights[colourBlock[7]];
+        const uint32_t weight0 = weights & 0x3FF;
+        const uint32_t weight1 = weights >> 10;
+        const uint32_t endpoint0 = expandColour(c0);
+        const uint32_t endpoint1 = expandColour(c1);
+        // Red and blue in the 16 bit lanes of one word, rounded and divided by the 16 pixels, then by d
+        const uint32_t d = threeColours ? 2 : 3;
+        const uint32_t redBlue = ((weight0 * (endpoint0 & 0x00FF00FF) + weight1 * (endpoint1 & 0x00FF00FF)
+                                   + 8 * d * 0x00010001) >> 4) & 0x0FFF0FFF;
+        const uint32_t green = (weight0 * ((endpoint0 >> 8) & 0xFF) + weight1 * ((endpoint1 >> 8) & 0xFF) + 8 * d) >> 4;
+        colour = threeColours ? packRGBA((redBlue & 0xFFFF) / 2, green / 2, (redBlue >> 16) / 2, 0)
+                              : packRGBA((redBlue & 0xFFFF) / 3, green / 3, (redBlue >> 16) / 3, 0);
+    }
+
+    uint32_t alpha = 255;
+    if (alphaBlock)
+    {
+        const uint32_t a0 = alphaBlock[0];
+        const uint32_t a1 = alphaBlock[1];
+        const bool sixAlphas = a0 <= a1;
+        const uint32_t* pairWeights = g_paletteWeights.alphaPairs[sixAlphas];
+        const uint64_t bits = alphaIndices(alphaBlock);
+        uint32_t weights = 0;
+        for (int pair = 0; pair < 8; pair++)
+            weights += pairWeights[(bits >> (pair * 6)) & 63];
+        // The 255 entries of the six alphas palette are 255 * 5 / 5
+        const uint32_t sum = (weights & 0x3FF) * a0 + ((weights >> 10) & 0x3FF) * a1 + (weights >> 20) * 255 * 5;
+        alpha = sixAlphas ? ((sum + 40) >> 4) / 5 : ((sum + 56) >> 4) / 7;
+    }
+    return colour | (alpha << 24);
+}
+
+// Where the pixels of a frame go
+struct FrameOutput
+{
+    int width, height;
+    uint8_t* rgba;
+    size_t rowBytes;
+    unsigned int blocksPerRow;
+    unsigned int blockCount;
+};
+
+static inline void storeTile(const FrameOutput& output, const Tile& tile, unsigned int x, unsigned int y, bool alphaOnly)
+{
+    const int rows = std::min(4, output.height - (int)y * 4);
+    const int columns = std::min(4, output.width - (int)x * 4);
+    uint8_t* blockOutput = output.rgba + y * 4 * output.rowBytes + x * 16;
+    for (int row = 0; row < rows; row++)
+    {
+        uint8_t* rowOutput = blockOutput + row * output.rowBytes;
+        const uint32_t* tileRow = &tile.pixels[row * 4];
+        if (alphaOnly)
+        {
+            // Keep the colours already decoded from the other texture
+            uint32_t pixels[4];
+            memcpy(pixels, rowOutput, columns * 4);
+            for (int column = 0; column < columns; column++)
+                pixels[column] = (pixels[column] & 0x00FFFFFF) | (tileRow[column] & 0xFF000000);
+            memcpy(rowOutput, pixels, columns * 4);
+        }
+        else
+        {
+            memcpy(rowOutput, tileRow, columns * 4);
+        }
+    }
+}
+
+// Pixels of one block of a texture, alphaBlock optionally holds the A_RGTC1 block merged as alpha (Hap Q Alpha)
+static inline void decodeTile(unsigned int format, const uint8_t* block, const uint8_t* alphaBlock, Tile& tile)
+{
+    switch (format)
+    {
+    case HapTextureFormat_RGB_DXT1:
+        decodeColourBlock(block, true, tile);
+        break;
+    case HapTextureFormat_RGBA_DXT5:
+        decodeColourBlock(block + 8, false, tile);
+        mergeAlphaBlock(block, tile);
+        break;
+    case HapTextureFormat_YCoCg_DXT5:
+        // Y is stored in the alpha block
+        decodeColourBlock(block + 8, false, tile);
+        mergeAlphaBlock(block, tile);
+        convertYCoCgTile(tile);
+        break;
+    case HapTextureFormat_A_RGTC1:
+        memset(&tile, 0, sizeof(tile));
+        mergeAlphaBlock(block, tile);
+        break;
+    }
+    if (alphaBlock)
+        mergeAlphaBlock(alphaBlock, tile);
+}
+
+// Decodes blockCount consecutive blocks of a texture, from block index firstBlock, blocks being their data
+// alphaBlocks optionally holds the A_RGTC1 blocks merged as alpha at the same indices (Hap Q Alpha)
+// alphaOnly only writes the alpha of an A_RGTC1 texture over pixels decoded before
+static void decodeBlocks(const FrameOutput& output, unsigned int format, const uint8_t* blocks, const uint8_t* alphaBlocks,
+                         bool alphaOnly, unsigned int firstBlock, unsigned int blockCount)
+{
+    const size_t bytes = blockBytes(format);
+    unsigned int x = firstBlock % output.blocksPerRow;
+    unsigned int y = firstBlock / output.blocksPerRow;
+    Tile tile;
+    for (unsigned int i = 0; i < blockCount; i++)
+    {
+        decodeTile(format, blocks + i * bytes, alphaBlocks ? alphaBlocks + i * 8 : nullptr, tile);
+        storeTile(output, tile, x, y, alphaOnly);
+
+        if (++x == output.blocksPerRow)
+        {
+            x = 0;
+            y++;
+        }
+    }
+}
+
+// Where the pixels of a preview go: the blocks [firstColumn, lastColumn) x [firstRow, lastRow) of the frame
+// scaled down by scale, into width x height pixels
+struct PreviewOutput
+{
+    int width, height;
+    uint8_t* rgba;
+    size_t rowBytes;
+    int scale;
+    unsigned int blocksPerRow;
+    unsigned int blockCount;
+    unsigned int firstColumn, lastColumn;
+    unsigned int firstRow, lastRow;
+};
+
+// Stores the side x side pixels of block (x, y) of the frame, side being 4 / scale
+static inline void storePreviewPixels(const PreviewOutput& output, const uint32_t* pixels, unsigned int x, unsigned int y, bool alphaOnly)
+{
+    const int side = 4 / output.scale;
+    const int outputX = (int)(x - output.firstColumn) * side;
+    const int outputY = (int)(y - output.firstRow) * side;
+    const int rows = std::min(side, output.height - outputY);
+    const int columns = std::min(side, output.width - outputX);
+    for (int row = 0; row < rows; row++)
+    {
+        uint8_t* rowOutput = output.rgba + (outputY + row) * output.rowBytes + outputX * 4;
+        const uint32_t* pixelRow = &pixels[row * side];
+        if (alphaOnly)
+        {
+            // Keep the colours already decoded from the other texture
+            uint32_t merged[4];
+            memcpy(merged, rowOutput, columns * 4);
+            for (int column = 0; column < columns; column++)
+                merged[column] = (merged[column] & 0x00FFFFFF) | (pixelRow[column] & 0xFF000000);
+            memcpy(rowOutput, merged, columns * 4);
+        }
+        else
+        {
+            memcpy(rowOutput, pixelRow, columns * 4);
+        }
+    }
+}
+
+// decodeBlocks for a preview, blocks out of the region are skipped without being decoded
+static void decodePreviewBlocks(const PreviewOutput& output, unsigned int format, const uint8_t* blocks, bool alphaOnly,
+                                unsigned int firstBlock, unsigned int blockCount)
+{
+    const size_t bytes = blockBytes(format);
+    const bool yCoCg = format == HapTextureFormat_YCoCg_DXT5;
+    const int blockPixels = 16 / (output.scale * output.scale);
+    unsigned int x = firstBlock % output.blocksPerRow;
+    unsigned int y = firstBlock / output.blocksPerRow;
+    Tile tile;
+
+    // Scaled down YCoCg pixels of several blocks, converted together once they fill a tile
+    Tile pending = {};
+    unsigned int pendingX[16], pendingY[16];
+    int pendingBlocks = 0;
+    auto storePending = [&]()
+    {
+        convertYCoCgTile(pending);
+        for (int i = 0; i < pendingBlocks; i++)
+            storePreviewPixels(output, &pending.pixels[i * blockPixels], pendingX[i], pendingY[i], alphaOnly);
+        pendingBlocks = 0;
+    };
+
+    for (unsigned int i = 0; i < blockCount; i++)
+    {
+        if (y >= output.firstRow && y < output.lastRow && x >= output.firstColumn && x < output.lastColumn)
+        {
+            const uint8_t* block = blocks + i * bytes;
+            if (output.scale == 1)
+            {
+                decodeTile(format, block, nullptr, tile);
+                storePreviewPixels(output, tile.pixels, x, y, alphaOnly);
+            }
+            else if (yCoCg)
+            {
+                // CoCg, scale and Y are averaged before being converted,
+                // like the GPU filters a YCoCg texture before the shader converts it
+                if (output.scale == 2)
+                {
+                    decodeTile(HapTextureFormat_RGBA_DXT5, block, nullptr, tile);
+                    halveTile(tile, &pending.pixels[pendingBlocks * blockPixels]);
+                }
+                else
+                {
+                    pending.pixels[pendingBlocks] = averageBlock(format, block);
+                }
+                pendingX[pendingBlocks] = x;
+                pendingY[pendingBlocks] = y;
+                if (++pendingBlocks * blockPixels == 16)
+                    storePending();
+            }
+            else
+            {
+                uint32_t averaged[4];
+                if (output.scale == 2)
+                {
+                    decodeTile(format, block, nullptr, tile);
+                    halveTile(tile, averaged);
+                }
+                else
+                {
+                    averaged[0] = averageBlock(format, block);
+                }
+                storePreviewPixels(output, averaged, x, y, alphaOnly);
+            }
+        }
+
+        if (++x == output.blocksPerRow)
+        {
+            x = 0;
+            y++;
+        }
+    }
+    if (pendingBlocks)
+        storePending();
+}
+
+struct TextureJob
+{
+    FrameOutput output;
+    const HapBlockDecoder::Texture* textures;
+    unsigned int textureCount;
+    bool alphaOnly;
+};
+
+// Decodes the 4 rows of pixels of one row of blocks, blocks are converted and merged while in cache
+static void decodeBlockRow(void* p, unsigned int blockRow)
+{
+    const TextureJob& job = *static_cast<const TextureJob*>(p);
+    const unsigned int format = job.textures[0].format;
+    const unsigned int firstBlock = blockRow * job.output.blocksPerRow;
+    const uint8_t* blocks = static_cast<const uint8_t*>(job.textures[0].data) + firstBlock * blockBytes(format);
+    const uint8_t* alphaBlocks = nullptr;
+    if (job.textureCount > 1)
+        alphaBlocks = static_cast<const uint8_t*>(job.textures[1].data) + firstBlock * 8;
+    decodeBlocks(job.output, format, blocks, alphaBlocks, job.alphaOnly, firstBlock, job.output.blocksPerRow);
+}
+
+static void decodeTextureRows(const FrameOutput& output, const HapBlockDecoder::Texture* textures, unsigned int textureCount,
+                              bool alphaOnly, HapDecodePool* pool)
+{
+    TextureJob job;
+    job.output = output;
+    job.textures = textures;
+    job.textureCount = textureCount;
+    job.alphaOnly = alphaOnly;
+    const unsigned int blockRows = output.blockCount / output.blocksPerRow;
+    if (pool && blockRows > 1)
+    {
+        pool->run(decodeBlockRow, &job, blockRows);
+    }
+    else
+    {
+        for (unsigned int blockRow = 0; blockRow < blockRows; blockRow++)
+            decodeBlockRow(&job, blockRow);
+    }
+}
+
+static bool makeOutput(int width, int height, void* rgba, size_t rowBytes, FrameOutput& output)
+{
+    if (!rgba || width <= 0 || height <= 0 || rowBytes < (size_t)width * 4)
+        return false;
+    output.width = width;
+    output.height = height;
+    output.rgba = static_cast<uint8_t*>(rgba);
+    output.rowBytes = rowBytes;
+    output.blocksPerRow = (unsigned int)(width + 3) / 4;
+    output.blockCount = output.blocksPerRow * ((unsigned int)(height + 3) / 4);
+    return true;
+}
+
+static unsigned int checkFormats(const unsigned int* formats, unsigned int textureCount)
+{
+    if (textureCount == 2)
+    {
+        if (formats[0] != HapTextureFormat_YCoCg_DXT5 || formats[1] != HapTextureFormat_A_RGTC1)
+            return HapResult_Bad_Frame;
+    }
+    else if (textureCount != 1 || blockBytes(formats[0]) == 0)
+    {
+        return HapResult_Bad_Frame;
+    }
+    return HapResult_No_Error;
+}
+
+unsigned int HapBlockDecoder::decode(const Texture* textures, unsigned int textureCount, int width, int height,
+                                     void* rgba, size_t rowBytes, HapDecodePool* pool)
+{
+    FrameOutput output;
+    if (!textures || textureCount < 1 || textureCount > 2 || !makeOutput(width, height, rgba, rowBytes, output))
+        return HapResult_Bad_Arguments;
+    unsigned int formats[2];
+    for (unsigned int i = 0; i < textureCount; i++)
+        formats[i] = textures[i].format;
+    unsigned int result = checkFormats(formats, textureCount);
+    if (result != HapResult_No_Error)
+        return result;
+    for (unsigned int i = 0; i < textureCount; i++)
+    {
+        if (!textures[i].data || textures[i].size < blockBytes(textures[i].format) * output.blockCount)
+            return HapResult_Buffer_Too_Small;
+    }
+
+    decodeTextureRows(output, textures, textureCount, false, pool);
+    return HapResult_No_Error;
+}
+
+// State shared by the HapDecodeToSink chunks of one texture
+struct ChunkJob
+{
+    FrameOutput output;
+    // Set when decoding a preview, output is then not used
+    const PreviewOutput* preview = nullptr;
+    unsigned int format;
+    bool alphaOnly;
+    // Set when a chunk doesn't hold whole blocks, the texture is then decoded again through a texture buffer
+    std::atomic<bool> misaligned{false};
+};
+
+// One scratch buffer per decode thread, kept from frame to frame so chunks are decompressed into warm cache lines
+static void* chunkBuffer(unsigned long length, void* /*info*/)
+{
+    static thread_local std::vector<uint8_t> scratch;
+    if (scratch.size() < length)
+        scratch.resize(length);
+    return scratch.data();
+}
+
+static unsigned int chunkDecoded(const void* data, unsigned long offset, unsigned long length, void* info)
+{
+    ChunkJob& job = *static_cast<ChunkJob*>(info);
+    const size_t bytes = blockBytes(job.format);
+    if (offset % bytes != 0 || length % bytes != 0)
+    {
+        job.misaligned = true;
+        return HapResult_No_Error;
+    }
+    const unsigned long firstBlock = offset / bytes;
+    const unsigned int textureBlocks = job.preview ? job.preview->blockCount : job.output.blockCount;
+    if (firstBlock >= textureBlocks)
+        return HapResult_No_Error;
+    // Padding past the last block is ignored
+    const unsigned long blockCount = std::min<unsigned long>(length / bytes, textureBlocks - firstBlock);
+    if (job.preview)
+        decodePreviewBlocks(*job.preview, job.format, static_cast<const uint8_t*>(data), job.alphaOnly,
+                            (unsigned int)firstBlock, (unsigned int)blockCount);
+    else
+        decodeBlocks(job.output, job.format, static_cast<const uint8_t*>(data), nullptr, job.alphaOnly,
+                     (unsigned int)firstBlock, (unsigned int)blockCount);
+    return HapResult_No_Error;
+}
+
+// Only the chunks holding a block row of the preview region are decompressed
+static int previewChunkWanted(unsigned long offset, unsigned long length, void* info)
+{
+    const ChunkJob& job = *static_cast<const ChunkJob*>(info);
+    const size_t bytes = blockBytes(job.format);
+    if (length == 0 || offset % bytes != 0)
+        return 1;
+    const unsigned long firstRow = offset / bytes / job.preview->blocksPerRow;
+    const unsigned long lastRow = ((offset + length) / bytes - 1) / job.preview->blocksPerRow;
+    return firstRow < job.preview->lastRow && lastRow >= job.preview->firstRow;
+}
+
+unsigned int HapBlockDecoder::decodeFrame(const void* frame, size_t frameBytes, int width, int height,
+                                          void* rgba, size_t rowBytes, HapDecodePool* pool)
+{
+    FrameOutput output;
+    if (!frame || !makeOutput(width, height, rgba, rowBytes, output))
+        return HapResult_Bad_Arguments;
+
+    unsigned int textureCount = 0;
+    unsigned int result = HapGetFrameTextureCount(frame, frameBytes, &textureCount);
+    if (result != HapResult_No_Error)
+        return result;
+    unsigned int formats[2] = { 0, 0 };
+    for (unsigned int i = 0; i < textureCount && i < 2; i++)
+    {
+        result = HapGetFrameTextureFormat(frame, frameBytes, i, &formats[i]);
+        if (result != HapResult_No_Error)
+            return result;
+    }
+    result = checkFormats(formats, textureCount);
+    if (result != HapResult_No_Error)
+        return result;
+
+    // The colour texture writes whole pixels, the alpha texture of Hap Q Alpha then only writes their alpha
+    for (unsigned int i = 0; i < textureCount; i++)
+    {
+        ChunkJob job;
+        job.output = output;
+        job.format = formats[i];
+        job.alphaOnly = i > 0;
+        HapChunkSink sink = { chunkBuffer, chunkDecoded, &job, nullptr };
+        unsigned long decodedBytes = 0;
+        unsigned int textureFormat;
+        result = HapDecodeToSink(frame, frameBytes, i, HapMTDecode, pool, &sink, &decodedBytes, &textureFormat);
+        if (result != HapResult_No_Error)
+            return result;
+        if (decodedBytes < blockBytes(formats[i]) * output.blockCount)
+            return HapResult_Bad_Frame;
+
+        if (job.misaligned)
+        {
+            std::vector<uint8_t> buffer(decodedBytes);
+            result = HapDecode(frame, frameBytes, i, HapMTDecode, pool, buffer.data(), buffer.size(), &decodedBytes, &textureFormat);
+            if (result != HapResult_No_Error)
+                return result;
+            Texture texture = { buffer.data(), buffer.size(), formats[i] };
+            decodeTextureRows(output, &texture, 1, job.alphaOnly, pool);
+        }
+    }
+    return HapResult_No_Error;
+}
+
+// Blocks of the region rounded out to whole blocks, and the size of its pixels at 1 / scale
+static bool makePreviewOutput(int width, int height, const HapBlockDecoder::Region* region, int scale, PreviewOutput& output)
+{
+    if (width <= 0 || height <= 0 || (scale != 1 && scale != 2 && scale != 4))
+        return false;
+    HapBlockDecoder::Region frameRegion = { 0, 0, width, height };
+    if (!region)
+        region = &frameRegion;
+    if (region->x < 0 || region->y < 0 || region->width <= 0 || region->height <= 0
+        || region->x + region->width > width || region->y + region->height > height)
+        return false;
+    output.scale = scale;
+    output.blocksPerRow = (unsigned int)(width + 3) / 4;
+    output.blockCount = output.blocksPerRow * ((unsigned int)(height + 3) / 4);
+    output.firstColumn = (unsigned int)region->x / 4;
+    output.firstRow = (unsigned int)region->y / 4;
+    output.lastColumn = (unsigned int)(region->x + region->width + 3) / 4;
+    output.lastRow = (unsigned int)(region->y + region->height + 3) / 4;
+    // Pixels of the rounded region still inside the frame
+    const int regionWidth = std::min((int)output.lastColumn * 4, width) - (int)output.firstColumn * 4;
+    const int regionHeight = std::min((int)output.lastRow * 4, height) - (int)output.firstRow * 4;
+    output.width = (regionWidth + scale - 1) / scale;
+    output.height = (regionHeight + scale - 1) / scale;
+    return true;
+}
+
+bool HapBlockDecoder::previewSize(int width, int height, const Region* region, int scale, int& previewWidth, int& previewHeight)
+{
+    PreviewOutput output;
+    if (!makePreviewOutput(width, height, region, scale, output))
+        return false;
+    previewWidth = output.width;
+    previewHeight = output.height;
+    return true;
+}
+
+struct PreviewJob
+{
+    const PreviewOutput* output;
+    unsigned int format;
+    const uint8_t* blocks;
+    bool alphaOnly;
+};
+
+static void decodePreviewRow(void* p, unsigned int index)
+{
+    const PreviewJob& job = *static_cast<const PreviewJob*>(p);
+    const PreviewOutput& output = *job.output;
+    const unsigned int firstBlock = (output.firstRow + index) * output.blocksPerRow + output.firstColumn;
+    decodePreviewBlocks(output, job.format, job.blocks + firstBlock * blockBytes(job.format), job.alphaOnly,
+                        firstBlock, output.lastColumn - output.firstColumn);
+}
+
+unsigned int HapBlockDecoder::decodePreview(const void* frame, size_t frameBytes, int width, int height, const Region* region, int scale,
+                                            void* rgba, size_t rowBytes, HapDecodePool* pool)
+{
+    PreviewOutput output;
+    if (!frame || !rgba || !makePreviewOutput(width, height, region, scale, output) || rowBytes < (size_t)output.width * 4)
+        return HapResult_Bad_Arguments;
+    output.rgba = static_cast<uint8_t*>(rgba);
+    output.rowBytes = rowBytes;
+
+    unsigned int textureCount = 0;
+    unsigned int result = HapGetFrameTextureCount(frame, frameBytes, &textureCount);
+    if (result != HapResult_No_Error)
+        return result;
+    unsigned int formats[2] = { 0, 0 };
+    for (unsigned int i = 0; i < textureCount && i < 2; i++)
+    {
+        result = HapGetFrameTextureFormat(frame, frameBytes, i, &formats[i]);
+        if (result != HapResult_No_Error)
+            return result;
+    }
+    result = checkFormats(formats, textureCount);
+    if (result != HapResult_No_Error)
+        return result;
+
+    // Same passes as decodeFrame, the alpha texture of Hap Q Alpha only writes the averaged alpha
+    for (unsigned int i = 0; i < textureCount; i++)
+    {
+        ChunkJob job;
+        job.preview = &output;
+        job.format = formats[i];
+        job.alphaOnly = i > 0;
+        HapChunkSink sink = { chunkBuffer, chunkDecoded, &job, previewChunkWanted };
+        unsigned long decodedBytes = 0;
+        unsigned int textureFormat;
+        result = HapDecodeToSink(frame, frameBytes, i, HapMTDecode, pool, &sink, &decodedBytes, &textureFormat);
+        if (result != HapResult_No_Error)
+            return result;
+        if (decodedBytes < blockBytes(formats[i]) * output.blockCount)
+            return HapResult_Bad_Frame;
+
+        if (job.misaligned)
+        {
+            std::vector<uint8_t> buffer(decodedBytes);
+            result = HapDecode(frame, frameBytes, i, HapMTDecode, pool, buffer.data(), buffer.size(), &decodedBytes, &textureFormat);
+            if (result != HapResult_No_Error)
+                return result;
+            PreviewJob previewJob = { &output, formats[i], buffer.data(), job.alphaOnly };
+            const unsigned int rows = output.lastRow - output.firstRow;
+            if (pool && rows > 1)
+            {
+                pool->run(decodePreviewRow, &previewJob, rows);
+            }
+            else
+            {
+                for (unsigned int row = 0; row < rows; row++)
+                    decodePreviewRow(&previewJob, row);
+            }
+        }
+    }
+    return HapResult_No_Error;
+}
+
+const char* HapBlockDecoder::instructionSet()
+{
+#if defined(HAP_BLOCK_AVX2)
+    return "SSSE3 + AVX2";
+#elif defined(HAP_BLOCK_SSSE3)
+    return "SSSE3";
+#elif defined(HAP_BLOCK_NEON)
+    return "NEON";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,61 @@
+#ifndef HAPBLOCKDECODER_H
+#define HAPBLOCKDECODER_H
+
+#include <cstddef>
+
+class HapDecodePool;
+
+// CPU decoder of the textures HapDecode outputs (DXT1, DXT5, YCoCg DXT5 and RGTC1 blocks) into RGBA8 pixels
+// for paths without a GPU. Colours match the fragment shaders of the GPU path: YCoCg textures go through the
+// scaled CoCg math of ScaledCoCgYToRGBA.frag and an A_RGTC1 second texture becomes the alpha channel,
+// as in ScaledCoCgYPlusAToRGBA.frag
+class HapBlockDecoder
+{
+public:
+    struct Texture
+    {
+        const void* data;
+        size_t size;
+        unsigned int format;
+    };
+
+    // Decodes width x height pixels of the textures of one frame into rgba, rows of pixels are rowBytes apart
+    // textureCount is 1, or 2 for HapTextureFormat_YCoCg_DXT5 followed by HapTextureFormat_A_RGTC1
+    // A lone HapTextureFormat_A_RGTC1 texture decodes to black pixels with alpha, as an A8 texture samples
+    // Rows of blocks are spread over the threads of pool when it isn't null
+    // Returns a HapResult
+    static unsigned int decode(const Texture* textures, unsigned int textureCount, int width, int height,
+                               void* rgba, size_t rowBytes, HapDecodePool* pool = nullptr);
+
+    // Decodes a HAP frame straight to RGBA8 pixels, same layout and colours as decode
+    // Each chunk is decompressed into a scratch buffer of its decode thread and turned into pixels right away,
+    // the DXT texture never goes through memory. Chunks are decoded in parallel by HapMTDecode (on pool on Linux)
+    // Returns a HapResult
+    static unsigned int decodeFrame(const void* frame, size_t frameBytes, int width, int height,
+                                    void* rgba, size_t rowBytes, HapDecodePool* pool = nullptr);
+
+    // Rectangle of a frame, in pixels from the top left corner
+    struct Region
+    {
+        int x, y;
+        int width, height;
+    };
+
+    // Size of the pixels decodePreview outputs for region of a width x height frame (the whole frame when null) at 1 / scale
+    // Returns false when scale isn't 1, 2 or 4 or the region is empty or out of the frame
+    static bool previewSize(int width, int height, const Region* region, int scale, int& previewWidth, int& previewHeight);
+
+    // Decodes the region of a HAP frame (the whole frame when null) to RGBA8 pixels scaled down by scale (1, 2 or 4),
+    // for preview monitors and thumbnails. The region is rounded out to whole 4x4 blocks, each output pixel averages
+    // a scale x scale square of a block (for Hap Q, of YCoCg values before their conversion, like GPU filtering).
+    // Chunks holding no block row of the region are not even decompressed, so decode time follows the region.
+    // At 1 / 4 blocks are averaged from their palette endpoints without being decoded, which may round a channel one up
+    // Returns a HapResult
+    static unsigned int decodePreview(const void* frame, size_t frameBytes, int width, int height, const Region* region, int scale,
+                                      void* rgba, size_t rowBytes, HapDecodePool* pool = nullptr);
+
+    // Instruction set the block kernels were built for
+    static const char* instructionSet();
+};
+
+#endif // HAPBLOCKDECODER_H
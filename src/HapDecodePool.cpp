@@ -0,0 +1,180 @@
+#include "HapDecodePool.h"
+
+#include <cmath>
+
+#if defined( Linux )
+    #include <pthread.h>
+    #include <sched.h>
+#endif
+
+// Number of batches each thread should get from a frame, more balances better, fewer contends less
+#define HAP_DECODE_BATCHES_PER_THREAD 4
+
+HapDecodePool& HapDecodePool::instance()
+{
+    static HapDecodePool pool;
+    return pool;
+}
+
+HapDecodePool::HapDecodePool(unsigned int workerCount, bool pinWorkers)
+{
+    unsigned int hardwareThreads = std::thread::hardware_concurrency();
+    if (hardwareThreads == 0)
+        hardwareThreads = 1;
+    // The thread calling run() works too
+    if (workerCount == 0)
+        workerCount = hardwareThreads - 1;
+
+    for (unsigned int i = 0; i < workerCount; i++)
+    {
+        m_workers.emplace_back(&HapDecodePool::workerMain, this, i);
+        #if defined( Linux )
+            if (pinWorkers)
+            {
+                // Workers take cores 1 and up, one each. Threads calling run() are not pinned (several may call it), so
+                // core 0 is only left free for the OS to schedule them on
+                cpu_set_t cpuSet;
+                CPU_ZERO(&cpuSet);
+                CPU_SET((i + 1) % hardwareThreads, &cpuSet);
+                pthread_setaffinity_np(m_workers.back().native_handle(), sizeof(cpu_set_t), &cpuSet);
+            }
+        #else
+            (void)pinWorkers;
+        #endif
+    }
+}
+
+HapDecodePool::~HapDecodePool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (std::thread& worker : m_workers)
+        worker.join();
+}
+
+bool HapDecodePool::runBatch(Job* job)
+{
+    unsigned int first = job->next.fetch_add(job->batchSize, std::memory_order_relaxed);
+    if (first >= job->count)
+        return false;
+    unsigned int last = first + job->batchSize;
+    if (last > job->count)
+        last = job->count;
+    for (unsigned int i = first; i < last; i++)
+        job->function(job->p, i);
+    job->done.fetch_add(last - first, std::memory_order_release);
+    return true;
+}
+
+bool HapDecodePool::runAnyBatch(unsigned int firstSlot)
+{
+    uint64_t activeSlots = m_activeSlots.load();
+    if (activeSlots == 0)
+        return false;
+
+    // Pick the job with the earliest deadline, scanning from firstSlot so jobs with the same deadline take turns
+    JobSlot* bestSlot = nullptr;
+    Job* bestJob = nullptr;
+    for (int n = 0; n < MAX_JOBS; n++)
+    {
+        int index = (firstSlot + n) % MAX_JOBS;
+        if (!(activeSlots & ((uint64_t)1 << index)))
+            continue;
+        JobSlot& slot = m_slots[index];
+        // Register before looking at the job so its owner waits for us
+        slot.users.fetch_add(1);
+        Job* job = slot.job.load();
+        if (job && job->next.load(std::memory_order_relaxed) < job->count
+            && (!bestJob || job->deadlineMs < bestJob->deadlineMs))
+        {
+            if (bestSlot)
+                bestSlot->users.fetch_sub(1);
+            bestSlot = &slot;
+            bestJob = job;
+        }
+        else
+        {
+            slot.users.fetch_sub(1);
+        }
+    }
+    if (!bestJob)
+        return false;
+
+    // One batch at a time so a job with an earlier deadline is picked up as soon as it shows up
+    bool worked = runBatch(bestJob);
+    bestSlot->users.fetch_sub(1);
+    return worked;
+}
+
+void HapDecodePool::workerMain(unsigned int workerIndex)
+{
+    unsigned int turn = workerIndex;
+    for (;;)
+    {
+        unsigned int generation = m_generation.load();
+        if (runAnyBatch(turn++))
+            continue;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.wait(lock, [&] { return m_stop || m_generation.load() != generation; });
+        if (m_stop)
+            return;
+    }
+}
+
+void HapDecodePool::run(HapDecodeWorkFunction function, void *p, unsigned int count, double deadlineMs)
+{
+    if (count == 0)
+        return;
+
+    Job job;
+    job.function = function;
+    job.p = p;
+    job.count = count;
+    job.deadlineMs = deadlineMs > 0 ? deadlineMs : HUGE_VAL;
+    job.batchSize = count / ((workerCount() + 1) * HAP_DECODE_BATCHES_PER_THREAD);
+    if (job.batchSize == 0)
+        job.batchSize = 1;
+
+    // Find a free slot, without one (or without workers) decode everything on this thread
+    JobSlot* slot = nullptr;
+    uint64_t slotBit = 0;
+    if (!m_workers.empty() && count > 1)
+    {
+        for (int i = 0; i < MAX_JOBS && !slot; i++)
+        {
+            bool expected = false;
+            if (m_slots[i].busy.compare_exchange_strong(expected, true))
+            {
+                slot = &m_slots[i];
+                slotBit = (uint64_t)1 << i;
+            }
+        }
+    }
+    if (!slot)
+    {
+        while (runBatch(&job)) {}
+        return;
+    }
+
+    slot->job.store(&job);
+    m_activeSlots.fetch_or(slotBit);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_generation.fetch_add(1);
+    }
+    m_wake.notify_all();
+
+    while (runBatch(&job)) {}
+    while (job.done.load(std::memory_order_acquire) != count)
+        std::this_thread::yield();
+
+    // Unpublish and wait for workers still looking at the job before it goes out of scope
+    m_activeSlots.fetch_and(~slotBit);
+    slot->job.store(nullptr);
+    while (slot->users.load() != 0)
+        std::this_thread::yield();
+    slot->busy.store(false);
+}
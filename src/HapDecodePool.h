@@ -0,0 +1,77 @@
+#ifndef HAPDECODEPOOL_H
+#define HAPDECODEPOOL_H
+
+#include "hap/hap.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of decode threads running the chunk work of HapDecode
+// Several frames (from several streams) can be decoded at once: each one is published as a job
+// and idle workers steal batches of chunks from any active job. Jobs live on the caller's stack,
+// running a frame does not allocate.
+// Workers serve the job with the earliest deadline first, jobs with the same deadline take turns batch by batch.
+class HapDecodePool
+{
+public:
+    // Process wide pool with one worker per hardware thread
+    static HapDecodePool& instance();
+
+    // workerCount 0 picks one worker per hardware thread but one (the caller works too), pinned workers stick to one core each (Linux only)
+    explicit HapDecodePool(unsigned int workerCount = 0, bool pinWorkers = true);
+    ~HapDecodePool();
+
+    HapDecodePool(const HapDecodePool&) = delete;
+    HapDecodePool& operator=(const HapDecodePool&) = delete;
+
+    // Calls function(p, i) for every i in [0, count) and returns once all calls are done
+    // The calling thread decodes too while waiting
+    // deadlineMs (steady clock, see FrameScheduler::nowMs) ranks the job against the others, 0 runs it after every job with a deadline
+    void run(HapDecodeWorkFunction function, void *p, unsigned int count, double deadlineMs = 0);
+
+    unsigned int workerCount() const { return (unsigned int)m_workers.size(); }
+
+private:
+    struct Job
+    {
+        HapDecodeWorkFunction function;
+        void* p;
+        unsigned int count;
+        unsigned int batchSize;
+        double deadlineMs;
+        std::atomic<unsigned int> next{0};
+        std::atomic<unsigned int> done{0};
+    };
+
+    // A job slot outlives the jobs it holds so workers can safely look at it at any time
+    struct alignas(64) JobSlot
+    {
+        std::atomic<Job*> job{nullptr};
+        // Workers currently looking at job, the owner waits for them before leaving
+        std::atomic<int> users{0};
+        std::atomic<bool> busy{false};
+    };
+
+    // Maximum number of frames decoding at once, more run on their caller thread alone
+    static const int MAX_JOBS = 64;
+
+    void workerMain(unsigned int workerIndex);
+    bool runBatch(Job* job);
+    bool runAnyBatch(unsigned int firstSlot);
+
+    JobSlot m_slots[MAX_JOBS];
+    // One bit per slot holding a job, lets workers skip empty slots
+    std::atomic<uint64_t> m_activeSlots{0};
+
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::atomic<unsigned int> m_generation{0};
+    bool m_stop = false;
+};
+
+#endif // HAPDECODEPOOL_H
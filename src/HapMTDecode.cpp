@@ -0,0 +1,32 @@
+#include "HapMTDecode.h"
+#include "HapDecodePool.h"
+
+#if defined(__APPLE__)
+    #include <dispatch/dispatch.h>
+#elif !defined( Linux )
+    #include <ppl.h>
+#endif
+void HapMTDecode(HapDecodeWorkFunction function, void *info, unsigned int count, void *callbackInfo)
+{
+    #if defined(__APPLE__)
+        (void)callbackInfo;
+        dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t index) {
+            function(info, (unsigned int)index);
+        });
+    #elif defined( Linux )
+        // callbackInfo may select a specific pool, otherwise the process wide one is used
+        HapDecodePool* pool = callbackInfo ? static_cast<HapDecodePool*>(callbackInfo) : &HapDecodePool::instance();
+        pool->run(function, info, count);
+    #else
+        (void)callbackInfo;
+        concurrency::parallel_for((unsigned int)0, count, [&](unsigned int i) {
+            function(info, i);
+        });
+    #endif
+}
+
+void HapScheduledDecode(HapDecodeWorkFunction function, void *info, unsigned int count, void *callbackInfo)
+{
+    const HapDecodeSchedule* schedule = static_cast<const HapDecodeSchedule*>(callbackInfo);
+    schedule->pool->run(function, info, count, schedule->deadlineMs);
+}
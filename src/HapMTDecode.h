@@ -0,0 +1,23 @@
+#ifndef HAPMTDECODE_H
+#define HAPMTDECODE_H
+
+#include "hap/hap.h"
+
+// HapDecodeCallback running the chunk decodes of a frame in parallel
+// On Linux callbackInfo may point to the HapDecodePool to use, nullptr uses the process wide pool
+void HapMTDecode(HapDecodeWorkFunction function, void *info, unsigned int count, void *callbackInfo);
+
+class HapDecodePool;
+
+// Pool and deadline of the decode of one frame, when several streams share a pool
+struct HapDecodeSchedule
+{
+    HapDecodePool* pool;
+    double deadlineMs;
+};
+
+// HapDecodeCallback running the chunk decodes on the pool of a HapDecodeSchedule passed as callbackInfo,
+// on every platform, ranked by its deadline against the frames of the other streams
+void HapScheduledDecode(HapDecodeWorkFunction function, void *info, unsigned int count, void *callbackInfo);
+
+#endif // HAPMTDECODE_H
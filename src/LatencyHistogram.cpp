@@ -0,0 +1,83 @@
+#include "LatencyHistogram.h"
+
+#include <cmath>
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::reset()
+{
+    for (std::atomic<uint64_t>& bucket : m_buckets)
+        bucket.store(0, std::memory_order_relaxed);
+    m_count.store(0, std::memory_order_relaxed);
+    m_sumUs.store(0, std::memory_order_relaxed);
+    m_maxUs.store(0, std::memory_order_relaxed);
+}
+
+unsigned int LatencyHistogram::bucketIndex(uint64_t valueUs)
+{
+    if (valueUs < LINEAR_BUCKETS)
+        return (unsigned int)valueUs;
+    // Keep the 5 most significant bits: the leading 1 and the 16 sub buckets of the power of 2
+    unsigned int highestBit = 63;
+    while (!(valueUs >> highestBit))
+        highestBit--;
+    unsigned int shift = highestBit - 4;
+    if (shift > MAX_SHIFT)
+        return BUCKET_COUNT - 1;
+    unsigned int subBucket = (unsigned int)(valueUs >> shift) - SUB_BUCKETS;
+    return LINEAR_BUCKETS + (shift - 1) * SUB_BUCKETS + subBucket;
+}
+
+uint64_t LatencyHistogram::bucketHighestValue(unsigned int index)
+{
+    if (index < LINEAR_BUCKETS)
+        return index;
+    unsigned int shift = (index - LINEAR_BUCKETS) / SUB_BUCKETS + 1;
+    uint64_t subBucket = (index - LINEAR_BUCKETS) % SUB_BUCKETS + SUB_BUCKETS;
+    return ((subBucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(double valueMs)
+{
+    uint64_t valueUs = valueMs > 0 ? (uint64_t)llround(valueMs * 1000.0) : 0;
+    m_buckets[bucketIndex(valueUs)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sumUs.fetch_add(valueUs, std::memory_order_relaxed);
+    uint64_t maxUs = m_maxUs.load(std::memory_order_relaxed);
+    while (valueUs > maxUs && !m_maxUs.compare_exchange_weak(maxUs, valueUs, std::memory_order_relaxed))
+        ;
+}
+
+double LatencyHistogram::quantileMs(double quantile) const
+{
+    // Buckets are read one by one while other threads record, sum them instead of trusting m_count
+    uint64_t counts[BUCKET_COUNT];
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < BUCKET_COUNT; i++)
+    {
+        counts[i] = m_buckets[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if (!total)
+        return 0;
+
+    uint64_t rank = (uint64_t)ceil(quantile * total);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < BUCKET_COUNT; i++)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+        {
+            // The highest value recorded is known exactly, don't report more
+            uint64_t valueUs = bucketHighestValue(i);
+            uint64_t maxUs = m_maxUs.load(std::memory_order_relaxed);
+            return (valueUs < maxUs ? valueUs : maxUs) / 1000.0;
+        }
+    }
+    return maxMs();
+}
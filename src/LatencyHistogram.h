@@ -0,0 +1,44 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <atomic>
+#include <cstdint>
+
+// Latency distribution with a bounded relative error, in the manner of HdrHistogram
+// Values are counted in microseconds: exactly below 32us, then 16 linear buckets per power of 2 (error under 6.25%)
+// up to about 38 hours. Recording is lock free and can happen from any thread while other threads read
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void record(double valueMs);
+
+    uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+    double sumMs() const { return m_sumUs.load(std::memory_order_relaxed) / 1000.0; }
+    double maxMs() const { return m_maxUs.load(std::memory_order_relaxed) / 1000.0; }
+
+    // Highest value of the bucket holding the quantile (0 to 1) of the recorded values, 0 when empty
+    double quantileMs(double quantile) const;
+
+    void reset();
+
+private:
+    static unsigned int bucketIndex(uint64_t valueUs);
+    static uint64_t bucketHighestValue(unsigned int index);
+
+    static const unsigned int LINEAR_BUCKETS = 32;
+    static const unsigned int SUB_BUCKETS = 16;
+    static const unsigned int MAX_SHIFT = 32;
+    static const unsigned int BUCKET_COUNT = LINEAR_BUCKETS + SUB_BUCKETS * MAX_SHIFT;
+
+    std::atomic<uint64_t> m_buckets[BUCKET_COUNT];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sumUs;
+    std::atomic<uint64_t> m_maxUs;
+};
+
+#endif // LATENCYHISTOGRAM_H
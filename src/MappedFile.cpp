@@ -0,0 +1,243 @@
+#include "MappedFile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// Size of the buffer libavformat reads the container headers through
+#define MAPPED_FILE_IO_BUFFER_SIZE (64 * 1024)
+
+// How far ahead of the packet being read the kernel is asked to read
+#define MAPPED_FILE_READAHEAD_BYTES (64 * 1024 * 1024)
+
+MappedFile::MappedFile()
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+int MappedFile::open(const char* path)
+{
+    close();
+    #ifdef _WIN32
+        HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            m_error = "Could not open file";
+            return -1;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            CloseHandle(file);
+            m_error = "Could not get file size";
+            return -1;
+        }
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!mapping) {
+            CloseHandle(file);
+            m_error = "Could not create file mapping";
+            return -1;
+        }
+        void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!data) {
+            CloseHandle(mapping);
+            CloseHandle(file);
+            m_error = "Could not map file";
+            return -1;
+        }
+        m_fileHandle = file;
+        m_mappingHandle = mapping;
+        m_data = static_cast<uint8_t*>(data);
+        m_size = fileSize.QuadPart;
+    #else
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            m_error = "Could not open file";
+            return -1;
+        }
+        struct stat fileStat;
+        if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+            ::close(fd);
+            m_error = "Could not get file size";
+            return -1;
+        }
+        void* data = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        // The mapping keeps the file alive
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            m_error = "Could not map file";
+            return -1;
+        }
+        m_data = static_cast<uint8_t*>(data);
+        m_size = fileStat.st_size;
+        // Playback reads the file front to back, let the kernel read ahead aggressively and drop pages behind us
+        madvise(m_data, m_size, MADV_SEQUENTIAL);
+    #endif
+    m_ioPosition = 0;
+    return 0;
+}
+
+void MappedFile::close()
+{
+    if (m_ioContext) {
+        av_freep(&m_ioContext->buffer);
+        avio_context_free(&m_ioContext);
+    }
+    if (!m_data)
+        return;
+    #ifdef _WIN32
+        UnmapViewOfFile(m_data);
+        CloseHandle(m_mappingHandle);
+        CloseHandle(m_fileHandle);
+        m_mappingHandle = nullptr;
+        m_fileHandle = nullptr;
+    #else
+        munmap(m_data, m_size);
+    #endif
+    m_data = nullptr;
+    m_size = 0;
+}
+
+void MappedFile::prefetch(int64_t offset, int64_t length)
+{
+    if (!m_data || offset >= m_size || length <= 0)
+        return;
+    length = std::min(length, m_size - offset);
+    #ifdef _WIN32
+        WIN32_MEMORY_RANGE_ENTRY range;
+        range.VirtualAddress = m_data + offset;
+        range.NumberOfBytes = static_cast<SIZE_T>(length);
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    #else
+        // madvise needs a page aligned address
+        static const int64_t pageSize = sysconf(_SC_PAGESIZE);
+        int64_t alignedOffset = offset & ~(pageSize - 1);
+        madvise(m_data + alignedOffset, length + (offset - alignedOffset), MADV_WILLNEED);
+    #endif
+}
+
+AVIOContext* MappedFile::ioContext()
+{
+    if (!m_data)
+        return nullptr;
+    if (!m_ioContext) {
+        unsigned char* buffer = static_cast<unsigned char*>(av_malloc(MAPPED_FILE_IO_BUFFER_SIZE));
+        if (!buffer)
+            return nullptr;
+        m_ioContext = avio_alloc_context(buffer, MAPPED_FILE_IO_BUFFER_SIZE, 0, this, &MappedFile::readCallback, nullptr, &MappedFile::seekCallback);
+        if (!m_ioContext) {
+            av_free(buffer);
+            return nullptr;
+        }
+    }
+    return m_ioContext;
+}
+
+int MappedFile::readCallback(void* opaque, uint8_t* buf, int bufSize)
+{
+    MappedFile* file = static_cast<MappedFile*>(opaque);
+    int64_t remaining = file->m_size - file->m_ioPosition;
+    if (remaining <= 0)
+        return AVERROR_EOF;
+    int length = static_cast<int>(std::min<int64_t>(bufSize, remaining));
+    memcpy(buf, file->m_data + file->m_ioPosition, length);
+    file->m_ioPosition += length;
+    return length;
+}
+
+int64_t MappedFile::seekCallback(void* opaque, int64_t offset, int whence)
+{
+    MappedFile* file = static_cast<MappedFile*>(opaque);
+    int64_t position;
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return file->m_size;
+        case SEEK_SET:
+            position = offset;
+            break;
+        case SEEK_CUR:
+            position = file->m_ioPosition + offset;
+            break;
+        case SEEK_END:
+            position = file->m_size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    if (position < 0 || position > file->m_size)
+        return AVERROR(EINVAL);
+    file->m_ioPosition = position;
+    return position;
+}
+
+// The mapping owns the memory, packets only borrow it
+static void noopFree(void*, uint8_t*)
+{
+}
+
+MappedPacketSource::MappedPacketSource(MappedFile& file, const PacketIndex& index, int streamIndex)
+    :m_file(file),
+     m_index(index),
+     m_streamIndex(streamIndex)
+{
+}
+
+int MappedPacketSource::readPacket(AVPacket* packet)
+{
+    if (m_nextEntry >= m_index.size())
+        return AVERROR_EOF;
+    const PacketIndex::Entry& entry = m_index[m_nextEntry];
+    if (entry.pos + entry.size > m_file.size())
+        return AVERROR_INVALIDDATA;
+
+    // Keep the kernel a window ahead of us, refilled once half of it was consumed
+    if (entry.pos + entry.size + MAPPED_FILE_READAHEAD_BYTES / 2 > m_prefetchedUntil) {
+        int64_t start = std::max(m_prefetchedUntil, entry.pos);
+        m_file.prefetch(start, entry.pos + MAPPED_FILE_READAHEAD_BYTES - start);
+        m_prefetchedUntil = entry.pos + MAPPED_FILE_READAHEAD_BYTES;
+    }
+
+    // HAP decoding never reads past the frame so the usual input padding is not needed
+    uint8_t* data = const_cast<uint8_t*>(m_file.data()) + entry.pos;
+    packet->buf = av_buffer_create(data, entry.size, noopFree, nullptr, AV_BUFFER_FLAG_READONLY);
+    if (!packet->buf)
+        return AVERROR(ENOMEM);
+    packet->data = data;
+    packet->size = entry.size;
+    packet->pts = entry.pts;
+    packet->dts = entry.pts;
+    packet->duration = entry.duration;
+    packet->pos = entry.pos;
+    packet->stream_index = m_streamIndex;
+    packet->flags |= AV_PKT_FLAG_KEY;
+    m_nextEntry++;
+    return 0;
+}
+
+int MappedPacketSource::rewind()
+{
+    m_nextEntry = 0;
+    m_prefetchedUntil = 0;
+    return 0;
+}
+
+int MappedPacketSource::seekToEntry(size_t entry)
+{
+    if (entry >= m_index.size())
+        return AVERROR(EINVAL);
+    m_nextEntry = entry;
+    // Restart the read-ahead window from the new position
+    m_prefetchedUntil = 0;
+    return 0;
+}
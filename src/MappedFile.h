@@ -0,0 +1,75 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+#include "HAPPacketSource.h"
+#include "PacketIndex.h"
+
+// Read only memory mapping of a whole movie file
+// Also exposes the mapping as an AVIOContext so libavformat parses the container without the file protocol copies
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Returns 0 on success
+    int open(const char* path);
+    void close();
+
+    const uint8_t* data() const { return m_data; }
+    int64_t size() const { return m_size; }
+
+    // Asks the kernel to start reading a range ahead of time
+    void prefetch(int64_t offset, int64_t length);
+
+    // Owned by the mapped file, set it as pb of a format context before avformat_open_input
+    // The format context must be opened with AVFMT_FLAG_CUSTOM_IO and closed before the mapped file
+    AVIOContext* ioContext();
+
+    const char* get_error() const { return m_error; }
+
+private:
+    static int readCallback(void* opaque, uint8_t* buf, int bufSize);
+    static int64_t seekCallback(void* opaque, int64_t offset, int whence);
+
+    uint8_t* m_data = nullptr;
+    int64_t m_size = 0;
+    int64_t m_ioPosition = 0;
+    AVIOContext* m_ioContext = nullptr;
+    const char* m_error = "";
+
+    #ifdef _WIN32
+        void* m_fileHandle = nullptr;
+        void* m_mappingHandle = nullptr;
+    #endif
+};
+
+// Emits packets pointing into the mapping, located with the packet index
+// Packets are read only and must be freed before the mapped file is closed
+class MappedPacketSource : public HAPPacketSource
+{
+public:
+    MappedPacketSource(MappedFile& file, const PacketIndex& index, int streamIndex);
+
+    int readPacket(AVPacket* packet) override;
+    int rewind() override;
+    int seekToEntry(size_t entry) override;
+
+private:
+    MappedFile& m_file;
+    const PacketIndex& m_index;
+    int m_streamIndex;
+    size_t m_nextEntry = 0;
+    int64_t m_prefetchedUntil = 0;
+};
+
+#endif // MAPPEDFILE_H
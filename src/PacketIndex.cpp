@@ -0,0 +1,138 @@
+#include "PacketIndex.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifndef AVINDEX_DISCARD_FRAME
+    #define AVINDEX_DISCARD_FRAME 0x0002
+#endif
+
+void PacketIndex::addEntry(const Entry& entry)
+{
+    if (!m_entries.empty() && m_entries.back().duration <= 0)
+        m_entries.back().duration = entry.pts - m_entries.back().pts;
+    if (entry.size > m_maxPacketSize)
+        m_maxPacketSize = entry.size;
+    m_entries.push_back(entry);
+}
+
+void PacketIndex::finish(AVStream* stream)
+{
+    m_timeBase = stream->time_base;
+
+    // The last frame lasts until the end of the stream, or as long as the previous one
+    Entry& last = m_entries.back();
+    if (last.duration > 0)
+        return;
+    if (stream->duration != AV_NOPTS_VALUE && stream->duration > last.pts - m_entries.front().pts)
+        last.duration = m_entries.front().pts + stream->duration - last.pts;
+    else if (m_entries.size() > 1)
+        last.duration = m_entries[m_entries.size() - 2].duration;
+}
+
+bool PacketIndex::buildFromContainer(AVFormatContext* formatCtx, int streamIndex)
+{
+    AVStream* stream = formatCtx->streams[streamIndex];
+    m_entries.clear();
+    m_maxPacketSize = 0;
+    m_fileRanges = false;
+
+    // Other containers index packet headers or clusters rather than payloads
+    if (!formatCtx->iformat || !strstr(formatCtx->iformat->name, "mov"))
+        return false;
+
+    #if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+        int entryCount = avformat_index_get_entries_count(stream);
+    #else
+        int entryCount = stream->nb_index_entries;
+    #endif
+
+    m_entries.reserve(entryCount);
+    for (int i = 0; i < entryCount; i++)
+    {
+        #if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+            const AVIndexEntry* indexEntry = avformat_index_get_entry(stream, i);
+        #else
+            const AVIndexEntry* indexEntry = &stream->index_entries[i];
+        #endif
+        // Edit lists can leave entries that must not be shown
+        if (indexEntry->flags & AVINDEX_DISCARD_FRAME)
+            continue;
+        if (indexEntry->size <= 0 || indexEntry->pos < 0)
+        {
+            m_entries.clear();
+            return false;
+        }
+        // HAP frames are never reordered, index timestamps (dts) are presentation timestamps
+        Entry entry = { indexEntry->pos, indexEntry->size, indexEntry->timestamp, 0 };
+        addEntry(entry);
+    }
+    if (m_entries.empty())
+        return false;
+
+    finish(stream);
+    m_fileRanges = true;
+    return true;
+}
+
+bool PacketIndex::buildByScan(AVFormatContext* formatCtx, int streamIndex)
+{
+    AVStream* stream = formatCtx->streams[streamIndex];
+    m_entries.clear();
+    m_maxPacketSize = 0;
+    m_fileRanges = false;
+
+    // Let the demuxer skip the payload of the other streams
+    std::vector<AVDiscard> discards(formatCtx->nb_streams);
+    for (unsigned int i = 0; i < formatCtx->nb_streams; i++)
+    {
+        discards[i] = formatCtx->streams[i]->discard;
+        if ((int)i != streamIndex)
+            formatCtx->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    AVPacket* packet = av_packet_alloc();
+    while (av_read_frame(formatCtx, packet) >= 0)
+    {
+        if (packet->stream_index == streamIndex)
+        {
+            int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+            if (pts == AV_NOPTS_VALUE && !m_entries.empty())
+                pts = m_entries.back().pts + std::max<int64_t>(m_entries.back().duration, 1);
+            Entry entry = { packet->pos, packet->size, pts != AV_NOPTS_VALUE ? pts : 0, packet->duration };
+            addEntry(entry);
+        }
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+
+    for (unsigned int i = 0; i < formatCtx->nb_streams; i++)
+        formatCtx->streams[i]->discard = discards[i];
+    av_seek_frame(formatCtx, -1, 0, AVSEEK_FLAG_BACKWARD);
+
+    if (m_entries.empty())
+        return false;
+    finish(stream);
+    return true;
+}
+
+size_t PacketIndex::entryAtPts(int64_t pts) const
+{
+    if (m_entries.empty())
+        return 0;
+    // Last entry starting at or before pts
+    auto it = std::upper_bound(m_entries.begin(), m_entries.end(), pts,
+                               [](int64_t value, const Entry& entry) { return value < entry.pts; });
+    if (it == m_entries.begin())
+        return 0;
+    return (it - m_entries.begin()) - 1;
+}
+
+size_t PacketIndex::entryAtTime(double seconds) const
+{
+    if (m_entries.empty())
+        return 0;
+    int64_t pts = m_entries.front().pts + (int64_t)llround(seconds / av_q2d(m_timeBase));
+    return entryAtPts(pts);
+}
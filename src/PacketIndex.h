@@ -0,0 +1,56 @@
+#ifndef PACKETINDEX_H
+#define PACKETINDEX_H
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+#include <vector>
+
+// Position, size and timing of every packet of a stream, in presentation order
+// Every HAP frame is an intra frame so any entry can be decoded on its own
+class PacketIndex
+{
+public:
+    struct Entry
+    {
+        int64_t pos;
+        int size;
+        int64_t pts;
+        int64_t duration;
+    };
+
+    // Builds the index from the sample tables libavformat read from a mov/mp4 container
+    // Returns false if the container has no usable index
+    bool buildFromContainer(AVFormatContext* formatCtx, int streamIndex);
+
+    // Builds the index by reading every packet of the stream once, then seeks back to the start
+    // Positions are the ones reported by the demuxer and may not point at the payload (matroska blocks...)
+    bool buildByScan(AVFormatContext* formatCtx, int streamIndex);
+
+    size_t size() const { return m_entries.size(); }
+    bool empty() const { return m_entries.empty(); }
+    const Entry& operator[](size_t i) const { return m_entries[i]; }
+    int maxPacketSize() const { return m_maxPacketSize; }
+    AVRational timeBase() const { return m_timeBase; }
+
+    // True when pos and size of every entry are the exact payload range in the file
+    bool hasFileRanges() const { return m_fileRanges; }
+
+    // Returns the entry shown at pts, or the first / last one out of the stream range
+    size_t entryAtPts(int64_t pts) const;
+    size_t entryAtTime(double seconds) const;
+
+private:
+    void addEntry(const Entry& entry);
+    void finish(AVStream* stream);
+
+    std::vector<Entry> m_entries;
+    int m_maxPacketSize = 0;
+    AVRational m_timeBase = { 1, 1 };
+    bool m_fileRanges = false;
+};
+
+#endif // PACKETINDEX_H
@@ -0,0 +1,96 @@
+#ifndef PACKETQUEUE_H
+#define PACKETQUEUE_H
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+}
+
+#include <atomic>
+#include <vector>
+
+// Bounded single-producer / single-consumer lock-free ring of ref-counted AVPackets
+// The producer owns a packet until push succeeds, the consumer owns it once popped
+// The queue is bounded both by a packet count and by a byte budget
+// Each packet carries the serial of the seek it was read after so stale packets can be told apart
+class PacketQueue
+{
+public:
+    PacketQueue(size_t maxPackets, size_t maxBytes)
+        :m_maxPackets(maxPackets > 0 ? maxPackets : 1),
+         m_maxBytes(maxBytes)
+    {
+        size_t capacity = 1;
+        while (capacity < m_maxPackets)
+            capacity <<= 1;
+        m_slots.resize(capacity, nullptr);
+        m_serials.resize(capacity, 0);
+        m_mask = capacity - 1;
+    }
+
+    // Only call once both threads stopped using the queue
+    ~PacketQueue()
+    {
+        while (AVPacket* packet = pop())
+            av_packet_free(&packet);
+    }
+
+    PacketQueue(const PacketQueue&) = delete;
+    PacketQueue& operator=(const PacketQueue&) = delete;
+
+    // Producer side, returns false when the queue is over budget
+    bool push(AVPacket* packet, int serial = 0)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t head = m_head.load(std::memory_order_acquire);
+        size_t count = tail - head;
+        if (count >= m_maxPackets)
+            return false;
+        // Always accept a packet in an empty queue so a packet larger than the budget can't stall us
+        if (count > 0 && m_maxBytes > 0 && m_bytes.load(std::memory_order_relaxed) + packet->size > m_maxBytes)
+            return false;
+        m_slots[tail & m_mask] = packet;
+        m_serials[tail & m_mask] = serial;
+        m_bytes.fetch_add(packet->size, std::memory_order_relaxed);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side, returns nullptr when empty
+    AVPacket* pop(int* serial = nullptr)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+            return nullptr;
+        AVPacket* packet = m_slots[head & m_mask];
+        if (serial)
+            *serial = m_serials[head & m_mask];
+        m_bytes.fetch_sub(packet->size, std::memory_order_relaxed);
+        m_head.store(head + 1, std::memory_order_release);
+        return packet;
+    }
+
+    size_t size() const
+    {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+
+    size_t bytes() const
+    {
+        return m_bytes.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::vector<AVPacket*> m_slots;
+    std::vector<int> m_serials;
+    size_t m_mask;
+    size_t m_maxPackets;
+    size_t m_maxBytes;
+
+    // Kept on separate cache lines so producer and consumer don't false share
+    alignas(64) std::atomic<size_t> m_head{0};
+    alignas(64) std::atomic<size_t> m_tail{0};
+    alignas(64) std::atomic<size_t> m_bytes{0};
+};
+
+#endif // PACKETQUEUE_H
@@ -0,0 +1,277 @@
+#include "PlaybackMetrics.h"
+
+#include <cstdio>
+#include <cstring>
+
+#if defined( Linux ) || defined( __APPLE__ )
+    #include <poll.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+#endif
+
+// Time the server waits for a connection, or for the request of a client, before checking for stop
+#define METRICS_POLL_TIMEOUT_MS 100
+
+// A client closing early mustn't kill the player with SIGPIPE
+#ifdef MSG_NOSIGNAL
+    #define METRICS_SEND_FLAGS MSG_NOSIGNAL
+#else
+    #define METRICS_SEND_FLAGS 0
+#endif
+
+static const char* g_metricStageNames[FrameTrace::STAGE_COUNT] =
+{
+    "demux",
+    "decompress",
+    "upload",
+    "record",
+    "submit",
+    "present",
+};
+
+std::atomic<PlaybackMetrics*> PlaybackMetrics::s_active(nullptr);
+const char* PlaybackMetrics::s_error = nullptr;
+
+int PlaybackMetrics::start(const char* socketPath)
+{
+    if (active())
+    {
+        s_error = "Metrics already started";
+        return -1;
+    }
+    PlaybackMetrics* metrics = new PlaybackMetrics();
+    if (socketPath && !metrics->listen(socketPath))
+    {
+        delete metrics;
+        return -1;
+    }
+    s_active.store(metrics, std::memory_order_release);
+    FrameTrace::s_stageConsumers.fetch_add(1, std::memory_order_release);
+    return 0;
+}
+
+void PlaybackMetrics::stop()
+{
+    PlaybackMetrics* metrics = s_active.exchange(nullptr, std::memory_order_acq_rel);
+    if (!metrics)
+        return;
+    FrameTrace::s_stageConsumers.fetch_sub(1, std::memory_order_release);
+    delete metrics;
+}
+
+PlaybackMetrics::PlaybackMetrics()
+    : m_presentedFrames(0)
+    , m_droppedFrames(0)
+    , m_lateFrames(0)
+    , m_starvationCount(0)
+    , m_queuedPackets(0)
+    , m_queuedBytes(0)
+    , m_stopping(false)
+{
+}
+
+PlaybackMetrics::~PlaybackMetrics()
+{
+    m_stopping.store(true, std::memory_order_release);
+    if (m_server.joinable())
+        m_server.join();
+    #if defined( Linux ) || defined( __APPLE__ )
+        if (m_listenSocket >= 0)
+        {
+            close(m_listenSocket);
+            unlink(m_socketPath.c_str());
+        }
+    #endif
+}
+
+void PlaybackMetrics::onFramePresented(bool late)
+{
+    m_presentedFrames.fetch_add(1, std::memory_order_relaxed);
+    if (late)
+        m_lateFrames.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PlaybackMetrics::setQueueState(size_t queuedPackets, size_t queuedBytes, size_t starvationCount)
+{
+    m_queuedPackets.store(queuedPackets, std::memory_order_relaxed);
+    m_queuedBytes.store(queuedBytes, std::memory_order_relaxed);
+    m_starvationCount.store(starvationCount, std::memory_order_relaxed);
+}
+
+PlaybackMetrics::LatencySummary PlaybackMetrics::summarize(const LatencyHistogram& histogram)
+{
+    LatencySummary summary;
+    summary.count = histogram.count();
+    if (summary.count)
+        summary.averageMs = histogram.sumMs() / summary.count;
+    summary.p50Ms = histogram.quantileMs(0.5);
+    summary.p90Ms = histogram.quantileMs(0.9);
+    summary.p99Ms = histogram.quantileMs(0.99);
+    summary.p999Ms = histogram.quantileMs(0.999);
+    summary.maxMs = histogram.maxMs();
+    return summary;
+}
+
+PlaybackMetrics::Snapshot PlaybackMetrics::snapshot() const
+{
+    Snapshot snapshot;
+    for (int stage = 0; stage < FrameTrace::STAGE_COUNT; stage++)
+        snapshot.stages[stage] = summarize(m_stageLatencies[stage]);
+    snapshot.gpu = summarize(m_gpuLatency);
+    snapshot.presentedFrames = m_presentedFrames.load(std::memory_order_relaxed);
+    snapshot.droppedFrames = m_droppedFrames.load(std::memory_order_relaxed);
+    snapshot.lateFrames = m_lateFrames.load(std::memory_order_relaxed);
+    snapshot.starvationCount = m_starvationCount.load(std::memory_order_relaxed);
+    snapshot.queuedPackets = m_queuedPackets.load(std::memory_order_relaxed);
+    snapshot.queuedBytes = m_queuedBytes.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+static void appendSummary(std::string& text, const char* stage, const PlaybackMetrics::LatencySummary& summary)
+{
+    struct Quantile { const char* name; double valueMs; };
+    const Quantile quantiles[] =
+    {
+        { "0.5", summary.p50Ms },
+        { "0.9", summary.p90Ms },
+        { "0.99", summary.p99Ms },
+        { "0.999", summary.p999Ms },
+    };
+    char line[256];
+    for (const Quantile& quantile : quantiles)
+    {
+        snprintf(line, sizeof(line), "hap_player_stage_latency_seconds{stage=\"%s\",quantile=\"%s\"} %.6f\n",
+                 stage, quantile.name, quantile.valueMs / 1000.0);
+        text += line;
+    }
+    snprintf(line, sizeof(line), "hap_player_stage_latency_seconds_sum{stage=\"%s\"} %.6f\n"
+                                 "hap_player_stage_latency_seconds_count{stage=\"%s\"} %llu\n",
+             stage, summary.averageMs * summary.count / 1000.0, stage, static_cast<unsigned long long>(summary.count));
+    text += line;
+}
+
+void PlaybackMetrics::writePrometheus(std::string& text) const
+{
+    Snapshot metrics = snapshot();
+    char line[256];
+
+    text += "# HELP hap_player_stage_latency_seconds Time spent per frame in each playback stage.\n";
+    text += "# TYPE hap_player_stage_latency_seconds summary\n";
+    for (int stage = 0; stage < FrameTrace::STAGE_COUNT; stage++)
+        appendSummary(text, g_metricStageNames[stage], metrics.stages[stage]);
+    appendSummary(text, "gpu", metrics.gpu);
+
+    text += "# HELP hap_player_stage_latency_max_seconds Longest time spent by a frame in each playback stage.\n";
+    text += "# TYPE hap_player_stage_latency_max_seconds gauge\n";
+    for (int stage = 0; stage <= FrameTrace::STAGE_COUNT; stage++)
+    {
+        bool gpu = stage == FrameTrace::STAGE_COUNT;
+        snprintf(line, sizeof(line), "hap_player_stage_latency_max_seconds{stage=\"%s\"} %.6f\n",
+                 gpu ? "gpu" : g_metricStageNames[stage], (gpu ? metrics.gpu.maxMs : metrics.stages[stage].maxMs) / 1000.0);
+        text += line;
+    }
+
+    struct Value { const char* name; const char* type; const char* help; unsigned long long value; };
+    const Value values[] =
+    {
+        { "hap_player_frames_presented_total", "counter", "Frames presented.", metrics.presentedFrames },
+        { "hap_player_frames_dropped_total", "counter", "Frames skipped because they were too late.", metrics.droppedFrames },
+        { "hap_player_frames_late_total", "counter", "Frames presented after their presentation time.", metrics.lateFrames },
+        { "hap_player_demux_starvation_total", "counter", "Times playback waited for the demuxer.", metrics.starvationCount },
+        { "hap_player_demux_queue_packets", "gauge", "Packets read ahead of playback.", metrics.queuedPackets },
+        { "hap_player_demux_queue_bytes", "gauge", "Bytes read ahead of playback.", metrics.queuedBytes },
+    };
+    for (const Value& value : values)
+    {
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+                 value.name, value.help, value.name, value.type, value.name, value.value);
+        text += line;
+    }
+}
+
+#if defined( Linux ) || defined( __APPLE__ )
+
+bool PlaybackMetrics::listen(const char* socketPath)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        s_error = "Metrics socket path too long";
+        return false;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    // A socket left by a previous run would make bind fail
+    unlink(socketPath);
+    m_listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_listenSocket < 0)
+    {
+        s_error = "Couldn't create metrics socket";
+        return false;
+    }
+    if (bind(m_listenSocket, (sockaddr*)&address, sizeof(address)) || ::listen(m_listenSocket, 4))
+    {
+        s_error = "Couldn't bind metrics socket";
+        close(m_listenSocket);
+        m_listenSocket = -1;
+        return false;
+    }
+    m_socketPath = socketPath;
+    m_server = std::thread(&PlaybackMetrics::serverMain, this);
+    return true;
+}
+
+// Answers every connection with the current metrics as an HTTP response, whatever the request
+void PlaybackMetrics::serverMain()
+{
+    while (!m_stopping.load(std::memory_order_acquire))
+    {
+        pollfd listenPoll = { m_listenSocket, POLLIN, 0 };
+        if (poll(&listenPoll, 1, METRICS_POLL_TIMEOUT_MS) <= 0)
+            continue;
+        int client = accept(m_listenSocket, nullptr, nullptr);
+        if (client < 0)
+            continue;
+        #ifdef SO_NOSIGPIPE
+            int noSigPipe = 1;
+            setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+        #endif
+
+        // Read the request so closing the connection doesn't reset it before the client read the response
+        pollfd clientPoll = { client, POLLIN, 0 };
+        char request[1024];
+        if (poll(&clientPoll, 1, METRICS_POLL_TIMEOUT_MS) > 0)
+            (void)!read(client, request, sizeof(request));
+
+        std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n";
+        writePrometheus(response);
+        const char* data = response.data();
+        size_t remaining = response.size();
+        while (remaining > 0)
+        {
+            ssize_t written = send(client, data, remaining, METRICS_SEND_FLAGS);
+            if (written <= 0)
+                break;
+            data += written;
+            remaining -= written;
+        }
+        close(client);
+    }
+}
+
+#else
+
+bool PlaybackMetrics::listen(const char* socketPath)
+{
+    (void)socketPath;
+    s_error = "Metrics socket is only available on Linux and macOS";
+    return false;
+}
+
+void PlaybackMetrics::serverMain()
+{
+}
+
+#endif
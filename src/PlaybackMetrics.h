@@ -0,0 +1,93 @@
+#ifndef PLAYBACKMETRICS_H
+#define PLAYBACKMETRICS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#include "FrameTrace.h"
+#include "LatencyHistogram.h"
+
+// Playback health: latency histograms of the frame stages (the ones of FrameTrace, plus GPU time),
+// presented / dropped / late frame counters and demux queue gauges
+// Read them with snapshot(), or scrape them in the Prometheus text format from a Unix socket
+// (curl --unix-socket path http://localhost/metrics). When metrics are off active() is null
+class PlaybackMetrics
+{
+public:
+    struct LatencySummary
+    {
+        uint64_t count = 0;
+        double averageMs = 0;
+        double p50Ms = 0;
+        double p90Ms = 0;
+        double p99Ms = 0;
+        double p999Ms = 0;
+        double maxMs = 0;
+    };
+
+    struct Snapshot
+    {
+        LatencySummary stages[FrameTrace::STAGE_COUNT];
+        // GPU execution of the command buffer of the frames, from timestamp queries around it
+        LatencySummary gpu;
+        uint64_t presentedFrames = 0;
+        uint64_t droppedFrames = 0;
+        // Presented after their presentation time
+        uint64_t lateFrames = 0;
+        uint64_t starvationCount = 0;
+        size_t queuedPackets = 0;
+        size_t queuedBytes = 0;
+    };
+
+    // Starts collecting, and serving the metrics on a Unix socket at socketPath unless it is null
+    // Returns 0 on success, or -1 with the reason in get_error()
+    static int start(const char* socketPath);
+    // Stops serving and collecting, call once playback stopped
+    static void stop();
+    static const char* get_error() { return s_error; }
+
+    // Metrics being collected, or nullptr when they are off
+    static PlaybackMetrics* active() { return s_active.load(std::memory_order_acquire); }
+
+    // Can be called from any thread
+    void recordStage(FrameTrace::Stage stage, double durationMs) { m_stageLatencies[stage].record(durationMs); }
+    void recordGpuLatency(double durationMs) { m_gpuLatency.record(durationMs); }
+    void onFramePresented(bool late);
+    void onFrameDropped() { m_droppedFrames.fetch_add(1, std::memory_order_relaxed); }
+    void setQueueState(size_t queuedPackets, size_t queuedBytes, size_t starvationCount);
+
+    Snapshot snapshot() const;
+    // Appends the metrics in the Prometheus text exposition format
+    void writePrometheus(std::string& text) const;
+
+private:
+    PlaybackMetrics();
+    ~PlaybackMetrics();
+
+    bool listen(const char* socketPath);
+    void serverMain();
+
+    static LatencySummary summarize(const LatencyHistogram& histogram);
+
+    static std::atomic<PlaybackMetrics*> s_active;
+    static const char* s_error;
+
+    LatencyHistogram m_stageLatencies[FrameTrace::STAGE_COUNT];
+    LatencyHistogram m_gpuLatency;
+    std::atomic<uint64_t> m_presentedFrames;
+    std::atomic<uint64_t> m_droppedFrames;
+    std::atomic<uint64_t> m_lateFrames;
+    std::atomic<uint64_t> m_starvationCount;
+    std::atomic<size_t> m_queuedPackets;
+    std::atomic<size_t> m_queuedBytes;
+
+    int m_listenSocket = -1;
+    std::string m_socketPath;
+    std::atomic<bool> m_stopping;
+    std::thread m_server;
+};
+
+#endif // PLAYBACKMETRICS_H
@@ -0,0 +1,79 @@
+#include "ShaderPack.h"
+
+#include "AtomicFile.h"
+#include "MappedFile.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+ShaderPack::ShaderPack()
+    :m_file(new MappedFile())
+{
+}
+
+ShaderPack::~ShaderPack()
+{
+}
+
+int ShaderPack::open(const char* path)
+{
+    m_header = nullptr;
+    m_entries = nullptr;
+    if (m_file->open(path)) {
+        m_error = m_file->get_error();
+        return -1;
+    }
+    const uint8_t* data = m_file->data();
+    uint64_t size = m_file->size();
+    const Header* header = reinterpret_cast<const Header*>(data);
+    if (size < sizeof(Header) || header->magic != MAGIC || header->version != VERSION) {
+        m_error = "Not a shader pack or wrong version";
+        return -1;
+    }
+    if (size < sizeof(Header) + (uint64_t)header->entryCount * sizeof(Entry)) {
+        m_error = "Truncated shader pack";
+        return -1;
+    }
+    const Entry* entries = reinterpret_cast<const Entry*>(data + sizeof(Header));
+    for (uint32_t i = 0; i < header->entryCount; i++) {
+        if (entries[i].offset > size || entries[i].size > size - entries[i].offset
+            || !memchr(entries[i].name, 0, MAX_NAME_LENGTH)) {
+            m_error = "Corrupted shader pack entry";
+            return -1;
+        }
+    }
+    m_header = header;
+    m_entries = entries;
+    return 0;
+}
+
+const ShaderPack::Entry* ShaderPack::find(const char* name, uint32_t conversionType) const
+{
+    if (!m_header)
+        return nullptr;
+    for (uint32_t i = 0; i < m_header->entryCount; i++) {
+        if (m_entries[i].conversionType == conversionType && !strcmp(m_entries[i].name, name))
+            return &m_entries[i];
+    }
+    return nullptr;
+}
+
+const uint8_t* ShaderPack::data(const Entry* entry) const
+{
+    return m_file->data() + entry->offset;
+}
+
+bool ShaderPack::extract(const Entry* entry, const std::string& path) const
+{
+    const uint8_t* content = data(entry);
+    std::FILE* fp = std::fopen(path.c_str(), "rb");
+    if (fp) {
+        std::vector<uint8_t> previousContent(entry->size + 1);
+        size_t previousSize = std::fread(previousContent.data(), 1, previousContent.size(), fp);
+        std::fclose(fp);
+        if (previousSize == entry->size && !memcmp(previousContent.data(), content, entry->size))
+            return true;
+    }
+    return writeFileAtomically(path, content, entry->size);
+}
@@ -0,0 +1,59 @@
+#ifndef SHADERPACK_H
+#define SHADERPACK_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+class MappedFile;
+
+// Shaders precompiled by tools/ShaderPackTool for every target language, in a single file:
+// a header, an array of entries then the 16 bytes aligned shader data
+// Loaded with a single mmap, nothing is compiled at runtime
+class ShaderPack
+{
+public:
+    static const uint32_t MAGIC = 0x4b505348; // "HSPK"
+    static const uint32_t VERSION = 1;
+    static const uint32_t MAX_NAME_LENGTH = 64;
+
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t entryCount;
+        uint32_t reserved;
+    };
+
+    struct Entry
+    {
+        char name[MAX_NAME_LENGTH]; // Source file name, "Default.vert"
+        uint32_t conversionType;    // ShaderCompiler::ConversionType
+        uint32_t stage;             // ShaderCompiler::ShaderStage
+        uint64_t offset;            // From the start of the file
+        uint64_t size;
+    };
+
+    ShaderPack();
+    ~ShaderPack();
+
+    // Returns 0 on success
+    int open(const char* path);
+
+    // Returns the entry compiled from name for conversionType, or nullptr
+    const Entry* find(const char* name, uint32_t conversionType) const;
+    const uint8_t* data(const Entry* entry) const;
+
+    // Writes an entry to a file atomically, left untouched if it already holds the same content
+    bool extract(const Entry* entry, const std::string& path) const;
+
+    const char* get_error() const { return m_error; }
+
+private:
+    std::unique_ptr<MappedFile> m_file;
+    const Header* m_header = nullptr;
+    const Entry* m_entries = nullptr;
+    const char* m_error = "";
+};
+
+#endif // SHADERPACK_H
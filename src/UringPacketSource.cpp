@@ -0,0 +1,255 @@
+#include "UringPacketSource.h"
+
+#include "FrameScheduler.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// O_DIRECT reads must be aligned in memory, file offset and length, 4k covers every common device
+#define URING_DIRECT_IO_ALIGNMENT 4096
+
+static inline int64_t alignDown(int64_t value)
+{
+    return value & ~(int64_t)(URING_DIRECT_IO_ALIGNMENT - 1);
+}
+
+static inline int64_t alignUp(int64_t value)
+{
+    return alignDown(value + URING_DIRECT_IO_ALIGNMENT - 1);
+}
+
+UringPacketSource::UringPacketSource(const PacketIndex& index, int streamIndex,
+                                     unsigned int bufferCount, unsigned int queueDepth)
+    :m_index(index),
+     m_streamIndex(streamIndex),
+     m_queueDepth(queueDepth > 0 ? queueDepth : 1),
+     m_buffers(bufferCount > m_queueDepth ? bufferCount : m_queueDepth + 1)
+{
+}
+
+UringPacketSource::~UringPacketSource()
+{
+    // Packets still using the buffers must have been freed
+    if (m_ringReady) {
+        drainReads();
+        io_uring_queue_exit(&m_ring);
+    }
+    for (Buffer& buffer : m_buffers)
+        free(buffer.data);
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+int UringPacketSource::open(const char* path)
+{
+    if (m_index.empty()) {
+        m_error = "Empty packet index";
+        return -1;
+    }
+
+    // Not every file system supports O_DIRECT, go through the page cache there
+    m_fd = ::open(path, O_RDONLY | O_DIRECT);
+    m_directIO = m_fd >= 0;
+    if (m_fd < 0)
+        m_fd = ::open(path, O_RDONLY);
+    if (m_fd < 0) {
+        m_error = "Could not open file";
+        return -1;
+    }
+    if (!m_directIO)
+        posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Room for the biggest packet once its start and end are aligned
+    m_bufferSize = alignUp(m_index.maxPacketSize()) + URING_DIRECT_IO_ALIGNMENT;
+    std::vector<iovec> iovecs(m_buffers.size());
+    for (size_t i = 0; i < m_buffers.size(); i++) {
+        Buffer& buffer = m_buffers[i];
+        buffer.owner = this;
+        if (posix_memalign(reinterpret_cast<void**>(&buffer.data), URING_DIRECT_IO_ALIGNMENT, m_bufferSize)) {
+            buffer.data = nullptr;
+            m_error = "Could not allocate read buffers";
+            return -1;
+        }
+        iovecs[i].iov_base = buffer.data;
+        iovecs[i].iov_len = m_bufferSize;
+    }
+
+    if (io_uring_queue_init(m_queueDepth, &m_ring, 0) < 0) {
+        m_error = "Could not create io_uring";
+        return -1;
+    }
+    m_ringReady = true;
+
+    // Registered buffers save pinning pages on every read, not available under a low RLIMIT_MEMLOCK
+    m_fixedBuffers = io_uring_register_buffers(&m_ring, iovecs.data(), (unsigned int)iovecs.size()) == 0;
+    return 0;
+}
+
+double UringPacketSource::throughputMBs() const
+{
+    double firstReadMs = m_firstReadMs;
+    if (firstReadMs == 0)
+        return 0;
+    double elapsedMs = FrameScheduler::nowMs() - firstReadMs;
+    if (elapsedMs <= 0)
+        return 0;
+    return m_bytesRead / (1024.0 * 1024.0) / (elapsedMs / 1000);
+}
+
+void UringPacketSource::releaseBuffer(void* opaque, uint8_t*)
+{
+    Buffer* buffer = static_cast<Buffer*>(opaque);
+    buffer->state.store(BUFFER_FREE, std::memory_order_release);
+}
+
+void UringPacketSource::submitReads()
+{
+    unsigned int submitted = 0;
+    while (m_nextSubmitEntry < m_index.size() && m_inFlight < m_queueDepth) {
+        Buffer& buffer = m_buffers[m_submitSequence % m_buffers.size()];
+        if (buffer.state.load(std::memory_order_acquire) != BUFFER_FREE)
+            break;
+
+        const PacketIndex::Entry& entry = m_index[m_nextSubmitEntry];
+        buffer.entry = m_nextSubmitEntry;
+        buffer.readOffset = alignDown(entry.pos);
+        buffer.readLength = (int)(alignUp(entry.pos + entry.size) - buffer.readOffset);
+        buffer.needed = (int)(entry.pos + entry.size - buffer.readOffset);
+        buffer.filled = 0;
+        if (!queueRead(buffer, 0))
+            break;
+        buffer.state.store(BUFFER_READING, std::memory_order_relaxed);
+
+        m_nextSubmitEntry++;
+        m_submitSequence++;
+        m_inFlight++;
+        submitted++;
+    }
+    if (submitted) {
+        if (m_firstReadMs == 0)
+            m_firstReadMs = FrameScheduler::nowMs();
+        io_uring_submit(&m_ring);
+    }
+}
+
+// Queues the read of a buffer from its byte start on, returns false when the submission queue is full
+bool UringPacketSource::queueRead(Buffer& buffer, int start)
+{
+    io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
+    if (!sqe)
+        return false;
+    buffer.readStart = start;
+    unsigned int bufferIndex = (unsigned int)(&buffer - m_buffers.data());
+    if (m_fixedBuffers)
+        io_uring_prep_read_fixed(sqe, m_fd, buffer.data + start, buffer.readLength - start, buffer.readOffset + start, bufferIndex);
+    else
+        io_uring_prep_read(sqe, m_fd, buffer.data + start, buffer.readLength - start, buffer.readOffset + start);
+    io_uring_sqe_set_data(sqe, &buffer);
+    return true;
+}
+
+int UringPacketSource::waitForCompletion()
+{
+    io_uring_cqe* cqe;
+    int res = io_uring_wait_cqe(&m_ring, &cqe);
+    if (res < 0)
+        return res;
+    Buffer* buffer = static_cast<Buffer*>(io_uring_cqe_get_data(cqe));
+    res = cqe->res;
+    io_uring_cqe_seen(&m_ring, cqe);
+    if (res > 0) {
+        m_bytesRead += res;
+        buffer->filled = buffer->readStart + res;
+        // Reads may come back short, read the rest of the packet (from an aligned offset with O_DIRECT)
+        // A read that can't make progress is the end of the file, left to readPacket to report
+        int start = m_directIO ? (int)alignDown(buffer->filled) : buffer->filled;
+        if (buffer->filled < buffer->needed && start > buffer->readStart && queueRead(*buffer, start)) {
+            io_uring_submit(&m_ring);
+            return 0;
+        }
+    }
+    buffer->result = res < 0 ? res : buffer->filled;
+    buffer->state.store(res < 0 ? BUFFER_FAILED : BUFFER_READY, std::memory_order_relaxed);
+    m_inFlight--;
+    return 0;
+}
+
+void UringPacketSource::drainReads()
+{
+    while (m_inFlight > 0) {
+        if (waitForCompletion() < 0)
+            break;
+    }
+}
+
+int UringPacketSource::readPacket(AVPacket* packet)
+{
+    if (m_nextReadEntry >= m_index.size())
+        return AVERROR_EOF;
+
+    submitReads();
+
+    Buffer& buffer = m_buffers[m_readSequence % m_buffers.size()];
+    if (m_readSequence == m_submitSequence) {
+        // The read could not be submitted, its buffer is still held by a packet
+        return AVERROR(EAGAIN);
+    }
+    while (buffer.state.load(std::memory_order_relaxed) == BUFFER_READING) {
+        int res = waitForCompletion();
+        if (res < 0)
+            return res;
+    }
+
+    const PacketIndex::Entry& entry = m_index[m_nextReadEntry];
+    int64_t skip = entry.pos - buffer.readOffset;
+    bool complete = buffer.state.load(std::memory_order_relaxed) == BUFFER_READY && buffer.result >= skip + entry.size;
+    int res = buffer.state.load(std::memory_order_relaxed) == BUFFER_FAILED ? buffer.result : AVERROR(EIO);
+    m_nextReadEntry++;
+    m_readSequence++;
+    if (!complete) {
+        buffer.state.store(BUFFER_FREE, std::memory_order_relaxed);
+        return res;
+    }
+
+    // The buffer comes back to the ring when the last reference to the packet is freed
+    buffer.state.store(BUFFER_HANDED_OUT, std::memory_order_relaxed);
+    packet->buf = av_buffer_create(buffer.data, m_bufferSize, &UringPacketSource::releaseBuffer, &buffer, AV_BUFFER_FLAG_READONLY);
+    if (!packet->buf) {
+        buffer.state.store(BUFFER_FREE, std::memory_order_relaxed);
+        return AVERROR(ENOMEM);
+    }
+    packet->data = buffer.data + skip;
+    packet->size = entry.size;
+    packet->pts = entry.pts;
+    packet->dts = entry.pts;
+    packet->duration = entry.duration;
+    packet->pos = entry.pos;
+    packet->stream_index = m_streamIndex;
+    packet->flags |= AV_PKT_FLAG_KEY;
+
+    // Keep the reads going while this packet is decoded
+    submitReads();
+    return 0;
+}
+
+int UringPacketSource::rewind()
+{
+    return seekToEntry(0);
+}
+
+int UringPacketSource::seekToEntry(size_t entry)
+{
+    if (entry >= m_index.size())
+        return AVERROR(EINVAL);
+    // Reads ahead of the playhead are thrown away
+    drainReads();
+    while (m_readSequence < m_submitSequence) {
+        m_buffers[m_readSequence % m_buffers.size()].state.store(BUFFER_FREE, std::memory_order_relaxed);
+        m_readSequence++;
+    }
+    m_nextSubmitEntry = entry;
+    m_nextReadEntry = entry;
+    return 0;
+}
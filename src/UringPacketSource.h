@@ -0,0 +1,108 @@
+#ifndef URINGPACKETSOURCE_H
+#define URINGPACKETSOURCE_H
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+}
+
+#include <liburing.h>
+
+#include <atomic>
+#include <vector>
+
+#include "HAPPacketSource.h"
+#include "PacketIndex.h"
+
+// Streams packets with io_uring reads bypassing the page cache (O_DIRECT when the file system allows it)
+// Reads run ahead of the playhead into a fixed ring of aligned buffers sized from the packet index,
+// packets point into these buffers and give them back to the ring once freed
+// Linux only
+class UringPacketSource : public HAPPacketSource
+{
+public:
+    // bufferCount must cover the demux queue plus the reads in flight
+    UringPacketSource(const PacketIndex& index, int streamIndex,
+                      unsigned int bufferCount, unsigned int queueDepth);
+    ~UringPacketSource() override;
+
+    UringPacketSource(const UringPacketSource&) = delete;
+    UringPacketSource& operator=(const UringPacketSource&) = delete;
+
+    // Returns 0 on success
+    int open(const char* path);
+
+    // Returns AVERROR(EAGAIN) while every buffer is still held by packets
+    int readPacket(AVPacket* packet) override;
+    int rewind() override;
+    int seekToEntry(size_t entry) override;
+
+    const char* get_error() const { return m_error; }
+    bool directIO() const { return m_directIO; }
+
+    // Metrics, can be read from any thread
+    size_t readsInFlight() const { return m_inFlight; }
+    size_t bytesRead() const { return m_bytesRead; }
+    // Average read throughput since the first read in MB/s
+    double throughputMBs() const;
+
+private:
+    enum BufferState
+    {
+        BUFFER_FREE,
+        BUFFER_READING,
+        BUFFER_READY,
+        BUFFER_FAILED,
+        BUFFER_HANDED_OUT
+    };
+
+    struct alignas(64) Buffer
+    {
+        UringPacketSource* owner;
+        uint8_t* data;
+        size_t entry;
+        int64_t readOffset;
+        int readLength;
+        // Bytes the packet needs from readOffset, bytes read so far and where the read in flight starts
+        int needed;
+        int filled;
+        int readStart;
+        int result;
+        std::atomic<int> state{BUFFER_FREE};
+    };
+
+    static void releaseBuffer(void* opaque, uint8_t* data);
+
+    void submitReads();
+    bool queueRead(Buffer& buffer, int start);
+    int waitForCompletion();
+    void drainReads();
+
+    const PacketIndex& m_index;
+    int m_streamIndex;
+    unsigned int m_queueDepth;
+
+    int m_fd = -1;
+    bool m_directIO = false;
+    bool m_ringReady = false;
+    bool m_fixedBuffers = false;
+    io_uring m_ring;
+
+    size_t m_bufferSize = 0;
+    std::vector<Buffer> m_buffers;
+
+    // Next entry to submit and next entry to hand out
+    size_t m_nextSubmitEntry = 0;
+    size_t m_nextReadEntry = 0;
+    // Buffers are used in ring order, the sequence numbers pick the buffer
+    size_t m_submitSequence = 0;
+    size_t m_readSequence = 0;
+
+    std::atomic<size_t> m_inFlight{0};
+    std::atomic<size_t> m_bytesRead{0};
+    std::atomic<double> m_firstReadMs{0};
+
+    const char* m_error = "";
+};
+
+#endif // URINGPACKETSOURCE_H
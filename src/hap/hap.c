@@ -47,6 +47,12 @@
 #define kHapFormatYCoCgDXT5 0xF
 #define kHapFormatARGTC1 0x1
 
+#if defined(_MSC_VER)
+    #define HAP_THREAD_LOCAL __declspec(thread)
+#else
+    #define HAP_THREAD_LOCAL __thread
+#endif
+
 /*
  Packed byte values for Hap
  
@@ -85,6 +91,18 @@ typedef struct HapChunkDecodeInfo {
     size_t compressed_chunk_size;
     char *uncompressed_chunk_data;
     size_t uncompressed_chunk_size;
+    /*
+     Only used when the output rows are not tightly packed: the chunk is written to output_buffer at output_offset,
+     counted in bytes of tightly packed output, one row of output_row_bytes every output_row_stride bytes
+     */
+    char *output_buffer;
+    size_t output_offset;
+    size_t output_row_bytes;
+    size_t output_row_stride;
+    /*
+     Only used when decoding to a sink: the chunk is handed to sink, starting output_offset bytes into the texture
+     */
+    const HapChunkSink *sink;
 } HapChunkDecodeInfo;
 
 // TODO: rename the defines we use for codes used in stored frames
@@ -558,11 +576,176 @@ unsigned int HapEncode(unsigned int count,
     }
 }
 
+// Returns the number of bytes spanned in a row-strided buffer by length bytes of tightly packed data
+static size_t hap_strided_length(size_t length, size_t row_bytes, size_t row_stride)
+{
+    if (length == 0)
+    {
+        return 0;
+    }
+    return (((length - 1) / row_bytes) * row_stride) + ((length - 1) % row_bytes) + 1;
+}
+
+// Copies length bytes of tightly packed data, starting at offset in the packed layout, into a row-strided buffer
+static void hap_write_strided(char *output_buffer, size_t row_bytes, size_t row_stride,
+                              size_t offset, const char *input, size_t length)
+{
+    while (length > 0)
+    {
+        size_t column = offset % row_bytes;
+        size_t count = row_bytes - column;
+        if (count > length)
+        {
+            count = length;
+        }
+        memcpy(output_buffer + ((offset / row_bytes) * row_stride) + column, input, count);
+        input += count;
+        offset += count;
+        length -= count;
+    }
+}
+
+/*
+ Scratch buffer of the calling thread, grown to the biggest chunk it decoded and kept for the next ones
+ Decode threads are expected to live as long as the process (a pool), the buffer is not freed when a thread exits
+ */
+static HAP_THREAD_LOCAL char *hap_thread_scratch = NULL;
+static HAP_THREAD_LOCAL size_t hap_thread_scratch_size = 0;
+
+static char *hap_get_thread_scratch(size_t length)
+{
+    if (hap_thread_scratch_size < length)
+    {
+        char *scratch = (char *)realloc(hap_thread_scratch, length);
+        if (scratch == NULL)
+        {
+            return NULL;
+        }
+        hap_thread_scratch = scratch;
+        hap_thread_scratch_size = length;
+    }
+    return hap_thread_scratch;
+}
+
+static void hap_decode_chunk_strided(HapChunkDecodeInfo *chunk)
+{
+    if (chunk->compressor == kHapCompressorSnappy)
+    {
+        /*
+         Snappy can only write contiguously, so decompress to a chunk-sized scratch buffer and scatter it to the rows
+         */
+        char *scratch = hap_get_thread_scratch(chunk->uncompressed_chunk_size);
+        snappy_status snappy_result;
+
+        if (scratch == NULL)
+        {
+            chunk->result = HapResult_Internal_Error;
+            return;
+        }
+
+        snappy_result = snappy_uncompress(chunk->compressed_chunk_data,
+                                          chunk->compressed_chunk_size,
+                                          scratch,
+                                          &chunk->uncompressed_chunk_size);
+
+        switch (snappy_result)
+        {
+            case SNAPPY_INVALID_INPUT:
+                chunk->result = HapResult_Bad_Frame;
+                break;
+            case SNAPPY_OK:
+                hap_write_strided(chunk->output_buffer, chunk->output_row_bytes, chunk->output_row_stride,
+                                  chunk->output_offset, scratch, chunk->uncompressed_chunk_size);
+                chunk->result = HapResult_No_Error;
+                break;
+            default:
+                chunk->result = HapResult_Internal_Error;
+                break;
+        }
+    }
+    else if (chunk->compressor == kHapCompressorNone)
+    {
+        hap_write_strided(chunk->output_buffer, chunk->output_row_bytes, chunk->output_row_stride,
+                          chunk->output_offset, chunk->compressed_chunk_data, chunk->compressed_chunk_size);
+        chunk->result = HapResult_No_Error;
+    }
+    else
+    {
+        chunk->result = HapResult_Bad_Frame;
+    }
+}
+
+static unsigned int hap_decode_to_sink(const HapChunkSink *sink, unsigned int compressor,
+                                       const char *compressed_data, size_t compressed_size,
+                                       size_t uncompressed_size, size_t offset)
+{
+    if (compressor == kHapCompressorSnappy)
+    {
+        /*
+         The sink provides the buffer so it can reuse one that stays in cache
+         */
+        char *buffer = (char *)sink->chunkBuffer(uncompressed_size, sink->info);
+        snappy_status snappy_result;
+
+        if (buffer == NULL)
+        {
+            return HapResult_Internal_Error;
+        }
+
+        snappy_result = snappy_uncompress(compressed_data, compressed_size, buffer, &uncompressed_size);
+
+        switch (snappy_result)
+        {
+            case SNAPPY_INVALID_INPUT:
+                return HapResult_Bad_Frame;
+            case SNAPPY_OK:
+                return sink->chunkDecoded(buffer, offset, uncompressed_size, sink->info);
+            default:
+                return HapResult_Internal_Error;
+        }
+    }
+    else if (compressor == kHapCompressorNone)
+    {
+        /*
+         Uncompressed data is handed over in place
+         */
+        return sink->chunkDecoded(compressed_data, offset, compressed_size, sink->info);
+    }
+    else
+    {
+        return HapResult_Bad_Frame;
+    }
+}
+
 static void hap_decode_chunk(HapChunkDecodeInfo chunks[], unsigned int index)
 {
     if (chunks)
     {
-        if (chunks[index].compressor == kHapCompressorSnappy)
+        if (chunks[index].sink != NULL
+            && chunks[index].sink->chunkWanted != NULL
+            && !chunks[index].sink->chunkWanted(chunks[index].output_offset,
+                                                chunks[index].uncompressed_chunk_size,
+                                                chunks[index].sink->info))
+        {
+            /*
+             The sink doesn't need this part of the texture, skip its decompression
+             */
+            chunks[index].result = HapResult_No_Error;
+        }
+        else if (chunks[index].sink != NULL)
+        {
+            chunks[index].result = hap_decode_to_sink(chunks[index].sink,
+                                                      chunks[index].compressor,
+                                                      chunks[index].compressed_chunk_data,
+                                                      chunks[index].compressed_chunk_size,
+                                                      chunks[index].uncompressed_chunk_size,
+                                                      chunks[index].output_offset);
+        }
+        else if (chunks[index].output_buffer != NULL)
+        {
+            hap_decode_chunk_strided(&chunks[index]);
+        }
+        else if (chunks[index].compressor == kHapCompressorSnappy)
         {
             snappy_status snappy_result = snappy_uncompress(chunks[index].compressed_chunk_data,
                                                             chunks[index].compressed_chunk_size,
@@ -596,10 +779,17 @@ static void hap_decode_chunk(HapChunkDecodeInfo chunks[], unsigned int index)
     }
 }
 
+/*
+ outputRowBytes and outputRowStride describe the layout of outputBuffer: when they differ, each row of outputRowBytes bytes
+ starts outputRowStride bytes after the previous one, otherwise the output is tightly packed
+ When sink is not NULL, decoded chunks are handed to it instead and outputBuffer is not used
+ */
 unsigned int hap_decode_single_texture(const void *texture_section, uint32_t texture_section_length,
                                        unsigned int texture_section_type,
                                        HapDecodeCallback callback, void *info,
                                        void *outputBuffer, unsigned long outputBufferBytes,
+                                       unsigned long outputRowBytes, unsigned long outputRowStride,
+                                       const HapChunkSink *sink,
                                        unsigned long *outputBufferBytesUsed,
                                        unsigned int *outputBufferTextureFormat)
 {
@@ -607,6 +797,7 @@ unsigned int hap_decode_single_texture(const void *texture_section, uint32_t tex
     unsigned int textureFormat;
     unsigned int compressor;
     size_t bytesUsed = 0;
+    int strided = (outputRowBytes != outputRowStride);
 
     /*
      One top-level section type describes texture-format and second-stage compression
@@ -772,11 +963,33 @@ unsigned int hap_decode_single_texture(const void *texture_section, uint32_t tex
                     chunk_info[i].uncompressed_chunk_size = chunk_info[i].compressed_chunk_size;
                 }
 
-                chunk_info[i].uncompressed_chunk_data = (char *)(((uint8_t *)outputBuffer) + running_uncompressed_chunk_size);
+                chunk_info[i].sink = sink;
+                if (sink)
+                {
+                    chunk_info[i].uncompressed_chunk_data = NULL;
+                    chunk_info[i].output_buffer = NULL;
+                    chunk_info[i].output_offset = running_uncompressed_chunk_size;
+                }
+                else if (strided)
+                {
+                    chunk_info[i].uncompressed_chunk_data = NULL;
+                    chunk_info[i].output_buffer = (char *)outputBuffer;
+                    chunk_info[i].output_offset = running_uncompressed_chunk_size;
+                    chunk_info[i].output_row_bytes = outputRowBytes;
+                    chunk_info[i].output_row_stride = outputRowStride;
+                }
+                else
+                {
+                    chunk_info[i].uncompressed_chunk_data = (char *)(((uint8_t *)outputBuffer) + running_uncompressed_chunk_size);
+                    chunk_info[i].output_buffer = NULL;
+                }
                 running_uncompressed_chunk_size += chunk_info[i].uncompressed_chunk_size;
             }
 
-            if (result == HapResult_No_Error && running_uncompressed_chunk_size > outputBufferBytes)
+            if (result == HapResult_No_Error
+                && sink == NULL
+                && (strided ? hap_strided_length(running_uncompressed_chunk_size, outputRowBytes, outputRowStride)
+                            : running_uncompressed_chunk_size) > outputBufferBytes)
             {
                 result = HapResult_Buffer_Too_Small;
             }
@@ -831,14 +1044,41 @@ unsigned int hap_decode_single_texture(const void *texture_section, uint32_t tex
         {
             return HapResult_Internal_Error;
         }
-        if (bytesUsed > outputBufferBytes)
+        if (sink)
         {
-            return HapResult_Buffer_Too_Small;
+            result = hap_decode_to_sink(sink, compressor, (const char *)texture_section, texture_section_length, bytesUsed, 0);
+            if (result != HapResult_No_Error)
+            {
+                return result;
+            }
         }
-        snappy_result = snappy_uncompress((const char *)texture_section, texture_section_length, (char *)outputBuffer, &bytesUsed);
-        if (snappy_result != SNAPPY_OK)
+        else
         {
-            return HapResult_Internal_Error;
+            if ((strided ? hap_strided_length(bytesUsed, outputRowBytes, outputRowStride) : bytesUsed) > outputBufferBytes)
+            {
+                return HapResult_Buffer_Too_Small;
+            }
+            if (strided)
+            {
+                char *scratch = hap_get_thread_scratch(bytesUsed);
+                if (scratch == NULL)
+                {
+                    return HapResult_Internal_Error;
+                }
+                snappy_result = snappy_uncompress((const char *)texture_section, texture_section_length, scratch, &bytesUsed);
+                if (snappy_result == SNAPPY_OK)
+                {
+                    hap_write_strided((char *)outputBuffer, outputRowBytes, outputRowStride, 0, scratch, bytesUsed);
+                }
+            }
+            else
+            {
+                snappy_result = snappy_uncompress((const char *)texture_section, texture_section_length, (char *)outputBuffer, &bytesUsed);
+            }
+            if (snappy_result != SNAPPY_OK)
+            {
+                return HapResult_Internal_Error;
+            }
         }
     }
     else if (compressor == kHapCompressorNone)
@@ -847,11 +1087,26 @@ unsigned int hap_decode_single_texture(const void *texture_section, uint32_t tex
          Only one section is present containing a single block of uncompressed texture data
          */
         bytesUsed = texture_section_length;
-        if (texture_section_length > outputBufferBytes)
+        if (sink)
+        {
+            result = hap_decode_to_sink(sink, compressor, (const char *)texture_section, texture_section_length, bytesUsed, 0);
+            if (result != HapResult_No_Error)
+            {
+                return result;
+            }
+        }
+        else if ((strided ? hap_strided_length(bytesUsed, outputRowBytes, outputRowStride) : bytesUsed) > outputBufferBytes)
         {
             return HapResult_Buffer_Too_Small;
         }
-        memcpy(outputBuffer, texture_section, texture_section_length);
+        else if (strided)
+        {
+            hap_write_strided((char *)outputBuffer, outputRowBytes, outputRowStride, 0, (const char *)texture_section, texture_section_length);
+        }
+        else
+        {
+            memcpy(outputBuffer, texture_section, texture_section_length);
+        }
     }
     else
     {
@@ -929,31 +1184,20 @@ int hap_get_section_at_index(const void *input_buffer, uint32_t input_buffer_byt
     }
 }
 
-unsigned int HapDecode(const void *inputBuffer, unsigned long inputBufferBytes,
-                       unsigned int index,
-                       HapDecodeCallback callback, void *info,
-                       void *outputBuffer, unsigned long outputBufferBytes,
-                       unsigned long *outputBufferBytesUsed,
-                       unsigned int *outputBufferTextureFormat)
+static unsigned int hap_decode_texture(const void *inputBuffer, unsigned long inputBufferBytes,
+                                       unsigned int index,
+                                       HapDecodeCallback callback, void *info,
+                                       void *outputBuffer, unsigned long outputBufferBytes,
+                                       unsigned long outputRowBytes, unsigned long outputRowStride,
+                                       const HapChunkSink *sink,
+                                       unsigned long *outputBufferBytesUsed,
+                                       unsigned int *outputBufferTextureFormat)
 {
     int result = HapResult_No_Error;
     const void *section;
     uint32_t section_length;
     unsigned int section_type;
 
-    /*
-     Check arguments
-     */
-    if (inputBuffer == NULL
-        || index > 1
-        || callback == NULL
-        || outputBuffer == NULL
-        || outputBufferTextureFormat == NULL
-        )
-    {
-        return HapResult_Bad_Arguments;
-    }
-
     /*
      Locate the section at the given index, which will either be the top-level section in a single texture image, or one of the
      sections inside a multi-image top-level section.
@@ -971,6 +1215,9 @@ unsigned int HapDecode(const void *inputBuffer, unsigned long inputBufferBytes,
                                            callback, info,
                                            outputBuffer,
                                            outputBufferBytes,
+                                           outputRowBytes,
+                                           outputRowStride,
+                                           sink,
                                            outputBufferBytesUsed,
                                            outputBufferTextureFormat);
     }
@@ -978,6 +1225,89 @@ unsigned int HapDecode(const void *inputBuffer, unsigned long inputBufferBytes,
     return result;
 }
 
+unsigned int HapDecodeWithRowStride(const void *inputBuffer, unsigned long inputBufferBytes,
+                       unsigned int index,
+                       HapDecodeCallback callback, void *info,
+                       void *outputBuffer, unsigned long outputBufferBytes,
+                       unsigned long outputRowBytes, unsigned long outputRowStride,
+                       unsigned long *outputBufferBytesUsed,
+                       unsigned int *outputBufferTextureFormat)
+{
+    /*
+     Check arguments
+     */
+    if (inputBuffer == NULL
+        || index > 1
+        || callback == NULL
+        || outputBuffer == NULL
+        || outputBufferTextureFormat == NULL
+        || (outputRowBytes != outputRowStride && (outputRowBytes == 0 || outputRowStride < outputRowBytes))
+        )
+    {
+        return HapResult_Bad_Arguments;
+    }
+
+    return hap_decode_texture(inputBuffer, inputBufferBytes,
+                              index,
+                              callback, info,
+                              outputBuffer, outputBufferBytes,
+                              outputRowBytes, outputRowStride,
+                              NULL,
+                              outputBufferBytesUsed,
+                              outputBufferTextureFormat);
+}
+
+unsigned int HapDecodeToSink(const void *inputBuffer, unsigned long inputBufferBytes,
+                             unsigned int index,
+                             HapDecodeCallback callback, void *info,
+                             const HapChunkSink *sink,
+                             unsigned long *outputBufferBytesUsed,
+                             unsigned int *outputBufferTextureFormat)
+{
+    /*
+     Check arguments
+     */
+    if (inputBuffer == NULL
+        || index > 1
+        || callback == NULL
+        || sink == NULL
+        || sink->chunkBuffer == NULL
+        || sink->chunkDecoded == NULL
+        || outputBufferTextureFormat == NULL
+        )
+    {
+        return HapResult_Bad_Arguments;
+    }
+
+    return hap_decode_texture(inputBuffer, inputBufferBytes,
+                              index,
+                              callback, info,
+                              NULL, 0,
+                              0, 0,
+                              sink,
+                              outputBufferBytesUsed,
+                              outputBufferTextureFormat);
+}
+
+unsigned int HapDecode(const void *inputBuffer, unsigned long inputBufferBytes,
+                       unsigned int index,
+                       HapDecodeCallback callback, void *info,
+                       void *outputBuffer, unsigned long outputBufferBytes,
+                       unsigned long *outputBufferBytesUsed,
+                       unsigned int *outputBufferTextureFormat)
+{
+    /*
+     A tightly packed output is a strided output where rows and stride match
+     */
+    return HapDecodeWithRowStride(inputBuffer, inputBufferBytes,
+                                  index,
+                                  callback, info,
+                                  outputBuffer, outputBufferBytes,
+                                  0, 0,
+                                  outputBufferBytesUsed,
+                                  outputBufferTextureFormat);
+}
+
 unsigned int HapGetFrameTextureCount(const void *inputBuffer, unsigned long inputBufferBytes, unsigned int *outputTextureCount)
 {
     int result;
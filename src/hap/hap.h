@@ -133,6 +133,57 @@ unsigned int HapDecode(const void *inputBuffer, unsigned long inputBufferBytes,
                        unsigned long *outputBufferBytesUsed,
                        unsigned int *outputBufferTextureFormat);
 
+/*
+ Decodes a texture from inputBuffer exactly like HapDecode, but writes it to a destination whose rows are not tightly packed,
+ such as a mapped texture upload buffer.
+
+ outputRowBytes is the length in bytes of one row of compressed blocks (four rows of pixels) and outputRowStride is the
+ distance in bytes between the start of two consecutive rows in outputBuffer. When both are equal, chunks are decompressed
+ straight into outputBuffer; otherwise every chunk (or the whole texture when it is not chunked) is decompressed into a
+ scratch buffer and copied row by row. That scratch buffer belongs to the decoding thread and is reused by its next
+ decodes, it is never freed.
+ outputBufferBytes must cover the strided destination. If outputBufferBytesUsed is not NULL then it will be set to the
+ decoded length of the texture, not counting row padding.
+ */
+unsigned int HapDecodeWithRowStride(const void *inputBuffer, unsigned long inputBufferBytes,
+                                    unsigned int index,
+                                    HapDecodeCallback callback, void *info,
+                                    void *outputBuffer, unsigned long outputBufferBytes,
+                                    unsigned long outputRowBytes, unsigned long outputRowStride,
+                                    unsigned long *outputBufferBytesUsed,
+                                    unsigned int *outputBufferTextureFormat);
+
+/*
+ Receives the chunks of a texture decoded by HapDecodeToSink, possibly from several threads at once.
+ chunkBuffer returns a buffer of at least length bytes for one chunk to be decompressed into, or NULL on failure.
+ chunkDecoded is then called with the decoded data of the chunk, which starts offset bytes into the texture; data is
+ only valid during the call and is either the buffer returned by chunkBuffer or the frame itself for uncompressed chunks.
+ chunkDecoded returns one of the HapResult values.
+ chunkWanted is optional: when it is not NULL it is called first with the offset and decoded length of each chunk of a
+ chunked texture, and chunks it returns 0 for are neither decompressed nor handed to chunkDecoded.
+ */
+typedef struct HapChunkSink {
+    void *(*chunkBuffer)(unsigned long length, void *info);
+    unsigned int (*chunkDecoded)(const void *data, unsigned long offset, unsigned long length, void *info);
+    void *info;
+    int (*chunkWanted)(unsigned long offset, unsigned long length, void *info);
+} HapChunkSink;
+
+/*
+ Decodes a texture from inputBuffer like HapDecode, but hands each chunk to sink as soon as it is decompressed instead of
+ writing the texture to an output buffer, so the chunk can be consumed while it is still in cache.
+ Chunks of a texture never overlap but are not guaranteed to hold whole compressed blocks: encoders split the texture
+ by bytes, so a chunk may start or end inside a block. A sink working on blocks must check that offset and length are
+ multiples of the block size and otherwise keep the chunk, or decode the texture again with HapDecode. The texture
+ format is known before decoding through HapGetFrameTextureFormat, and is also returned in outputBufferTextureFormat.
+ */
+unsigned int HapDecodeToSink(const void *inputBuffer, unsigned long inputBufferBytes,
+                             unsigned int index,
+                             HapDecodeCallback callback, void *info,
+                             const HapChunkSink *sink,
+                             unsigned long *outputBufferBytesUsed,
+                             unsigned int *outputBufferTextureFormat);
+
 /*
  If this returns HapResult_No_Error then outputTextureCount is set to the count of textures in the frame.
  */
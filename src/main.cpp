@@ -1,7 +1,25 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <thread>
+#include <vector>
 
 #include "HAPAvFormatForgeRenderer.h"
+#include "HAPAvFormatNullRenderer.h"
+#include "HAPAvFormatDemuxer.h"
+#include "HAPPacketSource.h"
+#include "HAPStreamEngine.h"
+#include "MappedFile.h"
+#include "PacketIndex.h"
+#ifdef HAVE_LIBURING
+    #include "UringPacketSource.h"
+#endif
+#include "FrameScheduler.h"
+#include "FrameTrace.h"
+#include "PlaybackMetrics.h"
 
 #ifdef __APPLE__
 #import <Cocoa/cocoa.h>
@@ -13,11 +31,24 @@
 using namespace std;
 using namespace std::chrono;
 
-static double currentMS()
-{
-    duration<double, milli> time_span = duration_cast<duration<double, milli>>(system_clock::now().time_since_epoch());
-    return time_span.count();
-}
+// Default demux queue budget, enough to ride out a few hundred ms of slow I/O
+#define DEFAULT_QUEUE_PACKETS 32
+#define DEFAULT_QUEUE_MB 512
+
+// Frames of the loop start kept in memory to cover the seek at the wrap
+#define DEFAULT_LOOP_CACHE_FRAMES 8
+
+// Reads kept in flight by the io_uring source
+#define DEFAULT_URING_QUEUE_DEPTH 8
+
+// Memory shared by the demux queues and decoded frames of all layers when playing several movies
+#define DEFAULT_LAYERS_MEMORY_MB 2048
+// Rate at which the layers are sampled and their statistics printed
+#define LAYERS_TICK_MS (1000.0 / 60.0)
+#define LAYERS_STATS_INTERVAL_MS 1000.0
+
+// A frame counts as late in the metrics when its rendering starts later than that after its presentation time
+#define METRICS_LATE_THRESHOLD_MS 1.0
 
 #ifdef __APPLE__
 
@@ -64,23 +95,335 @@ static inline bool handlePlatformEvents()
 }
 #endif
 
+// Prints the p50 / p99 / max latency of the stages that ran, when metrics are on
+static void printLatencies(FILE* output)
+{
+    PlaybackMetrics* metrics = PlaybackMetrics::active();
+    if (!metrics)
+        return;
+    const char* stageNames[FrameTrace::STAGE_COUNT] = { "demux", "decompress", "upload", "record", "submit", "present" };
+    PlaybackMetrics::Snapshot snapshot = metrics->snapshot();
+    fprintf(output, "Latency p50/p99/max (ms):");
+    for (int stage = 0; stage <= FrameTrace::STAGE_COUNT; stage++) {
+        bool gpu = stage == FrameTrace::STAGE_COUNT;
+        const PlaybackMetrics::LatencySummary& summary = gpu ? snapshot.gpu : snapshot.stages[stage];
+        if (summary.count)
+            fprintf(output, " %s %.2lf/%.2lf/%.2lf", gpu ? "gpu" : stageNames[stage], summary.p50Ms, summary.p99Ms, summary.maxMs);
+    }
+    fprintf(output, ", Presented: %lu, Dropped: %lu, Late: %lu\n", static_cast<unsigned long>(snapshot.presentedFrames),
+            static_cast<unsigned long>(snapshot.droppedFrames), static_cast<unsigned long>(snapshot.lateFrames));
+}
+
+// Decodes frames as fast as possible without window nor GPU, then prints throughput and latency
+// Stops at the end of the stream, or after maxFrames frames when the demuxer loops
+static void runBenchmark(HAPAvFormatDemuxer& demuxer, HAPAvFormatNullRenderer& renderer, size_t maxFrames)
+{
+    size_t frameCount = 0;
+    double startTimeMs = FrameScheduler::nowMs();
+    while (maxFrames == 0 || frameCount < maxFrames) {
+        FrameTrace* trace = FrameTrace::active();
+        if (trace)
+            trace->beginFrame();
+        AVPacket* packet;
+        {
+            FrameTrace::Scope traceDemux(FrameTrace::STAGE_DEMUX);
+            packet = demuxer.popPacket();
+        }
+        if (!packet) {
+            if (demuxer.finished())
+                break;
+            std::this_thread::yield();
+            continue;
+        }
+        renderer.renderFrame(packet, FrameScheduler::nowMs());
+        demuxer.releasePacket(packet);
+        if (trace)
+            trace->endFrame();
+        PlaybackMetrics* metrics = PlaybackMetrics::active();
+        if (metrics) {
+            metrics->onFramePresented(false);
+            metrics->setQueueState(demuxer.queueDepth(), demuxer.queuedBytes(), demuxer.starvationCount());
+        }
+        frameCount++;
+    }
+    double elapsedMs = FrameScheduler::nowMs() - startTimeMs;
+    if (demuxer.failed())
+        fprintf(stderr, "Benchmark stopped on read errors - %s.\n", demuxer.get_error().c_str());
+    renderer.printStats(stdout, elapsedMs);
+    printf("Demux queue starved %lu times\n", static_cast<unsigned long>(demuxer.starvationCount()));
+    printLatencies(stdout);
+}
+
+// Places the layers in a grid filling the window, or stacks them over the whole window with blendMode
+static void placeLayers(HAPAvFormatForgeRenderer& renderer, int layerCount, int width, int height, bool stack,
+                        HAPAvFormatForgeRenderer::BlendMode blendMode)
+{
+    int columns = (int)ceil(sqrt((double)layerCount));
+    int rows = (layerCount + columns - 1) / columns;
+    for (int layer = 0; layer < layerCount; layer++) {
+        HAPAvFormatForgeRenderer::LayerPlacement placement;
+        if (stack) {
+            // The bottom layer covers the cleared window
+            placement.blendMode = layer ? blendMode : HAPAvFormatForgeRenderer::BLEND_MODE_OVER;
+        } else {
+            placement.width = (float)width / columns;
+            placement.height = (float)height / rows;
+            placement.x = (layer % columns) * placement.width;
+            placement.y = (layer / columns) * placement.height;
+        }
+        renderer.setLayerPlacement(layer, placement);
+    }
+}
+
+// Plays every movie as a looping layer with its own clock, all layers sharing the decode pool and one memory budget
+// The layers are composited in one window, or only decoded when headless
+// Runs for durationSeconds, or forever when 0
+static int playLayers(const std::vector<char*>& filepaths, const HAPStreamEngine::LayerOptions& options,
+                      size_t memoryBytes, double durationSeconds, bool headless, bool stack,
+                      HAPAvFormatForgeRenderer::BlendMode blendMode)
+{
+    HAPStreamEngine engine(memoryBytes);
+    for (char* filepath : filepaths) {
+        if (engine.addLayer(filepath, options) < 0) {
+            fprintf(stderr, "Couldn't open layer %s - %s.\n", filepath, engine.get_error());
+            return -1;
+        }
+    }
+
+    std::unique_ptr<HAPAvFormatForgeRenderer> renderer;
+    if (!headless) {
+        // Window of the size of the first layer
+        const AVCodecParameters* firstCodecParams = engine.codecParams(0);
+        renderer.reset(new HAPAvFormatForgeRenderer());
+        if (renderer->initRenderer()
+                || renderer->openWindow("Simple ffmpeg player", firstCodecParams->width, firstCodecParams->height)
+                || renderer->createContext()) {
+            fprintf(stderr, "Could not set up the compositor - %s\n", renderer->get_error());
+            return -1;
+        }
+        for (size_t layer = 0; layer < engine.layerCount(); layer++) {
+            if (renderer->addLayer(engine.codecParams(layer)) < 0) {
+                fprintf(stderr, "Could not add layer %s - %s\n", filepaths[layer], renderer->get_error());
+                return -1;
+            }
+        }
+        placeLayers(*renderer, (int)engine.layerCount(), firstCodecParams->width, firstCodecParams->height,
+                    stack, blendMode);
+    }
+
+    if (engine.start()) {
+        fprintf(stderr, "Couldn't start layers - %s.\n", engine.get_error());
+        return -1;
+    }
+
+    // Draws the latest frame of every layer each tick
+    std::vector<HAPStreamEngine::Frame> frames(engine.layerCount());
+    double startTimeMs = FrameScheduler::nowMs();
+    double lastStatsTimeMs = startTimeMs;
+    bool shouldQuit = false;
+    while (!shouldQuit && (durationSeconds <= 0 || FrameScheduler::nowMs() - startTimeMs < durationSeconds * 1000.0)) {
+        // Keep the window responsive, closing it ends playback
+        if (renderer)
+            shouldQuit = handlePlatformEvents();
+        for (size_t layer = 0; layer < engine.layerCount(); layer++)
+            engine.acquireFrame(layer, frames[layer]);
+        FrameTrace* trace = FrameTrace::active();
+        if (renderer && trace) {
+            trace->beginFrame();
+            renderer->renderLayers(frames.data(), (int)frames.size(), FrameScheduler::nowMs());
+            trace->endFrame();
+        } else if (renderer)
+            renderer->renderLayers(frames.data(), (int)frames.size(), FrameScheduler::nowMs());
+        if (FrameScheduler::nowMs() > lastStatsTimeMs + LAYERS_STATS_INTERVAL_MS) {
+            lastStatsTimeMs = FrameScheduler::nowMs();
+            engine.printStats(stdout);
+            // Queues of all layers add up in the metrics
+            PlaybackMetrics* metrics = PlaybackMetrics::active();
+            if (metrics) {
+                HAPStreamEngine::LayerStats total;
+                for (size_t layer = 0; layer < engine.layerCount(); layer++) {
+                    HAPStreamEngine::LayerStats stats = engine.layerStats(layer);
+                    total.queuedPackets += stats.queuedPackets;
+                    total.queuedBytes += stats.queuedBytes;
+                    total.starvationCount += stats.starvationCount;
+                }
+                metrics->setQueueState(total.queuedPackets, total.queuedBytes, total.starvationCount);
+                printLatencies(stdout);
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(LAYERS_TICK_MS));
+    }
+    engine.stop();
+    engine.printStats(stdout);
+    return 0;
+}
 
 int main(int argc, char** argv)
 {
-    // Get file path to open
-    if (argc != 2) {
-        cout << "Requires exactly one parameter: the file path of the movie to playback";
+    // Get options and file path to open
+    char* filepath = nullptr;
+    std::vector<char*> filepaths;
+    size_t layersMemoryBytes = (size_t)DEFAULT_LAYERS_MEMORY_MB * 1024 * 1024;
+    double durationSeconds = 0;
+    bool stackLayers = false;
+    char* tracePath = nullptr;
+    char* metricsSocketPath = nullptr;
+    HAPAvFormatForgeRenderer::BlendMode layersBlendMode = HAPAvFormatForgeRenderer::BLEND_MODE_OVER;
+    size_t queuePackets = DEFAULT_QUEUE_PACKETS;
+    size_t queueBytes = (size_t)DEFAULT_QUEUE_MB * 1024 * 1024;
+    FrameScheduler::LatePolicy latePolicy = FrameScheduler::LATE_POLICY_DROP;
+    bool bench = false;
+    size_t benchFrames = 0;
+    HAPAvFormatNullRenderer::RGBAMode benchRGBAMode = HAPAvFormatNullRenderer::RGBA_NONE;
+    bool useMmap = false;
+    bool useUring = false;
+    int previewScale = 0;
+    bool hasPreviewRegion = false;
+    HapBlockDecoder::Region previewRegion = { 0, 0, 0, 0 };
+    long startFrame = -1;
+    double startTime = -1;
+    long loopIn = 0;
+    long loopOut = -1;
+    size_t loopCacheFrames = DEFAULT_LOOP_CACHE_FRAMES;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--queue-packets") && i + 1 < argc) {
+            queuePackets = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--queue-mb") && i + 1 < argc) {
+            queueBytes = strtoul(argv[++i], nullptr, 10) * 1024 * 1024;
+        } else if (!strcmp(argv[i], "--late-policy") && i + 1 < argc) {
+            i++;
+            if (!strcmp(argv[i], "present"))
+                latePolicy = FrameScheduler::LATE_POLICY_PRESENT;
+            else if (!strcmp(argv[i], "latest"))
+                latePolicy = FrameScheduler::LATE_POLICY_LATEST;
+            else if (!strcmp(argv[i], "drop"))
+                latePolicy = FrameScheduler::LATE_POLICY_DROP;
+            else {
+                filepath = nullptr;
+                break;
+            }
+        } else if (!strcmp(argv[i], "--bench")) {
+            bench = true;
+        } else if (!strcmp(argv[i], "--bench-frames") && i + 1 < argc) {
+            bench = true;
+            benchFrames = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--bench-rgba")) {
+            bench = true;
+            benchRGBAMode = HAPAvFormatNullRenderer::RGBA_FUSED;
+        } else if (!strcmp(argv[i], "--bench-rgba-separate")) {
+            bench = true;
+            benchRGBAMode = HAPAvFormatNullRenderer::RGBA_SEPARATE;
+        } else if (!strcmp(argv[i], "--mmap")) {
+            useMmap = true;
+        } else if (!strcmp(argv[i], "--uring")) {
+            useUring = true;
+        } else if (!strcmp(argv[i], "--start-frame") && i + 1 < argc) {
+            startFrame = strtol(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--start-time") && i + 1 < argc) {
+            startTime = strtod(argv[++i], nullptr);
+        } else if (!strcmp(argv[i], "--loop-in") && i + 1 < argc) {
+            loopIn = strtol(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--loop-out") && i + 1 < argc) {
+            loopOut = strtol(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--loop-cache") && i + 1 < argc) {
+            loopCacheFrames = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--layers-mb") && i + 1 < argc) {
+            layersMemoryBytes = strtoul(argv[++i], nullptr, 10) * 1024 * 1024;
+        } else if (!strcmp(argv[i], "--layer-blend") && i + 1 < argc) {
+            const char* blendModes[] = { "over", "add", "multiply", "screen" };
+            const char* blendMode = argv[++i];
+            stackLayers = true;
+            int mode = 0;
+            while (mode < HAPAvFormatForgeRenderer::BLEND_MODE_COUNT && strcmp(blendMode, blendModes[mode]))
+                mode++;
+            if (mode == HAPAvFormatForgeRenderer::BLEND_MODE_COUNT) {
+                filepath = nullptr;
+                break;
+            }
+            layersBlendMode = (HAPAvFormatForgeRenderer::BlendMode)mode;
+        } else if (!strcmp(argv[i], "--preview") && i + 1 < argc) {
+            previewScale = (int)strtol(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--preview-region") && i + 1 < argc) {
+            hasPreviewRegion = sscanf(argv[++i], "%d,%d,%d,%d", &previewRegion.x, &previewRegion.y,
+                                      &previewRegion.width, &previewRegion.height) == 4;
+            if (!hasPreviewRegion) {
+                filepath = nullptr;
+                break;
+            }
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (!strcmp(argv[i], "--metrics") && i + 1 < argc) {
+            metricsSocketPath = argv[++i];
+        } else if (!strcmp(argv[i], "--duration") && i + 1 < argc) {
+            durationSeconds = strtod(argv[++i], nullptr);
+        } else if (argv[i][0] != '-') {
+            filepaths.push_back(argv[i]);
+            filepath = filepaths[0];
+        } else {
+            filepath = nullptr;
+            break;
+        }
+    }
+    if (!filepath) {
+        cout << "Usage: " << argv[0] << " [--queue-packets count] [--queue-mb size] [--late-policy drop|present|latest] [--bench] [--bench-frames count] [--bench-rgba] [--bench-rgba-separate] [--mmap] [--uring] [--start-frame index] [--start-time seconds] [--loop-in index] [--loop-out index] [--loop-cache count] [--layers-mb size] [--layer-blend over|add|multiply|screen] [--duration seconds] [--preview 1|2|4] [--preview-region x,y,width,height] [--trace file] [--metrics socket] movie [movie...]\n";
+        cout << "Requires the file path of the movie to playback";
+        return -1;
+    }
+    if (filepaths.size() > 1 && (previewScale || hasPreviewRegion)) {
+        fprintf(stderr, "--preview and --preview-region only apply to a single movie.\n");
+        return -1;
+    }
+    // Layers always play their whole movie in a loop from a mapped or av_read_frame source
+    if (filepaths.size() > 1 && (useUring || startFrame >= 0 || startTime >= 0 || loopIn != 0 || loopOut >= 0 ||
+                                 loopCacheFrames != DEFAULT_LOOP_CACHE_FRAMES)) {
+        fprintf(stderr, "--uring, --start-frame, --start-time, --loop-in, --loop-out and --loop-cache only apply to a single movie.\n");
         return -1;
     }
-    char* filepath = argv[1];
 
     // Initialize AV Codec / Format
     #if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 9, 100)
         av_register_all();
     #endif
+    // Per frame stage timings go to a file written by a background thread
+    if (tracePath && FrameTrace::start(tracePath)) {
+        fprintf(stderr, "Couldn't start frame trace - %s.\n", FrameTrace::get_error());
+        return -1;
+    }
+    // Latency histograms and frame counters, served in the Prometheus format on a Unix socket
+    if (metricsSocketPath && PlaybackMetrics::start(metricsSocketPath)) {
+        fprintf(stderr, "Couldn't start metrics - %s.\n", PlaybackMetrics::get_error());
+        return -1;
+    }
+
     avformat_network_init();
+
+    // Several movies play as layers, each on its own clock
+    if (filepaths.size() > 1) {
+        HAPStreamEngine::LayerOptions layerOptions;
+        layerOptions.useMmap = useMmap;
+        layerOptions.queuePackets = queuePackets;
+        layerOptions.latePolicy = latePolicy;
+        int result = playLayers(filepaths, layerOptions, layersMemoryBytes, durationSeconds, bench, stackLayers,
+                                layersBlendMode);
+        FrameTrace::stop();
+        PlaybackMetrics::stop();
+        return result;
+    }
+
     AVFormatContext* pFormatCtx = avformat_alloc_context();
 
+    // Parse the container straight from a memory mapping of the file instead of the buffered file protocol
+    // Must outlive the format context and every packet
+    MappedFile mappedFile;
+    if (useMmap) {
+        if (mappedFile.open(filepath) || !mappedFile.ioContext()) {
+            fprintf(stderr, "Couldn't map input file: %s - %s.\n", filepath, mappedFile.get_error());
+            return -1;
+        }
+        pFormatCtx->pb = mappedFile.ioContext();
+        pFormatCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
     // Open file
     if(avformat_open_input(&pFormatCtx,filepath,NULL,NULL)!=0){
         fprintf(stderr, "Couldn't open input stream: %s.\n", filepath);
@@ -113,7 +456,34 @@ int main(int argc, char** argv)
     fprintf(stderr, "--------------- File Information ----------------\n");
     av_dump_format(pFormatCtx,0,filepath,0);
 
-    HAPAvFormatForgeRenderer hapAvFormatRenderer;
+    // A preview region alone is shown at full scale, the window takes the size of the preview
+    int windowWidth = pCodecParams->width;
+    int windowHeight = pCodecParams->height;
+    if (hasPreviewRegion && !previewScale)
+        previewScale = 1;
+    if (previewScale && !HapBlockDecoder::previewSize(pCodecParams->width, pCodecParams->height,
+                                                      hasPreviewRegion ? &previewRegion : nullptr, previewScale,
+                                                      windowWidth, windowHeight)) {
+        fprintf(stderr, "Invalid preview: scale must be 1, 2 or 4 and the region inside the %dx%d frame.\n",
+                pCodecParams->width, pCodecParams->height);
+        return -1;
+    }
+
+    // Headless benchmark decodes into RAM, otherwise render with The forge
+    std::unique_ptr<HAPAvFormatRenderer> renderer;
+    if (bench) {
+        HAPAvFormatNullRenderer* nullRenderer = new HAPAvFormatNullRenderer();
+        nullRenderer->setRGBAMode(benchRGBAMode);
+        if (previewScale)
+            nullRenderer->setPreview(previewScale, hasPreviewRegion ? &previewRegion : nullptr);
+        renderer.reset(nullRenderer);
+    } else {
+        HAPAvFormatForgeRenderer* forgeRenderer = new HAPAvFormatForgeRenderer();
+        if (previewScale)
+            forgeRenderer->setPreview(previewScale, hasPreviewRegion ? &previewRegion : nullptr);
+        renderer.reset(forgeRenderer);
+    }
+    HAPAvFormatRenderer& hapAvFormatRenderer = *renderer;
 
     // Initialize The forge renderer
     std::cout << "step 1" << std::endl;
@@ -125,8 +495,7 @@ int main(int argc, char** argv)
 
     // Open window as needed
     std::cout << "step 2" << std::endl;
-    if (hapAvFormatRenderer.openWindow("Simple ffmpeg player",
-                                       pCodecParams->width, pCodecParams->height))
+    if (hapAvFormatRenderer.openWindow("Simple ffmpeg player", windowWidth, windowHeight))
     {
         fprintf(stderr, "Could not open window - %s\n", hapAvFormatRenderer.get_error());
         return -1;
@@ -144,47 +513,172 @@ int main(int argc, char** argv)
     }
 
 
+    // Mapped files hand out packets pointing into the mapping, located with the container index
+    // io_uring streams the packets into its own buffers, bypassing the page cache
+    // Containers without an index are read through libavformat
+    // The index also gives frame accurate seeks and gapless loops. Scanning a file without one reads it whole,
+    // only done when a seek or loop option needs it, playback otherwise loops by seeking back to the start
+    PacketIndex packetIndex;
+    bool needsIndex = startFrame >= 0 || startTime >= 0 || loopIn != 0 || loopOut >= 0 ||
+                      loopCacheFrames != DEFAULT_LOOP_CACHE_FRAMES;
+    if (!packetIndex.buildFromContainer(pFormatCtx, videoindex) && needsIndex && !packetIndex.buildByScan(pFormatCtx, videoindex))
+        fprintf(stderr, "Couldn't index the video stream, seeking is disabled.\n");
+    bool hasPacketIndex = packetIndex.hasFileRanges();
+    std::unique_ptr<HAPPacketSource> packetSource;
+    #ifdef HAVE_LIBURING
+        UringPacketSource* uringSource = nullptr;
+        if (useUring && hasPacketIndex) {
+            // Enough buffers for a full demux queue, the frame being rendered and the reads in flight
+            size_t queuedPackets = queuePackets;
+            if (queueBytes > 0)
+                queuedPackets = std::min(queuedPackets, queueBytes / packetIndex.maxPacketSize() + 1);
+            uringSource = new UringPacketSource(packetIndex, videoindex,
+                                                (unsigned int)queuedPackets + 2 + DEFAULT_URING_QUEUE_DEPTH,
+                                                DEFAULT_URING_QUEUE_DEPTH);
+            packetSource.reset(uringSource);
+            if (uringSource->open(filepath)) {
+                fprintf(stderr, "Couldn't set up io_uring reads: %s.\n", uringSource->get_error());
+                return -1;
+            }
+            if (!uringSource->directIO())
+                fprintf(stderr, "O_DIRECT not supported for this file, io_uring reads go through the page cache.\n");
+        }
+    #else
+        if (useUring)
+            fprintf(stderr, "io_uring is not available in this build (Linux with liburing only), packets are read without it.\n");
+    #endif
+    if (!packetSource && useMmap && hasPacketIndex) {
+        packetSource.reset(new MappedPacketSource(mappedFile, packetIndex, videoindex));
+    } else if (!packetSource) {
+        if ((useMmap || useUring) && !hasPacketIndex)
+            fprintf(stderr, "No packet index in container, packets are copied by libavformat.\n");
+        packetSource.reset(new AvFormatPacketSource(pFormatCtx, videoindex, &packetIndex));
+    }
+
+    // Demux on its own thread, the packet source belongs to the demuxer until it is stopped
+    // The benchmark reads the file once unless asked for a number of frames
+    HAPAvFormatDemuxer demuxer(packetSource.get(), &packetIndex, queuePackets, queueBytes, !bench || benchFrames > 0);
+    if (!packetIndex.empty()) {
+        size_t lastFrame = packetIndex.size() - 1;
+        if (!demuxer.setLoopRange((size_t)loopIn, loopOut < 0 ? lastFrame : std::min((size_t)loopOut, lastFrame), loopCacheFrames))
+            fprintf(stderr, "Invalid loop range %ld - %ld, looping seeks back to the start.\n", loopIn, loopOut);
+    }
+    if (startFrame >= 0 && !demuxer.seekToFrame((size_t)startFrame))
+        fprintf(stderr, "Couldn't seek to frame %ld.\n", startFrame);
+    else if (startTime >= 0 && !demuxer.seekToTime(startTime))
+        fprintf(stderr, "Couldn't seek to %lf seconds.\n", startTime);
+    demuxer.start();
+
+    if (bench) {
+        runBenchmark(demuxer, static_cast<HAPAvFormatNullRenderer&>(hapAvFormatRenderer), benchFrames);
+        #ifdef HAVE_LIBURING
+            if (uringSource)
+                printf("io_uring reads: %.1lf MB/s, %lu in flight\n", uringSource->throughputMBs(),
+                       static_cast<unsigned long>(uringSource->readsInFlight()));
+        #endif
+        demuxer.stop();
+        avformat_close_input(&pFormatCtx);
+        FrameTrace::stop();
+        PlaybackMetrics::stop();
+        return 0;
+    }
+
+    // Present frames on the pts timeline of the stream
+    FrameScheduler scheduler(pFormatCtx->streams[videoindex]->time_base, latePolicy);
+
     // Loop playing back frames until user ask to close the window
-    AVPacket packet;
     bool shouldQuit = false;
-    double lastFrameTimeMs = currentMS();
+    int serial = demuxer.serial();
+    size_t presentedFrames = 0;
+    #ifdef LOG_RUNTIME_INFO
+        double lastDemuxLogTimeMs = FrameScheduler::nowMs();
+    #endif
     while (!shouldQuit) {
-        while (!shouldQuit && av_read_frame(pFormatCtx, &packet)>=0){
-            if(packet.stream_index==videoindex){
-                int64_t den = pFormatCtx->streams[packet.stream_index]->time_base.den;
-                int64_t num = pFormatCtx->streams[packet.stream_index]->time_base.num;
-                int64_t frameDuration = av_rescale(packet.duration, AV_TIME_BASE * num, den);
-
-                // Display new frame in openGL backbuffer
-                double preRender = currentMS();
-                hapAvFormatRenderer.renderFrame(&packet,lastFrameTimeMs);
-                double postRender = currentMS();
-                std::cout << "render took " << postRender - preRender << "ms\n";
-
-                // Keep showing previous frame depending on movie FPS (see frameDurationMs below)
-                double frameDurationMs = frameDuration / 1000.0;
-                double frameEndTimeMs = lastFrameTimeMs + frameDurationMs;
-
-                // Sleep until we reach frame end time
-                shouldQuit = handlePlatformEvents();
-                while (currentMS() < frameEndTimeMs) {
-                    std::this_thread::sleep_for(std::chrono::nanoseconds(300));
-                }
-                lastFrameTimeMs = frameEndTimeMs;
+        shouldQuit = handlePlatformEvents();
+        // A frame skipped below leaves its record unfinished, the next frame discards it
+        FrameTrace* trace = FrameTrace::active();
+        PlaybackMetrics* metrics = PlaybackMetrics::active();
+        if (trace)
+            trace->beginFrame();
+        AVPacket* packet;
+        {
+            FrameTrace::Scope traceDemux(FrameTrace::STAGE_DEMUX);
+            packet = demuxer.popPacket();
+        }
+        if (!packet) {
+            // The movie loops, the demuxer only finishes when reading fails
+            if (demuxer.finished())
+                break;
+            // Demuxer fell behind, keep the window alive while waiting
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            continue;
+        }
 
-                // Now swap OpenGL Backbuffer to front
-//                SDL_GL_SwapWindow(window);
-            }
-            av_packet_unref(&packet);
+        // First frame after a seek is shown right away
+        if (demuxer.serial() != serial) {
+            serial = demuxer.serial();
+            scheduler.restart();
         }
 
-        // Loop - seek back to first frame
-        av_seek_frame(pFormatCtx,-1,0,AVSEEK_FLAG_BACKWARD);
+        // Skip the frame if it is already too late to be shown, before spending any time decoding it
+        double presentationTimeMs = scheduler.presentationTimeMs(packet);
+        if (scheduler.shouldDrop(presentationTimeMs, demuxer.queueDepth() > 0)) {
+            demuxer.releasePacket(packet);
+            if (metrics)
+                metrics->onFrameDropped();
+            continue;
+        }
+
+        // Keep showing previous frame until this one is due
+        scheduler.waitUntil(presentationTimeMs);
+        bool late = FrameScheduler::nowMs() > presentationTimeMs + METRICS_LATE_THRESHOLD_MS;
+
+        // Display new frame in openGL backbuffer
+        hapAvFormatRenderer.renderFrame(packet,presentationTimeMs);
+        demuxer.releasePacket(packet);
+        presentedFrames++;
+        if (trace) {
+            trace->setPresentationTime(presentationTimeMs);
+            trace->endFrame();
+        }
+        if (metrics) {
+            metrics->onFramePresented(late);
+            metrics->setQueueState(demuxer.queueDepth(), demuxer.queuedBytes(), demuxer.starvationCount());
+        }
+
+        #ifdef LOG_RUNTIME_INFO
+            double nowMs = FrameScheduler::nowMs();
+            if (nowMs > lastDemuxLogTimeMs + 1000) {
+                lastDemuxLogTimeMs = nowMs;
+                printf("Demux queue: %lu packets, %lu bytes, starved %lu times, Dropped frames: %lu, Timeline rebases: %lu\n",
+                       static_cast<unsigned long>(demuxer.queueDepth()),
+                       static_cast<unsigned long>(demuxer.queuedBytes()),
+                       static_cast<unsigned long>(demuxer.starvationCount()),
+                       static_cast<unsigned long>(scheduler.droppedFrames()),
+                       static_cast<unsigned long>(scheduler.rebaseCount()));
+                #ifdef HAVE_LIBURING
+                    if (uringSource)
+                        printf("io_uring reads: %.1lf MB/s, %lu in flight\n", uringSource->throughputMBs(),
+                               static_cast<unsigned long>(uringSource->readsInFlight()));
+                #endif
+                printLatencies(stdout);
+            }
+        #endif
     }
 
+    if (demuxer.failed())
+        fprintf(stderr, "Playback stopped on read errors - %s.\n", demuxer.get_error().c_str());
+    printf("Presented %lu frames, dropped %lu late frames, timeline rebases: %lu\n",
+           static_cast<unsigned long>(presentedFrames),
+           static_cast<unsigned long>(scheduler.droppedFrames()),
+           static_cast<unsigned long>(scheduler.rebaseCount()));
+
     // Free resources - remark: should free OpenGL resources allocated in HAPAvFormatOpenGLRenderer
 //    SDL_Quit();
+    demuxer.stop();
     avformat_close_input(&pFormatCtx);
+    FrameTrace::stop();
+    PlaybackMetrics::stop();
 
     return 0;
 }
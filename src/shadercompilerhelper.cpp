@@ -1,48 +1,182 @@
 #include "shadercompilerhelper.h"
 
 #include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <vector>
 
+#ifdef _WIN32
+    #include <direct.h>
+#else
+    #include <sys/stat.h>
+#endif
+
+#include "AtomicFile.h"
 #include "Renderer/IResourceLoader.h"
 #include "OS/Interfaces/IFileSystem.h"
 
+// Bump when the compiler or the cache layout changes to invalidate existing entries
+#define SHADER_CACHE_VERSION 1
+
 ShaderCompilerHelper::ShaderCompilerHelper()
 {
 }
 
-bool ShaderCompilerHelper::transpileShader(const std::string& resourceFile,
-                                           const std::string& targetFile,
-                                           ShaderCompiler::Input& compilerInput)
+static bool readFile(const std::string& path, std::string& content)
 {
-    std::FILE *fp = std::fopen(resourceFile.c_str(), "rb");
+    std::FILE *fp = std::fopen(path.c_str(), "rb");
     if (!fp)
     {
         return false;
     }
     std::fseek(fp, 0, SEEK_END);
-    compilerInput.sourceCode.resize(std::ftell(fp));
+    long size = std::ftell(fp);
     std::rewind(fp);
-    std::fread(&(compilerInput.sourceCode[0]), 1, compilerInput.sourceCode.size(), fp);
+    content.resize(size > 0 ? size : 0);
+    bool success = size >= 0 && std::fread(&content[0], 1, content.size(), fp) == content.size();
     std::fclose(fp);
-    fp = nullptr;
+    return success;
+}
 
-    ShaderCompiler compiler;
-    ShaderCompiler::Result compileResult;
-    compileResult = compiler(compilerInput);
-    if (!compileResult.success)
+// Leaves the file untouched when it already holds content so its timestamp does not change
+static bool writeFileIfChanged(const std::string& path, const std::string& content)
+{
+    std::string previousContent;
+    if (readFile(path, previousContent) && previousContent == content)
     {
-        std::cout << "Compile Logs: " << compileResult.logs << std::endl;
-        std::cout << "Compile Errors: " << compileResult.errors << std::endl;
-        return false;
+        return true;
     }
-    fp = std::fopen(targetFile.c_str(), "wb");
-    if (!fp)
+    // Write aside then rename so a crash never leaves a truncated file behind
+    return writeFileAtomically(path, content.data(), content.size());
+}
+
+// 64 bit FNV-1a
+static void hashBytes(uint64_t& hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++)
     {
-        return false;
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
     }
-    std::fwrite(&(compileResult.outputCode[0]), 1, compileResult.outputCode.size(), fp);
-    std::fclose(fp);
-    return true;
+}
+
+template <typename T>
+static void hashValue(uint64_t& hash, const T& value)
+{
+    hashBytes(hash, &value, sizeof(value));
+}
+
+static void hashString(uint64_t& hash, const std::string& value)
+{
+    hashValue(hash, value.size());
+    hashBytes(hash, value.data(), value.size());
+}
+
+// Everything the compiler output depends on
+static uint64_t cacheKey(const ShaderCompiler::Input& input)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    hashValue(hash, (int)SHADER_CACHE_VERSION);
+    hashString(hash, input.sourceCode);
+    hashString(hash, input.entryPoint);
+    hashValue(hash, (int)input.stage);
+    hashValue(hash, (int)input.conversionType);
+    hashValue(hash, input.includeSpv);
+    hashValue(hash, input.optimize);
+    hashValue(hash, input.optimizeSize);
+    hashValue(hash, input.disassemble);
+    hashValue(hash, input.validate);
+    hashValue(hash, input.outputVersion);
+    hashValue(hash, input.useOpenglES);
+    return hash;
+}
+
+static std::string cachePath(uint64_t key)
+{
+    const char* cacheDirectory = fsGetResourceDirectory(RD_SHADER_BINARIES);
+    #ifdef _WIN32
+        _mkdir(cacheDirectory);
+    #else
+        mkdir(cacheDirectory, 0755);
+    #endif
+    char cacheFileName[32] = {0};
+    snprintf(cacheFileName, sizeof(cacheFileName), "%016llx.shadercache", (unsigned long long)key);
+    char c_cachePath[FS_MAX_PATH] = {0};
+    fsAppendPathComponent(cacheDirectory, cacheFileName, c_cachePath);
+    return c_cachePath;
+}
+
+bool ShaderCompilerHelper::compileShaders(const TranspileDesc* descriptions, const uint32_t count,
+                                          const ShaderCompiler::Input& input, std::vector<std::string>& outputs)
+{
+    m_cacheHits = 0;
+    m_cacheMisses = 0;
+
+    // Read every source and look it up in the cache
+    std::vector<ShaderCompiler::Input> inputs(count, input);
+    std::vector<std::string> cacheFiles(count);
+    std::vector<uint32_t> misses;
+    outputs.assign(count, std::string());
+    for (uint32_t i = 0; i < count; i++)
+    {
+        inputs[i].stage = descriptions[i].m_stage;
+        if (!readFile(descriptions[i].m_name, inputs[i].sourceCode))
+        {
+            std::cout << "Could not read shader " << descriptions[i].m_name << std::endl;
+            return false;
+        }
+        cacheFiles[i] = cachePath(cacheKey(inputs[i]));
+        if (readFile(cacheFiles[i], outputs[i]) && !outputs[i].empty())
+        {
+            m_cacheHits++;
+        }
+        else
+        {
+            misses.push_back(i);
+        }
+    }
+
+    // Compile the misses concurrently
+    std::vector<ShaderCompiler::Input> missInputs;
+    for (uint32_t i : misses)
+    {
+        missInputs.push_back(inputs[i]);
+    }
+    std::vector<ShaderCompiler::Result> missResults(misses.size());
+    ShaderCompiler::compileBatch(missInputs.data(), missResults.data(), (uint32_t)misses.size());
+
+    // Report and store in description order
+    bool success = true;
+    for (size_t m = 0; m < misses.size(); m++)
+    {
+        uint32_t i = misses[m];
+        const ShaderCompiler::Result& compileResult = missResults[m];
+        if (!compileResult.success)
+        {
+            std::cout << descriptions[i].m_name << std::endl;
+            std::cout << "Compile Logs: " << compileResult.logs << std::endl;
+            std::cout << "Compile Errors: " << compileResult.errors << std::endl;
+            success = false;
+            continue;
+        }
+        if (input.conversionType == ShaderCompiler::GLSL2SPV)
+        {
+            outputs[i].assign(reinterpret_cast<const char*>(compileResult.spirv.data()),
+                              compileResult.spirv.size() * sizeof(unsigned int));
+        }
+        else
+        {
+            outputs[i] = compileResult.outputCode;
+        }
+        m_cacheMisses++;
+        // A missing cache only costs the next start a compile
+        if (!writeFileIfChanged(cacheFiles[i], outputs[i]))
+        {
+            std::cout << "Could not write shader cache " << cacheFiles[i] << std::endl;
+        }
+    }
+    return success;
 }
 
 bool ShaderCompilerHelper::transpileShaders(const TranspileDesc* descriptions, const uint32_t count, const uint32_t rendererApi)
@@ -65,6 +199,13 @@ bool ShaderCompilerHelper::transpileShaders(const TranspileDesc* descriptions, c
     {
         input.conversionType = ShaderCompiler::GLSL2GLSL;
     }
+
+    std::vector<std::string> outputCodes;
+    if (!compileShaders(descriptions, count, input, outputCodes))
+    {
+        return false;
+    }
+
     for (uint32_t i = 0; i < count; i++)
     {
         const char *fileName = strrchr(descriptions[i].m_name.c_str(), '/');
@@ -78,14 +219,28 @@ bool ShaderCompilerHelper::transpileShaders(const TranspileDesc* descriptions, c
         {
             fsAppendPathExtension(c_fileOutput, fileSuffix.c_str(), c_fileOutput);
         }
-        std::string fileOutput = c_fileOutput;
-        input.stage = descriptions[i].m_stage;
-        if (!transpileShader(descriptions[i].m_name,
-                              fileOutput,
-                              input))
+        if (!writeFileIfChanged(c_fileOutput, outputCodes[i]))
         {
             return false;
         }
     }
     return true;
 }
+
+bool ShaderCompilerHelper::supportsMemoryShaders(const uint32_t rendererApi)
+{
+    return rendererApi == RENDERER_API_VULKAN;
+}
+
+bool ShaderCompilerHelper::transpileShadersToMemory(const TranspileDesc* descriptions, const uint32_t count,
+                                                    const uint32_t rendererApi, std::vector<std::string>& outputs)
+{
+    if (!supportsMemoryShaders(rendererApi))
+    {
+        return false;
+    }
+    // Vulkan takes SPIR-V byte code
+    ShaderCompiler::Input input;
+    input.conversionType = ShaderCompiler::GLSL2SPV;
+    return compileShaders(descriptions, count, input, outputs);
+}
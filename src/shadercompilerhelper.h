@@ -14,10 +14,27 @@ public:
         ShaderCompiler::ShaderStage m_stage;
     };
 
+    // Outputs are cached in RD_SHADER_BINARIES keyed by a hash of the source, stage, target and options,
+    // a warm start reads them back without running the compiler
+    // Cache misses are compiled concurrently, diagnostics are printed in description order
     bool transpileShaders(const TranspileDesc* descriptions, const uint32_t count, const uint32_t rendererApi = 0);
 
+    // Compiles to memory for renderer APIs that load shaders from a buffer (supportsMemoryShaders),
+    // outputs[i] is the byte code of descriptions[i], nothing is written to the shader directory
+    bool transpileShadersToMemory(const TranspileDesc* descriptions, const uint32_t count,
+                                  const uint32_t rendererApi, std::vector<std::string>& outputs);
+    static bool supportsMemoryShaders(const uint32_t rendererApi);
+
+    // Hit counts of the last transpile
+    uint32_t cacheHits() const { return m_cacheHits; }
+    uint32_t cacheMisses() const { return m_cacheMisses; }
+
 private:
-    bool transpileShader(const std::string&, const std::string&, ShaderCompiler::Input&);
+    bool compileShaders(const TranspileDesc* descriptions, const uint32_t count,
+                        const ShaderCompiler::Input& input, std::vector<std::string>& outputs);
+
+    uint32_t m_cacheHits = 0;
+    uint32_t m_cacheMisses = 0;
 };
 
 #endif // SHADERCOMPILERHELPER_H
@@ -0,0 +1,50 @@
+# Checks of the HAP decode paths that run without FFmpeg nor a GPU
+# Run it after building: HapDecodeTests, it prints each failed check and exits with their count
+TEMPLATE = app
+CONFIG += c++14 console
+CONFIG -= app_bundle
+CONFIG -= qt
+
+PROJECT_ROOT = $$PWD/../..
+
+INCLUDEPATH += \
+    $$PROJECT_ROOT/src
+
+HEADERS += \
+    $$PROJECT_ROOT/src/HapBlockDecoder.h \
+    $$PROJECT_ROOT/src/HapDecodePool.h \
+    $$PROJECT_ROOT/src/HapMTDecode.h \
+    $$PROJECT_ROOT/src/LatencyHistogram.h \
+    $$PROJECT_ROOT/src/hap/hap.h
+
+SOURCES += \
+    main.cpp \
+    $$PROJECT_ROOT/src/HapBlockDecoder.cpp \
+    $$PROJECT_ROOT/src/HapDecodePool.cpp \
+    $$PROJECT_ROOT/src/HapMTDecode.cpp \
+    $$PROJECT_ROOT/src/LatencyHistogram.cpp \
+    $$PROJECT_ROOT/src/hap/hap.c
+
+mac {
+    SNAPPY_PATH = $$PROJECT_ROOT/dependencies/Mac/x86_64/snappy
+    INCLUDEPATH += $${SNAPPY_PATH}/include
+    LIBS += $${SNAPPY_PATH}/lib/libsnappy.dylib
+}
+
+windows {
+    SNAPPY_PATH = $$PROJECT_ROOT/dependencies/Windows/x86_64/snappy
+    INCLUDEPATH += $${SNAPPY_PATH}/include
+    CONFIG(release, debug|release) {
+        LIBS += $${SNAPPY_PATH}/lib/snappy.lib
+    } else {
+        LIBS += $${SNAPPY_PATH}/lib/snappyd.lib
+    }
+}
+
+linux {
+    DEFINES += Linux
+    LIBS += -lsnappy -lpthread
+
+    # Same kernels as the player, the reference decoder of the checks is plain C++
+    contains(QMAKE_HOST.arch, x86_64): QMAKE_CXXFLAGS += -mssse3
+}
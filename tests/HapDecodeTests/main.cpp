@@ -0,0 +1,374 @@
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "HapBlockDecoder.h"
+#include "HapDecodePool.h"
+#include "HapMTDecode.h"
+#include "LatencyHistogram.h"
+#include "hap/hap.h"
+
+// Checks that the decode paths of the player agree with each other and with a plain reference decoder
+// Each failed check is printed, the exit code is the count of failures
+
+static int g_failures = 0;
+
+static void check(bool condition, const char* format, ...)
+{
+    if (condition)
+        return;
+    g_failures++;
+    va_list arguments;
+    va_start(arguments, format);
+    fprintf(stderr, "FAILED: ");
+    vfprintf(stderr, format, arguments);
+    fprintf(stderr, "\n");
+    va_end(arguments);
+}
+
+// Deterministic bytes, runs of repeated values so Snappy has something to compress
+static std::vector<uint8_t> makeBytes(size_t size, uint32_t seed)
+{
+    std::vector<uint8_t> bytes(size);
+    uint32_t state = seed * 2654435761u + 1;
+    for (size_t i = 0; i < size; i++) {
+        state = state * 1664525u + 1013904223u;
+        bytes[i] = (state >> 30) == 0 ? (uint8_t)(state >> 16) : (uint8_t)(i / 7);
+    }
+    return bytes;
+}
+
+static size_t blockBytes(unsigned int format)
+{
+    return format == HapTextureFormat_RGB_DXT1 || format == HapTextureFormat_A_RGTC1 ? 8 : 16;
+}
+
+static const char* formatName(unsigned int format)
+{
+    switch (format) {
+    case HapTextureFormat_RGB_DXT1: return "DXT1";
+    case HapTextureFormat_RGBA_DXT5: return "DXT5";
+    case HapTextureFormat_YCoCg_DXT5: return "YCoCg DXT5";
+    case HapTextureFormat_A_RGTC1: return "RGTC1";
+    }
+    return "unknown";
+}
+
+// Reference decoder, one pixel at a time straight from the DXT and RGTC specifications
+
+static void referenceColour(const uint8_t* block, bool allowThreeColours, int pixel, int rgb[3])
+{
+    int c0 = block[0] | (block[1] << 8);
+    int c1 = block[2] | (block[3] << 8);
+    int endpoints[2][3];
+    for (int e = 0; e < 2; e++) {
+        int c = e ? c1 : c0;
+        int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+        endpoints[e][0] = (r << 3) | (r >> 2);
+        endpoints[e][1] = (g << 2) | (g >> 4);
+        endpoints[e][2] = (b << 3) | (b >> 2);
+    }
+    int index = (block[4 + pixel / 4] >> (2 * (pixel % 4))) & 3;
+    for (int channel = 0; channel < 3; channel++) {
+        int a = endpoints[0][channel], b = endpoints[1][channel];
+        if (index < 2)
+            rgb[channel] = index ? b : a;
+        else if (c0 > c1 || !allowThreeColours)
+            rgb[channel] = index == 2 ? (2 * a + b) / 3 : (a + 2 * b) / 3;
+        else
+            rgb[channel] = index == 2 ? (a + b) / 2 : 0;
+    }
+}
+
+static int referenceAlpha(const uint8_t* block, int pixel)
+{
+    int a0 = block[0], a1 = block[1];
+    int bit = 3 * pixel;
+    int index = 0;
+    for (int i = 0; i < 3; i++, bit++)
+        index |= ((block[2 + bit / 8] >> (bit % 8)) & 1) << i;
+    if (index < 2)
+        return index ? a1 : a0;
+    if (a0 > a1)
+        return ((8 - index) * a0 + (index - 1) * a1) / 7;
+    if (index >= 6)
+        return index == 6 ? 0 : 255;
+    return ((6 - index) * a0 + (index - 1) * a1) / 5;
+}
+
+static int clampRound(float value)
+{
+    return (int)lrintf(std::fmin(std::fmax(value, 0.0f), 255.0f));
+}
+
+static void referencePixel(const HapBlockDecoder::Texture* textures, unsigned int textureCount, int width,
+                           int x, int y, uint8_t rgba[4])
+{
+    const size_t blockIndex = (size_t)(y / 4) * ((width + 3) / 4) + x / 4;
+    const int pixel = (y % 4) * 4 + x % 4;
+    const unsigned int format = textures[0].format;
+    const uint8_t* block = static_cast<const uint8_t*>(textures[0].data) + blockIndex * blockBytes(format);
+    int rgb[3] = { 0, 0, 0 };
+    int alpha = 255;
+    switch (format) {
+    case HapTextureFormat_RGB_DXT1:
+        referenceColour(block, true, pixel, rgb);
+        break;
+    case HapTextureFormat_RGBA_DXT5:
+        referenceColour(block + 8, false, pixel, rgb);
+        alpha = referenceAlpha(block, pixel);
+        break;
+    case HapTextureFormat_YCoCg_DXT5: {
+        // ScaledCoCgYToRGBA.frag: Co, Cg and the scale in the colour block, Y in the alpha block
+        int coCgScale[3];
+        referenceColour(block + 8, false, pixel, coCgScale);
+        float inverseScale = 8.0f / (float)(coCgScale[2] + 8);
+        float co = ((float)coCgScale[0] - 128.0f) * inverseScale;
+        float cg = ((float)coCgScale[1] - 128.0f) * inverseScale;
+        float luma = (float)referenceAlpha(block, pixel);
+        rgb[0] = clampRound(luma + co - cg);
+        rgb[1] = clampRound(luma + cg);
+        rgb[2] = clampRound(luma - co - cg);
+        break;
+    }
+    case HapTextureFormat_A_RGTC1:
+        alpha = referenceAlpha(block, pixel);
+        break;
+    }
+    if (textureCount == 2)
+        alpha = referenceAlpha(static_cast<const uint8_t*>(textures[1].data) + blockIndex * 8, pixel);
+    rgba[0] = (uint8_t)rgb[0];
+    rgba[1] = (uint8_t)rgb[1];
+    rgba[2] = (uint8_t)rgb[2];
+    rgba[3] = (uint8_t)alpha;
+}
+
+// Count of pixels differing from the reference, rows are rowBytes apart and the padding after them must be untouched
+static int countMismatches(const HapBlockDecoder::Texture* textures, unsigned int textureCount, int width, int height,
+                           const std::vector<uint8_t>& rgba, size_t rowBytes)
+{
+    int mismatches = 0;
+    for (int y = 0; y < height; y++) {
+        const uint8_t* row = &rgba[y * rowBytes];
+        for (int x = 0; x < width; x++) {
+            uint8_t expected[4];
+            referencePixel(textures, textureCount, width, x, y, expected);
+            if (memcmp(expected, row + x * 4, 4) != 0)
+                mismatches++;
+        }
+        for (size_t i = width * 4; i < rowBytes; i++)
+            if (row[i] != 0xCD)
+                mismatches++;
+    }
+    return mismatches;
+}
+
+struct Variant
+{
+    unsigned int textureCount;
+    unsigned int formats[2];
+};
+
+static const Variant g_variants[] = {
+    { 1, { HapTextureFormat_RGB_DXT1 } },
+    { 1, { HapTextureFormat_RGBA_DXT5 } },
+    { 1, { HapTextureFormat_YCoCg_DXT5 } },
+    { 1, { HapTextureFormat_A_RGTC1 } },
+    { 2, { HapTextureFormat_YCoCg_DXT5, HapTextureFormat_A_RGTC1 } },
+};
+
+// Frame sizes that aren't whole blocks exercise the edge blocks
+static const int g_sizes[][2] = { { 64, 48 }, { 70, 46 }, { 257, 131 } };
+
+// HapBlockDecoder::decode (SIMD kernels where the build has them) against the reference, on the caller and on a pool
+static void checkBlockDecoder(HapDecodePool& pool)
+{
+    for (const Variant& variant : g_variants) {
+        for (const auto& size : g_sizes) {
+            const int width = size[0], height = size[1];
+            const size_t blockCount = (size_t)((width + 3) / 4) * ((height + 3) / 4);
+            std::vector<uint8_t> blocks[2];
+            HapBlockDecoder::Texture textures[2];
+            for (unsigned int t = 0; t < variant.textureCount; t++) {
+                blocks[t] = makeBytes(blockBytes(variant.formats[t]) * blockCount, width + t);
+                textures[t] = { blocks[t].data(), blocks[t].size(), variant.formats[t] };
+            }
+            const size_t rowBytes = width * 4 + 12;
+            for (int threaded = 0; threaded < 2; threaded++) {
+                std::vector<uint8_t> rgba(rowBytes * height, 0xCD);
+                unsigned int result = HapBlockDecoder::decode(textures, variant.textureCount, width, height, rgba.data(), rowBytes,
+                                                              threaded ? &pool : nullptr);
+                check(result == HapResult_No_Error, "decode %s x%u %dx%d returned %u",
+                      formatName(variant.formats[0]), variant.textureCount, width, height, result);
+                int mismatches = countMismatches(textures, variant.textureCount, width, height, rgba, rowBytes);
+                check(mismatches == 0, "decode %s x%u %dx%d%s: %d pixels differ from the reference",
+                      formatName(variant.formats[0]), variant.textureCount, width, height, threaded ? " on a pool" : "", mismatches);
+            }
+        }
+    }
+}
+
+// HapBlockDecoder::decodeFrame, which decodes chunk by chunk, against HapDecode followed by HapBlockDecoder::decode
+static void checkFrameDecoder()
+{
+    const unsigned int chunkCounts[] = { 1, 5, 16 };
+    for (const Variant& variant : g_variants) {
+        for (const auto& size : g_sizes) {
+            for (unsigned int chunkCount : chunkCounts) {
+                for (unsigned int compressor : { (unsigned int)HapCompressorNone, (unsigned int)HapCompressorSnappy }) {
+                    const int width = size[0], height = size[1];
+                    const size_t blockCount = (size_t)((width + 3) / 4) * ((height + 3) / 4);
+                    std::vector<uint8_t> blocks[2];
+                    const void* inputs[2];
+                    unsigned long inputBytes[2];
+                    unsigned int formats[2], compressors[2], textureChunkCounts[2];
+                    for (unsigned int t = 0; t < variant.textureCount; t++) {
+                        blocks[t] = makeBytes(blockBytes(variant.formats[t]) * blockCount, chunkCount + t);
+                        inputs[t] = blocks[t].data();
+                        inputBytes[t] = blocks[t].size();
+                        formats[t] = variant.formats[t];
+                        compressors[t] = compressor;
+                        textureChunkCounts[t] = chunkCount;
+                    }
+                    std::vector<uint8_t> frame(HapMaxEncodedLength(variant.textureCount, inputBytes, formats, textureChunkCounts));
+                    unsigned long frameBytes = 0;
+                    if (HapEncode(variant.textureCount, inputs, inputBytes, formats, compressors, textureChunkCounts,
+                                  frame.data(), frame.size(), &frameBytes) != HapResult_No_Error) {
+                        check(false, "encode %s x%u %dx%d", formatName(variant.formats[0]), variant.textureCount, width, height);
+                        continue;
+                    }
+
+                    std::vector<uint8_t> decoded[2];
+                    HapBlockDecoder::Texture textures[2];
+                    for (unsigned int t = 0; t < variant.textureCount; t++) {
+                        decoded[t].resize(blocks[t].size());
+                        unsigned long bytesUsed = 0;
+                        unsigned int format = 0;
+                        unsigned int result = HapDecode(frame.data(), frameBytes, t, HapMTDecode, nullptr,
+                                                        decoded[t].data(), decoded[t].size(), &bytesUsed, &format);
+                        check(result == HapResult_No_Error && bytesUsed == blocks[t].size() && format == formats[t],
+                              "HapDecode texture %u of %s x%u", t, formatName(variant.formats[0]), variant.textureCount);
+                        textures[t] = { decoded[t].data(), decoded[t].size(), format };
+                    }
+
+                    const size_t rowBytes = width * 4 + 12;
+                    std::vector<uint8_t> expected(rowBytes * height, 0xCD), rgba(rowBytes * height, 0xCD);
+                    HapBlockDecoder::decode(textures, variant.textureCount, width, height, expected.data(), rowBytes);
+                    unsigned int result = HapBlockDecoder::decodeFrame(frame.data(), frameBytes, width, height, rgba.data(), rowBytes);
+                    check(result == HapResult_No_Error && rgba == expected,
+                          "decodeFrame %s x%u %dx%d, %u chunks, compressor %x differs from HapDecode + decode",
+                          formatName(variant.formats[0]), variant.textureCount, width, height, chunkCount, compressor);
+                }
+            }
+        }
+    }
+}
+
+static void decodeInOrder(HapDecodeWorkFunction function, void* p, unsigned int count, void* /*info*/)
+{
+    for (unsigned int i = 0; i < count; i++)
+        function(p, i);
+}
+
+// HapDecodeWithRowStride against HapDecode, rows padded the way a mapped upload buffer pads them
+static void checkStridedDecode()
+{
+    const unsigned int chunkCounts[] = { 1, 3, 7, 16 };
+    const HapDecodeCallback callbacks[] = { decodeInOrder, HapMTDecode };
+    const size_t rowBytes = 8 * 30, rows = 20, padding = 40, stride = rowBytes + padding;
+    const std::vector<uint8_t> texture = makeBytes(rowBytes * rows, 7);
+    for (unsigned int compressor : { (unsigned int)HapCompressorNone, (unsigned int)HapCompressorSnappy }) {
+        for (unsigned int chunkCount : chunkCounts) {
+            const void* input = texture.data();
+            unsigned long inputBytes = texture.size();
+            unsigned int format = HapTextureFormat_RGB_DXT1;
+            std::vector<uint8_t> frame(HapMaxEncodedLength(1, &inputBytes, &format, &chunkCount));
+            unsigned long frameBytes = 0;
+            if (HapEncode(1, &input, &inputBytes, &format, &compressor, &chunkCount, frame.data(), frame.size(), &frameBytes)
+                    != HapResult_No_Error) {
+                check(false, "encode %u chunks, compressor %x", chunkCount, compressor);
+                continue;
+            }
+
+            std::vector<uint8_t> packed(texture.size());
+            unsigned long bytesUsed = 0;
+            unsigned int outputFormat = 0;
+            unsigned int result = HapDecode(frame.data(), frameBytes, 0, decodeInOrder, nullptr, packed.data(), packed.size(),
+                                            &bytesUsed, &outputFormat);
+            check(result == HapResult_No_Error && packed == texture, "HapDecode %u chunks, compressor %x", chunkCount, compressor);
+
+            for (HapDecodeCallback callback : callbacks) {
+                const char* callbackName = callback == HapMTDecode ? "HapMTDecode" : "in order";
+                // The last row needs no padding after it
+                std::vector<uint8_t> strided(stride * rows, 0xCD);
+                result = HapDecodeWithRowStride(frame.data(), frameBytes, 0, callback, nullptr, strided.data(), stride * rows - padding,
+                                                rowBytes, stride, &bytesUsed, &outputFormat);
+                bool same = result == HapResult_No_Error && bytesUsed == texture.size() && outputFormat == format;
+                for (size_t row = 0; row < rows; row++) {
+                    same = same && memcmp(&strided[row * stride], &packed[row * rowBytes], rowBytes) == 0;
+                    for (size_t i = rowBytes; i < stride; i++)
+                        same = same && strided[row * stride + i] == 0xCD;
+                }
+                check(same, "HapDecodeWithRowStride %u chunks, compressor %x, %s differs from HapDecode",
+                      chunkCount, compressor, callbackName);
+
+                result = HapDecodeWithRowStride(frame.data(), frameBytes, 0, callback, nullptr, strided.data(), stride * rows - padding - 1,
+                                                rowBytes, stride, &bytesUsed, &outputFormat);
+                check(result == HapResult_Buffer_Too_Small, "HapDecodeWithRowStride %u chunks, compressor %x, %s accepted a short buffer",
+                      chunkCount, compressor, callbackName);
+            }
+        }
+    }
+}
+
+// Quantiles report the highest value of their bucket, never above the maximum recorded
+static void checkLatencyHistogram()
+{
+    LatencyHistogram histogram;
+    check(histogram.quantileMs(0.5) == 0, "empty histogram quantile");
+
+    // Exact below 32us
+    for (int us = 0; us < 32; us++)
+        histogram.record(us / 1000.0);
+    check(histogram.quantileMs(0.5) == 0.015, "linear buckets p50 %.3lf", histogram.quantileMs(0.5));
+    check(histogram.quantileMs(1.0) == 0.031 && histogram.maxMs() == 0.031, "linear buckets max");
+
+    // 32us and 33us share the first bucket of 2us, 34us starts the next one
+    histogram.reset();
+    histogram.record(0.032);
+    histogram.record(0.050);
+    check(histogram.quantileMs(0.5) == 0.033, "bucket of 32us ends at %.3lf", histogram.quantileMs(0.5));
+    histogram.reset();
+    histogram.record(0.034);
+    histogram.record(0.050);
+    check(histogram.quantileMs(0.5) == 0.035, "bucket of 34us ends at %.3lf", histogram.quantileMs(0.5));
+
+    // 1 to 100 ms: quantiles within the 6.25% error, and the maximum exact
+    histogram.reset();
+    for (int ms = 1; ms <= 100; ms++)
+        histogram.record(ms);
+    check(histogram.count() == 100 && histogram.sumMs() == 5050, "count and sum");
+    const double quantiles[] = { 0.5, 0.9, 0.99 };
+    for (double quantile : quantiles) {
+        double expected = std::ceil(quantile * 100);
+        double value = histogram.quantileMs(quantile);
+        check(value >= expected && value <= expected * 1.0625, "p%g is %.3lf ms for %g ms", quantile * 100, value, expected);
+    }
+    check(histogram.quantileMs(1.0) == 100 && histogram.maxMs() == 100, "p100 is %.3lf ms", histogram.quantileMs(1.0));
+}
+
+int main(int /*argc*/, char** /*argv*/)
+{
+    HapDecodePool pool(2, false);
+
+    checkBlockDecoder(pool);
+    checkFrameDecoder();
+    checkStridedDecode();
+    checkLatencyHistogram();
+
+    printf("Block kernels: %s, %d failed checks\n", HapBlockDecoder::instructionSet(), g_failures);
+    return g_failures;
+}
@@ -0,0 +1,42 @@
+# Precompiles the shaders of the player into a shader pack
+# Run it from the project root: ShaderPackTool [-o shaders/shaders.pack] [shaders]
+TEMPLATE = app
+CONFIG += c++14 console
+CONFIG -= app_bundle
+CONFIG -= qt
+
+PROJECT_ROOT = $$PWD/../..
+
+macos {
+    GLSLANG_BASE_FOLDER = $$PROJECT_ROOT/glslang/osx
+}
+windows {
+    GLSLANG_BASE_FOLDER = $$PROJECT_ROOT/glslang/windows
+}
+
+include($$PROJECT_ROOT/Shadercompiler.pri)
+
+# SPIRV-Cross comes with The Forge
+THE_FORGE_ROOT = $$PROJECT_ROOT/The-Forge
+SPIRV_CROSS_PATH = $$THE_FORGE_ROOT/Common_3/ThirdParty/OpenSource/SPIRV_Cross
+INCLUDEPATH += \
+    $$THE_FORGE_ROOT/Common_3 \
+    $$PROJECT_ROOT \
+    $$PROJECT_ROOT/src
+
+HEADERS += \
+    $$PROJECT_ROOT/src/ShaderPack.h
+
+SOURCES += \
+    main.cpp \
+    $$SPIRV_CROSS_PATH/spirv_cfg.cpp \
+    $$SPIRV_CROSS_PATH/spirv_cross.cpp \
+    $$SPIRV_CROSS_PATH/spirv_cross_parsed_ir.cpp \
+    $$SPIRV_CROSS_PATH/spirv_glsl.cpp \
+    $$SPIRV_CROSS_PATH/spirv_hlsl.cpp \
+    $$SPIRV_CROSS_PATH/spirv_msl.cpp \
+    $$SPIRV_CROSS_PATH/spirv_parser.cpp
+
+linux {
+    LIBS += -lpthread
+}
@@ -0,0 +1,315 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <dirent.h>
+#endif
+
+#include "shadercompiler.h"
+#include "ShaderPack.h"
+
+// Precompiles every shader of a directory for every target language into a single shader pack
+// The player built with CONFIG+=shader_pack loads the pack instead of compiling at runtime
+
+struct Target
+{
+    const char* name;
+    ShaderCompiler::ConversionType conversionType;
+    const char* entryPoint;
+};
+
+// Sources are GLSL, the HLSL2X conversions don't apply
+static const Target g_targets[] = {
+    { "GLSL", ShaderCompiler::GLSL2GLSL, "main" },
+    { "MSL", ShaderCompiler::GLSL2MSL, "stageMain" },
+    { "HLSL", ShaderCompiler::GLSL2HLSL, "main" },
+    { "SPIR-V", ShaderCompiler::GLSL2SPV, "main" },
+};
+
+struct ShaderFile
+{
+    std::string path;
+    std::string name;
+    ShaderCompiler::ShaderStage stage;
+};
+
+static double nowMs()
+{
+    using namespace std::chrono;
+    return duration_cast<duration<double, std::milli>>(steady_clock::now().time_since_epoch()).count();
+}
+
+static std::vector<ShaderCompiler::Target> compilerTargets()
+{
+    std::vector<ShaderCompiler::Target> targets;
+    for (const Target& target : g_targets) {
+        ShaderCompiler::Target compilerTarget;
+        compilerTarget.conversionType = target.conversionType;
+        compilerTarget.entryPoint = target.entryPoint;
+        targets.push_back(compilerTarget);
+    }
+    return targets;
+}
+
+// The first input of each shader, compileTargetsBatch compiles it for every target
+static std::vector<ShaderCompiler::Input> inputsPerShader(const std::vector<ShaderCompiler::Input>& inputs)
+{
+    const size_t targetCount = sizeof(g_targets) / sizeof(g_targets[0]);
+    std::vector<ShaderCompiler::Input> shaderInputs;
+    for (size_t i = 0; i < inputs.size(); i += targetCount)
+        shaderInputs.push_back(inputs[i]);
+    return shaderInputs;
+}
+
+static bool stageFromExtension(const std::string& name, ShaderCompiler::ShaderStage& stage)
+{
+    struct Extension { const char* extension; ShaderCompiler::ShaderStage stage; };
+    const Extension extensions[] = {
+        { ".vert", ShaderCompiler::STAGE_VERTEX },
+        { ".tesc", ShaderCompiler::STAGE_TESSCONTROL },
+        { ".tese", ShaderCompiler::STAGE_TESSEVALUATION },
+        { ".geom", ShaderCompiler::STAGE_GEOMETRY },
+        { ".frag", ShaderCompiler::STAGE_FRAGMENT },
+        { ".comp", ShaderCompiler::STAGE_COMPUTE },
+    };
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos)
+        return false;
+    for (const Extension& extension : extensions) {
+        if (name.compare(dot, std::string::npos, extension.extension) == 0) {
+            stage = extension.stage;
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::vector<ShaderFile> listShaders(const std::string& directory)
+{
+    std::vector<std::string> names;
+    #ifdef _WIN32
+        WIN32_FIND_DATAA findData;
+        HANDLE find = FindFirstFileA((directory + "\\*").c_str(), &findData);
+        if (find != INVALID_HANDLE_VALUE) {
+            do {
+                names.push_back(findData.cFileName);
+            } while (FindNextFileA(find, &findData));
+            FindClose(find);
+        }
+    #else
+        DIR* dir = opendir(directory.c_str());
+        if (dir) {
+            while (dirent* entry = readdir(dir))
+                names.push_back(entry->d_name);
+            closedir(dir);
+        }
+    #endif
+    // Same pack whatever the directory order
+    std::sort(names.begin(), names.end());
+
+    std::vector<ShaderFile> shaders;
+    for (const std::string& name : names) {
+        ShaderFile shader;
+        if (!stageFromExtension(name, shader.stage))
+            continue;
+        shader.name = name;
+        shader.path = directory + "/" + name;
+        shaders.push_back(shader);
+    }
+    return shaders;
+}
+
+static bool readFile(const std::string& path, std::string& content)
+{
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp)
+        return false;
+    fseek(fp, 0, SEEK_END);
+    content.resize(ftell(fp));
+    rewind(fp);
+    bool success = fread(&content[0], 1, content.size(), fp) == content.size();
+    fclose(fp);
+    return success;
+}
+
+static bool buildInputs(const std::vector<ShaderFile>& shaders, std::vector<ShaderCompiler::Input>& inputs)
+{
+    for (const ShaderFile& shader : shaders) {
+        ShaderCompiler::Input input;
+        input.stage = shader.stage;
+        if (!readFile(shader.path, input.sourceCode)) {
+            fprintf(stderr, "Couldn't read %s\n", shader.path.c_str());
+            return false;
+        }
+        for (const Target& target : g_targets) {
+            input.conversionType = target.conversionType;
+            input.entryPoint = target.entryPoint;
+            inputs.push_back(input);
+        }
+    }
+    return true;
+}
+
+static int writePack(const char* outputPath, const std::vector<ShaderFile>& shaders,
+                     const std::vector<ShaderCompiler::Input>& inputs, const std::vector<ShaderCompiler::Result>& results)
+{
+    const size_t targetCount = sizeof(g_targets) / sizeof(g_targets[0]);
+    std::vector<ShaderPack::Entry> entries(inputs.size());
+    std::vector<const void*> payloads(inputs.size());
+    uint64_t offset = sizeof(ShaderPack::Header) + entries.size() * sizeof(ShaderPack::Entry);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        const ShaderFile& shader = shaders[i / targetCount];
+        if (shader.name.size() >= ShaderPack::MAX_NAME_LENGTH) {
+            fprintf(stderr, "Shader name too long: %s\n", shader.name.c_str());
+            return -1;
+        }
+        ShaderPack::Entry& entry = entries[i];
+        memset(&entry, 0, sizeof(entry));
+        strcpy(entry.name, shader.name.c_str());
+        entry.conversionType = inputs[i].conversionType;
+        entry.stage = inputs[i].stage;
+        // SPIR-V words must stay aligned
+        offset = (offset + 15) & ~(uint64_t)15;
+        entry.offset = offset;
+        if (inputs[i].conversionType == ShaderCompiler::GLSL2SPV) {
+            entry.size = results[i].spirv.size() * sizeof(unsigned int);
+            payloads[i] = results[i].spirv.data();
+        } else {
+            entry.size = results[i].outputCode.size();
+            payloads[i] = results[i].outputCode.data();
+        }
+        offset += entry.size;
+    }
+
+    FILE* fp = fopen(outputPath, "wb");
+    if (!fp) {
+        fprintf(stderr, "Couldn't write %s\n", outputPath);
+        return -1;
+    }
+    ShaderPack::Header header = { ShaderPack::MAGIC, ShaderPack::VERSION, (uint32_t)entries.size(), 0 };
+    bool success = fwrite(&header, sizeof(header), 1, fp) == 1;
+    success = success && (entries.empty() || fwrite(entries.data(), sizeof(ShaderPack::Entry), entries.size(), fp) == entries.size());
+    const char padding[16] = {0};
+    uint64_t position = sizeof(ShaderPack::Header) + entries.size() * sizeof(ShaderPack::Entry);
+    for (size_t i = 0; i < entries.size() && success; i++) {
+        success = entries[i].offset == position || fwrite(padding, 1, entries[i].offset - position, fp) == entries[i].offset - position;
+        success = success && fwrite(payloads[i], 1, entries[i].size, fp) == entries[i].size;
+        position = entries[i].offset + entries[i].size;
+    }
+    success = fclose(fp) == 0 && success;
+    if (!success) {
+        fprintf(stderr, "Couldn't write %s\n", outputPath);
+        return -1;
+    }
+    printf("Packed %lu shaders in %s (%lu bytes)\n", static_cast<unsigned long>(entries.size()), outputPath, static_cast<unsigned long>(position));
+    return 0;
+}
+
+// Times the shader compiles, for every target language
+// The first compile pays for the glslang built-in symbol tables, which every compile used to pay before they were kept for the process lifetime
+static int runBenchmark(const std::vector<ShaderFile>& shaders, const std::vector<ShaderCompiler::Input>& inputs, size_t iterations)
+{
+    const size_t targetCount = sizeof(g_targets) / sizeof(g_targets[0]);
+    ShaderCompiler compiler;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        double startMs = nowMs();
+        ShaderCompiler::Result result = compiler(inputs[i]);
+        double coldMs = nowMs() - startMs;
+        if (!result.success) {
+            fprintf(stderr, "Couldn't compile %s to %s: %s%s\n", shaders[i / targetCount].path.c_str(), g_targets[i % targetCount].name,
+                    result.logs.c_str(), result.errors.c_str());
+            return -1;
+        }
+        if (i == 0)
+            printf("First compile (initializes glslang): %.3lf ms\n", coldMs);
+        startMs = nowMs();
+        for (size_t j = 0; j < iterations; j++)
+            compiler(inputs[i]);
+        double warmMs = iterations > 0 ? (nowMs() - startMs) / iterations : 0;
+        printf("%s -> %s: %.3lf ms per compile\n", shaders[i / targetCount].path.c_str(), g_targets[i % targetCount].name, warmMs);
+    }
+
+    // Whole shader set, on one thread then on all of them
+    std::vector<ShaderCompiler::Result> results(inputs.size());
+    unsigned int threadCounts[] = { 1, 0 };
+    for (unsigned int threadCount : threadCounts) {
+        double startMs = nowMs();
+        for (size_t i = 0; i < std::max<size_t>(iterations, 1); i++)
+            ShaderCompiler::compileBatch(inputs.data(), results.data(), (unsigned int)inputs.size(), threadCount);
+        double batchMs = (nowMs() - startMs) / std::max<size_t>(iterations, 1);
+        printf("Batch of %lu compiles on %u threads: %.3lf ms\n", static_cast<unsigned long>(inputs.size()),
+               threadCount ? threadCount : std::max(1u, std::thread::hardware_concurrency()), batchMs);
+    }
+
+    // Whole shader set, one front end pass per shader, shaders spread over all threads
+    std::vector<ShaderCompiler::Target> targets = compilerTargets();
+    std::vector<ShaderCompiler::Input> shaderInputs = inputsPerShader(inputs);
+    double startMs = nowMs();
+    for (size_t i = 0; i < std::max<size_t>(iterations, 1); i++)
+        ShaderCompiler::compileTargetsBatch(shaderInputs.data(), (unsigned int)shaderInputs.size(), targets.data(),
+                                            (unsigned int)targets.size(), results.data());
+    double targetsMs = (nowMs() - startMs) / std::max<size_t>(iterations, 1);
+    printf("Shared front end, %lu back ends per shader: %.3lf ms\n", static_cast<unsigned long>(targetCount), targetsMs);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    const char* outputPath = "shaders/shaders.pack";
+    const char* directory = "shaders";
+    long benchIterations = -1;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else if (!strcmp(argv[i], "--bench") && i + 1 < argc) {
+            benchIterations = strtol(argv[++i], nullptr, 10);
+        } else if (argv[i][0] != '-') {
+            directory = argv[i];
+        } else {
+            printf("Usage: %s [-o pack] [--bench iterations] [shader directory]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    std::vector<ShaderFile> shaders = listShaders(directory);
+    if (shaders.empty()) {
+        fprintf(stderr, "No shader found in %s\n", directory);
+        return -1;
+    }
+    std::vector<ShaderCompiler::Input> inputs;
+    if (!buildInputs(shaders, inputs))
+        return -1;
+
+    if (benchIterations >= 0)
+        return runBenchmark(shaders, inputs, (size_t)benchIterations);
+
+    // Shaders are compiled in parallel, each going through the front end once then through every back end
+    const size_t targetCount = sizeof(g_targets) / sizeof(g_targets[0]);
+    std::vector<ShaderCompiler::Target> targets = compilerTargets();
+    std::vector<ShaderCompiler::Input> shaderInputs = inputsPerShader(inputs);
+    std::vector<ShaderCompiler::Result> results(inputs.size());
+    ShaderCompiler::compileTargetsBatch(shaderInputs.data(), (unsigned int)shaderInputs.size(), targets.data(),
+                                        (unsigned int)targets.size(), results.data());
+
+    // Diagnostics in input order
+    bool success = true;
+    for (size_t i = 0; i < results.size(); i++) {
+        if (!results[i].success) {
+            fprintf(stderr, "Couldn't compile %s to %s\nCompile Logs: %s\nCompile Errors: %s\n",
+                    shaders[i / targetCount].path.c_str(), g_targets[i % targetCount].name,
+                    results[i].logs.c_str(), results[i].errors.c_str());
+            success = false;
+        }
+    }
+    if (!success)
+        return -1;
+    return writePack(outputPath, shaders, inputs, results);
+}